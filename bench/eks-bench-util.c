@@ -0,0 +1,167 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+/* Setting up a private session bus on which the service can be activated,
+ * and summing up the latencies measured on it, for the benchmarks */
+
+#include "eks-bench-util.h"
+
+#include <errno.h>
+
+gchar *
+eks_bench_absolute_path (const gchar *path)
+{
+  g_autofree gchar *cwd = NULL;
+
+  if (g_path_is_absolute (path))
+    return g_strdup (path);
+
+  cwd = g_get_current_dir ();
+  return g_build_filename (cwd, path, NULL);
+}
+
+gboolean
+eks_bench_make_directory (const gchar  *path,
+                          GError      **error)
+{
+  if (g_mkdir_with_parents (path, 0700) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Could not create %s: %s", path, g_strerror (errsv));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * eks_bench_serve_content:
+ * @root: the temporary directory of the benchmark
+ * @content_dir: the data directory of an installed app
+ * @app_ids: the ids of the simulated apps
+ * @error: return location for a #GError
+ *
+ * Lays out a data directory under @root in which every simulated app has
+ * the content of the given app, and puts it first in the data directories
+ * of the service. The service inherits the environment of the bus daemon,
+ * which must be started after this.
+ *
+ * Returns: %TRUE if the content was laid out
+ */
+gboolean
+eks_bench_serve_content (const gchar  *root,
+                         const gchar  *content_dir,
+                         GPtrArray    *app_ids,
+                         GError      **error)
+{
+  g_autofree gchar *share_dir = g_build_filename (root, "share", NULL);
+  g_autofree gchar *data_dir = g_build_filename (share_dir, "ekn", "data", NULL);
+  g_autofree gchar *target = eks_bench_absolute_path (content_dir);
+  g_autofree gchar *data_dirs = NULL;
+  const gchar *system_data_dirs = g_getenv ("XDG_DATA_DIRS");
+
+  if (!eks_bench_make_directory (data_dir, error))
+    return FALSE;
+
+  for (guint i = 0; i < app_ids->len; ++i)
+    {
+      g_autofree gchar *app_dir = g_build_filename (data_dir,
+                                                    g_ptr_array_index (app_ids, i),
+                                                    NULL);
+      g_autoptr(GFile) app_link = g_file_new_for_path (app_dir);
+
+      if (!g_file_make_symbolic_link (app_link, target, NULL, error))
+        return FALSE;
+    }
+
+  if (system_data_dirs == NULL)
+    system_data_dirs = "/usr/local/share:/usr/share";
+  data_dirs = g_strjoin (":", share_dir, system_data_dirs, NULL);
+  g_setenv ("XDG_DATA_DIRS", data_dirs, TRUE);
+
+  return TRUE;
+}
+
+/**
+ * eks_bench_write_service_file:
+ * @root: the temporary directory of the benchmark
+ * @service_path: the absolute path of the service binary
+ * @error: return location for a #GError
+ *
+ * Writes a D-Bus service file which activates @service_path, in a services
+ * directory under @root.
+ *
+ * Returns: (transfer full): the path of the services directory, to add to
+ *   the bus, or %NULL on error
+ */
+gchar *
+eks_bench_write_service_file (const gchar  *root,
+                              const gchar  *service_path,
+                              GError      **error)
+{
+  g_autofree gchar *services_dir = g_build_filename (root, "services", NULL);
+  g_autofree gchar *path = g_build_filename (services_dir,
+                                             SERVICE_BUS_NAME ".service",
+                                             NULL);
+  g_autofree gchar *contents = g_strdup_printf ("[D-BUS Service]\n"
+                                                "Name=" SERVICE_BUS_NAME "\n"
+                                                "Exec=%s\n",
+                                                service_path);
+
+  if (!eks_bench_make_directory (services_dir, error) ||
+      !g_file_set_contents (path, contents, -1, error))
+    return NULL;
+
+  return g_steal_pointer (&services_dir);
+}
+
+/* Symbolic links are removed without following them, so that the content
+ * of the app they point to is left alone */
+void
+eks_bench_remove_recursively (GFile *file)
+{
+  g_autoptr(GFileEnumerator) enumerator = NULL;
+
+  if (g_file_query_file_type (file, G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS, NULL) == G_FILE_TYPE_DIRECTORY)
+    enumerator = g_file_enumerate_children (file,
+                                            G_FILE_ATTRIBUTE_STANDARD_NAME,
+                                            G_FILE_QUERY_INFO_NOFOLLOW_SYMLINKS,
+                                            NULL,
+                                            NULL);
+
+  if (enumerator != NULL)
+    {
+      GFileInfo *info;
+      GFile *child;
+
+      while (g_file_enumerator_iterate (enumerator, &info, &child, NULL, NULL) &&
+             info != NULL)
+        eks_bench_remove_recursively (child);
+    }
+
+  g_file_delete (file, NULL, NULL);
+}
+
+gint
+eks_bench_compare_latencies (gconstpointer a,
+                             gconstpointer b)
+{
+  gint64 latency_a = *(const gint64 *) a;
+  gint64 latency_b = *(const gint64 *) b;
+
+  return (latency_a > latency_b) - (latency_a < latency_b);
+}
+
+/* Nearest-rank percentile of sorted latencies, in milliseconds */
+gdouble
+eks_bench_percentile (GArray *sorted,
+                      guint   percent)
+{
+  guint rank;
+
+  if (sorted->len == 0)
+    return 0;
+
+  rank = (sorted->len * percent + 99) / 100;
+  return g_array_index (sorted, gint64, MAX (rank, 1) - 1) / 1000.0;
+}
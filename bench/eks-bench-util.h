@@ -0,0 +1,34 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+#define SERVICE_BUS_NAME "com.endlessm.EknServices4.SearchProviderV4"
+#define SERVICE_OBJECT_PATH "/com/endlessm/EknServices4/SearchProviderV4"
+
+gchar * eks_bench_absolute_path (const gchar *path);
+
+gboolean eks_bench_make_directory (const gchar  *path,
+                                   GError      **error);
+
+gboolean eks_bench_serve_content (const gchar  *root,
+                                  const gchar  *content_dir,
+                                  GPtrArray    *app_ids,
+                                  GError      **error);
+
+gchar * eks_bench_write_service_file (const gchar  *root,
+                                      const gchar  *service_path,
+                                      GError      **error);
+
+void eks_bench_remove_recursively (GFile *file);
+
+gint eks_bench_compare_latencies (gconstpointer a,
+                                  gconstpointer b);
+
+gdouble eks_bench_percentile (GArray *sorted,
+                              guint   percent);
+
+G_END_DECLS
@@ -0,0 +1,589 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+/* Puts the search provider service under a repeatable load: starts it on a
+ * private session bus, makes many simulated apps available to it, replays
+ * a mix of method calls at a target rate from several clients, and reports
+ * the throughput and latency percentiles of each kind of call. */
+
+#include <gio/gio.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "eks-bench-util.h"
+#include "eks-bus-label.h"
+
+/* How often calls are sent, in order to keep up with the target rate */
+#define TICK_INTERVAL_MS 5
+/* How long to wait for outstanding replies once the run is over */
+#define DRAIN_TIMEOUT_SECONDS 30
+#define CALL_TIMEOUT_MS (60 * 1000)
+
+typedef enum {
+  CALL_SEARCH,
+  CALL_METADATA,
+  CALL_FEED,
+  N_CALL_KINDS
+} CallKind;
+
+static const gchar *call_kind_names[N_CALL_KINDS] = {
+  "search",
+  "metadata",
+  "feed",
+};
+
+static const gchar *search_words[] = {
+  "history", "animal", "water", "music", "science", "art", "city", "war",
+  "sport", "food", "planet", "king", "river", "language", "film", "game",
+  "mountain", "ocean", "computer", "health", "bird", "forest", "energy",
+  "religion", "space", "car", "book", "island", "plant", "school",
+};
+
+static const gchar *content_tags[] = {
+  "EknArticleObject",
+  "EknVideoObject",
+  "EknSetObject",
+};
+
+typedef struct {
+  const gchar *interface_name;
+  const gchar *method_name;
+} FeedMethod;
+
+static const FeedMethod feed_methods[] = {
+  { "com.endlessm.DiscoveryFeedContent", "ArticleCardDescriptions" },
+  { "com.endlessm.DiscoveryFeedArtwork", "ArtworkCardDescriptions" },
+  { "com.endlessm.DiscoveryFeedQuote", "GetQuoteOfTheDay" },
+  { "com.endlessm.DiscoveryFeedWord", "GetWordOfTheDay" },
+  { "com.endlessm.DiscoveryFeedNews", "GetRecentNews" },
+  { "com.endlessm.DiscoveryFeedVideo", "GetVideos" },
+};
+
+typedef struct {
+  GMainLoop *loop;
+  GRand *rand;
+
+  guint weights[N_CALL_KINDS];
+  guint total_weight;
+  gdouble rate;
+  guint duration;
+
+  // Array of object path strings, one for each simulated app
+  GPtrArray *app_paths;
+  // Array of GDBusConnection, one for each simulated client
+  GPtrArray *clients;
+
+  gint64 start_time;
+  gint64 end_time;
+  guint64 n_sent;
+  guint n_in_flight;
+  gboolean sending;
+
+  // Arrays of gint64 latencies in microseconds, one for each CallKind
+  GArray *latencies[N_CALL_KINDS];
+  guint64 errors[N_CALL_KINDS];
+} LoadGenerator;
+
+typedef struct {
+  LoadGenerator *generator;
+  CallKind kind;
+  gint64 start_time;
+} PendingCall;
+
+static gchar *opt_service = NULL;
+static gchar *opt_content = NULL;
+static gchar *opt_mix = NULL;
+static gint opt_apps = 50;
+static gint opt_clients = 8;
+static gdouble opt_rate = 100;
+static gint opt_duration = 30;
+static gint opt_seed = 0;
+
+static GOptionEntry options[] = {
+  { "service", 0, 0, G_OPTION_ARG_FILENAME, &opt_service,
+    "Path of the eks-search-provider-v4 binary to run", "PATH" },
+  { "content", 0, 0, G_OPTION_ARG_FILENAME, &opt_content,
+    "Data directory of an installed app, to serve as the content of every simulated app", "DIR" },
+  { "apps", 0, 0, G_OPTION_ARG_INT, &opt_apps,
+    "Number of simulated apps (default: 50)", "N" },
+  { "clients", 0, 0, G_OPTION_ARG_INT, &opt_clients,
+    "Number of simulated clients, each with its own connection (default: 8)", "N" },
+  { "rate", 0, 0, G_OPTION_ARG_DOUBLE, &opt_rate,
+    "Target number of calls per second (default: 100)", "RATE" },
+  { "duration", 0, 0, G_OPTION_ARG_INT, &opt_duration,
+    "Number of seconds to send calls for (default: 30)", "SECONDS" },
+  { "mix", 0, 0, G_OPTION_ARG_STRING, &opt_mix,
+    "Relative weights of the kinds of call (default: search=60,metadata=30,feed=10)", "MIX" },
+  { "seed", 0, 0, G_OPTION_ARG_INT, &opt_seed,
+    "Seed for choosing calls, for repeatable runs (default: 0)", "SEED" },
+  { NULL }
+};
+
+static gboolean
+parse_mix (const gchar    *mix,
+           LoadGenerator  *generator,
+           GError        **error)
+{
+  g_auto(GStrv) parts = g_strsplit (mix, ",", -1);
+
+  memset (generator->weights, 0, sizeof (generator->weights));
+  generator->total_weight = 0;
+
+  for (GStrv part = parts; *part != NULL; ++part)
+    {
+      g_auto(GStrv) key_value = g_strsplit (*part, "=", 2);
+      guint kind;
+      guint64 weight;
+
+      for (kind = 0; kind < N_CALL_KINDS; ++kind)
+        if (g_strcmp0 (key_value[0], call_kind_names[kind]) == 0)
+          break;
+
+      if (kind == N_CALL_KINDS || key_value[1] == NULL ||
+          !g_ascii_string_to_unsigned (key_value[1], 10, 0, G_MAXUINT16, &weight, NULL))
+        {
+          g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                       "Invalid call mix entry \"%s\"", *part);
+          return FALSE;
+        }
+
+      generator->weights[kind] = weight;
+    }
+
+  for (guint kind = 0; kind < N_CALL_KINDS; ++kind)
+    generator->total_weight += generator->weights[kind];
+
+  if (generator->total_weight == 0)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "The call mix has no calls in it");
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+static const gchar *
+random_word (LoadGenerator *generator)
+{
+  return search_words[g_rand_int_range (generator->rand, 0, G_N_ELEMENTS (search_words))];
+}
+
+static CallKind
+choose_call_kind (LoadGenerator *generator)
+{
+  guint n = g_rand_int_range (generator->rand, 0, generator->total_weight);
+
+  for (guint kind = 0; kind < N_CALL_KINDS; ++kind)
+    {
+      if (n < generator->weights[kind])
+        return kind;
+      n -= generator->weights[kind];
+    }
+
+  g_assert_not_reached ();
+}
+
+static GVariant *
+build_search_parameters (LoadGenerator *generator)
+{
+  g_auto(GVariantBuilder) builder;
+  guint n_terms = g_rand_int_range (generator->rand, 1, 3);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+  for (guint i = 0; i < n_terms; ++i)
+    g_variant_builder_add (&builder, "s", random_word (generator));
+
+  return g_variant_new ("(@as)", g_variant_builder_end (&builder));
+}
+
+/* Either a search or a page of one kind of content, like the pages of
+ * a knowledge app */
+static GVariant *
+build_metadata_parameters (LoadGenerator *generator)
+{
+  g_auto(GVariantBuilder) builder;
+  g_auto(GVariantDict) query;
+
+  g_variant_dict_init (&query, NULL);
+
+  if (g_rand_boolean (generator->rand))
+    {
+      g_variant_dict_insert (&query, "search-terms", "s", random_word (generator));
+    }
+  else
+    {
+      const gchar *tags[] = {
+        content_tags[g_rand_int_range (generator->rand, 0, G_N_ELEMENTS (content_tags))],
+        NULL,
+      };
+
+      g_variant_dict_insert (&query, "tags-match-any", "^as", tags);
+      g_variant_dict_insert (&query, "offset", "u", g_rand_int_range (generator->rand, 0, 10) * 20);
+    }
+
+  g_variant_dict_insert (&query, "limit", "u", 20);
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+  g_variant_builder_add_value (&builder, g_variant_dict_end (&query));
+
+  return g_variant_new ("(@aa{sv})", g_variant_builder_end (&builder));
+}
+
+static void
+on_call_finished (GObject      *source,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  PendingCall *call = user_data;
+  LoadGenerator *generator = call->generator;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source),
+                                                             result,
+                                                             &error);
+  gint64 latency = g_get_monotonic_time () - call->start_time;
+
+  if (reply == NULL)
+    generator->errors[call->kind]++;
+
+  /* Failed calls are timed too, since the service does the same work for
+   * them up to the point where it fails */
+  g_array_append_val (generator->latencies[call->kind], latency);
+
+  generator->n_in_flight--;
+  generator->end_time = g_get_monotonic_time ();
+  g_slice_free (PendingCall, call);
+
+  if (!generator->sending && generator->n_in_flight == 0)
+    g_main_loop_quit (generator->loop);
+}
+
+static void
+send_call (LoadGenerator *generator)
+{
+  PendingCall *call = g_slice_new0 (PendingCall);
+  GDBusConnection *client = g_ptr_array_index (generator->clients,
+                                               g_rand_int_range (generator->rand, 0,
+                                                                 generator->clients->len));
+  const gchar *app_path = g_ptr_array_index (generator->app_paths,
+                                             g_rand_int_range (generator->rand, 0,
+                                                               generator->app_paths->len));
+  const gchar *interface_name = NULL;
+  const gchar *method_name = NULL;
+  GVariant *parameters = NULL;
+
+  call->generator = generator;
+  call->kind = choose_call_kind (generator);
+
+  switch (call->kind)
+    {
+    case CALL_SEARCH:
+      interface_name = "org.gnome.Shell.SearchProvider2";
+      method_name = "GetInitialResultSet";
+      parameters = build_search_parameters (generator);
+      break;
+
+    case CALL_METADATA:
+      interface_name = "com.endlessm.ContentMetadata2";
+      method_name = "Query";
+      parameters = build_metadata_parameters (generator);
+      break;
+
+    case CALL_FEED:
+      {
+        const FeedMethod *method = &feed_methods[g_rand_int_range (generator->rand, 0,
+                                                                   G_N_ELEMENTS (feed_methods))];
+        interface_name = method->interface_name;
+        method_name = method->method_name;
+      }
+      break;
+
+    default:
+      g_assert_not_reached ();
+    }
+
+  generator->n_sent++;
+  generator->n_in_flight++;
+  call->start_time = g_get_monotonic_time ();
+
+  g_dbus_connection_call (client,
+                          SERVICE_BUS_NAME,
+                          app_path,
+                          interface_name,
+                          method_name,
+                          parameters,
+                          NULL,
+                          G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                          CALL_TIMEOUT_MS,
+                          NULL,
+                          on_call_finished,
+                          call);
+}
+
+static gboolean
+on_drain_timeout (gpointer user_data)
+{
+  LoadGenerator *generator = user_data;
+
+  g_printerr ("Gave up waiting for %u replies\n", generator->n_in_flight);
+  g_main_loop_quit (generator->loop);
+  return G_SOURCE_REMOVE;
+}
+
+/* Sends as many calls as needed to catch up with the target rate, so that
+ * the rate holds no matter how slow the replies are */
+static gboolean
+on_tick (gpointer user_data)
+{
+  LoadGenerator *generator = user_data;
+  gint64 elapsed = g_get_monotonic_time () - generator->start_time;
+
+  if (elapsed >= (gint64) generator->duration * G_USEC_PER_SEC)
+    {
+      generator->sending = FALSE;
+
+      if (generator->n_in_flight == 0)
+        g_main_loop_quit (generator->loop);
+      else
+        g_timeout_add_seconds (DRAIN_TIMEOUT_SECONDS, on_drain_timeout, generator);
+
+      return G_SOURCE_REMOVE;
+    }
+
+  while (generator->n_sent < (guint64) (generator->rate * elapsed / G_USEC_PER_SEC))
+    send_call (generator);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static void
+print_report_line (const gchar *name,
+                   GArray      *latencies,
+                   guint64      errors,
+                   gdouble      seconds)
+{
+  g_array_sort (latencies, eks_bench_compare_latencies);
+
+  g_print ("%-10s %8u %8" G_GUINT64_FORMAT " %10.1f %9.1f %9.1f %9.1f\n",
+           name,
+           latencies->len,
+           errors,
+           latencies->len / seconds,
+           eks_bench_percentile (latencies, 50),
+           eks_bench_percentile (latencies, 95),
+           eks_bench_percentile (latencies, 99));
+}
+
+static void
+print_report (LoadGenerator *generator)
+{
+  gdouble seconds = MAX (generator->end_time - generator->start_time, 1) / (gdouble) G_USEC_PER_SEC;
+  g_autoptr(GArray) all = g_array_new (FALSE, FALSE, sizeof (gint64));
+  guint64 all_errors = 0;
+
+  g_print ("%-10s %8s %8s %10s %9s %9s %9s\n",
+           "call", "replies", "errors", "per second", "p50 (ms)", "p95 (ms)", "p99 (ms)");
+
+  for (guint kind = 0; kind < N_CALL_KINDS; ++kind)
+    {
+      GArray *latencies = generator->latencies[kind];
+
+      if (generator->weights[kind] == 0)
+        continue;
+
+      g_array_append_vals (all, latencies->data, latencies->len);
+      all_errors += generator->errors[kind];
+      print_report_line (call_kind_names[kind], latencies, generator->errors[kind], seconds);
+    }
+
+  print_report_line ("all", all, all_errors, seconds);
+
+  if (generator->n_in_flight > 0)
+    g_print ("%u calls were still waiting for a reply\n", generator->n_in_flight);
+}
+
+/* The service's own view of the run, broken down by phase */
+static void
+print_service_report (GDBusConnection *connection)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) reply = NULL;
+  const gchar *report;
+
+  reply = g_dbus_connection_call_sync (connection,
+                                       SERVICE_BUS_NAME,
+                                       SERVICE_OBJECT_PATH,
+                                       "com.endlessm.EknServices.Metrics",
+                                       "GetReport",
+                                       NULL,
+                                       G_VARIANT_TYPE ("(s)"),
+                                       G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                       -1,
+                                       NULL,
+                                       &error);
+
+  if (reply == NULL)
+    {
+      g_printerr ("Could not get the service's metrics: %s\n", error->message);
+      return;
+    }
+
+  g_variant_get (reply, "(&s)", &report);
+  g_print ("\nService metrics:\n%s", report);
+}
+
+static gboolean
+start_service (GDBusConnection  *connection,
+               GError          **error)
+{
+  g_autoptr(GVariant) reply = g_dbus_connection_call_sync (connection,
+                                                           "org.freedesktop.DBus",
+                                                           "/org/freedesktop/DBus",
+                                                           "org.freedesktop.DBus",
+                                                           "StartServiceByName",
+                                                           g_variant_new ("(su)",
+                                                                          SERVICE_BUS_NAME,
+                                                                          0),
+                                                           G_VARIANT_TYPE ("(u)"),
+                                                           G_DBUS_CALL_FLAGS_NONE,
+                                                           -1,
+                                                           NULL,
+                                                           error);
+  return reply != NULL;
+}
+
+static gboolean
+run (GError **error)
+{
+  g_autoptr(GTestDBus) bus = NULL;
+  g_autofree gchar *root = NULL;
+  g_autofree gchar *services_dir = NULL;
+  g_autofree gchar *service_path = NULL;
+  g_autoptr(GFile) root_file = NULL;
+  g_autoptr(GPtrArray) app_ids = g_ptr_array_new_with_free_func (g_free);
+  LoadGenerator generator = { 0, };
+  gboolean ret = FALSE;
+
+  if (opt_service == NULL)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "The service to run must be given with --service");
+      return FALSE;
+    }
+
+  if (opt_apps <= 0 || opt_clients <= 0 || opt_rate <= 0 || opt_duration <= 0)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "The number of apps and clients, the rate and the duration must be positive");
+      return FALSE;
+    }
+
+  if (!parse_mix (opt_mix != NULL ? opt_mix : "search=60,metadata=30,feed=10",
+                  &generator, error))
+    return FALSE;
+
+  service_path = eks_bench_absolute_path (opt_service);
+
+  root = g_dir_make_tmp ("eks-load-generator-XXXXXX", error);
+  if (root == NULL)
+    return FALSE;
+  root_file = g_file_new_for_path (root);
+
+  generator.app_paths = g_ptr_array_new_with_free_func (g_free);
+  for (gint i = 0; i < opt_apps; ++i)
+    {
+      gchar *app_id = g_strdup_printf ("com.endlessm.bench.app%d", i);
+      g_autofree gchar *label = bus_label_escape (app_id);
+
+      g_ptr_array_add (app_ids, app_id);
+      g_ptr_array_add (generator.app_paths,
+                       g_strconcat (SERVICE_OBJECT_PATH "/", label, NULL));
+    }
+
+  if (opt_content != NULL &&
+      !eks_bench_serve_content (root, opt_content, app_ids, error))
+    goto out;
+
+  services_dir = eks_bench_write_service_file (root, service_path, error);
+  if (services_dir == NULL)
+    goto out;
+
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_add_service_dir (bus, services_dir);
+  g_test_dbus_up (bus);
+
+  generator.clients = g_ptr_array_new_with_free_func (g_object_unref);
+  for (gint i = 0; i < opt_clients; ++i)
+    {
+      GDBusConnection *client =
+        g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (bus),
+                                                G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                NULL,
+                                                NULL,
+                                                error);
+      if (client == NULL)
+        goto out;
+
+      g_ptr_array_add (generator.clients, client);
+    }
+
+  /* Startup isn't part of what is measured */
+  if (!start_service (g_ptr_array_index (generator.clients, 0), error))
+    goto out;
+
+  for (guint kind = 0; kind < N_CALL_KINDS; ++kind)
+    generator.latencies[kind] = g_array_new (FALSE, FALSE, sizeof (gint64));
+
+  generator.loop = g_main_loop_new (NULL, FALSE);
+  generator.rand = g_rand_new_with_seed (opt_seed);
+  generator.rate = opt_rate;
+  generator.duration = opt_duration;
+  generator.sending = TRUE;
+  generator.start_time = g_get_monotonic_time ();
+  generator.end_time = generator.start_time;
+
+  g_print ("Sending %.1f calls per second to %d apps from %d clients for %d seconds\n\n",
+           opt_rate, opt_apps, opt_clients, opt_duration);
+
+  g_timeout_add (TICK_INTERVAL_MS, on_tick, &generator);
+  g_main_loop_run (generator.loop);
+
+  print_report (&generator);
+  print_service_report (g_ptr_array_index (generator.clients, 0));
+
+  ret = TRUE;
+
+out:
+  g_clear_pointer (&generator.clients, g_ptr_array_unref);
+  g_clear_pointer (&generator.app_paths, g_ptr_array_unref);
+  g_clear_pointer (&generator.loop, g_main_loop_unref);
+  g_clear_pointer (&generator.rand, g_rand_free);
+  for (guint kind = 0; kind < N_CALL_KINDS; ++kind)
+    g_clear_pointer (&generator.latencies[kind], g_array_unref);
+
+  if (bus != NULL)
+    g_test_dbus_down (bus);
+  eks_bench_remove_recursively (root_file);
+
+  return ret;
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  g_autoptr(GOptionContext) context = g_option_context_new ("- put the knowledge services under load");
+  g_autoptr(GError) error = NULL;
+
+  g_option_context_add_main_entries (context, options, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error) ||
+      !run (&error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,399 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+/* Measures how long a client waits for its first reply when the search
+ * provider service isn't running yet, for each of its interfaces: the
+ * service is activated by the call itself, as it is by the shell or the
+ * Discovery Feed once it has exited for being idle, and is stopped again
+ * after every reply. */
+
+#include <gio/gio.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "eks-bench-util.h"
+#include "eks-bus-label.h"
+
+#define BENCH_APP_ID "com.endlessm.bench.app0"
+#define CALL_TIMEOUT_MS (60 * 1000)
+/* How long to wait for a stopped service to release its name */
+#define STOP_TIMEOUT_SECONDS 10
+
+typedef struct {
+  const gchar *name;
+  // Whether the call is made on the object of an app, or on the root object
+  gboolean on_app;
+  const gchar *interface_name;
+  const gchar *method_name;
+  // In GVariant text format
+  const gchar *parameters;
+} StartupCall;
+
+static const StartupCall startup_calls[] = {
+  { "search", TRUE, "org.gnome.Shell.SearchProvider2", "GetInitialResultSet",
+    "(['history'],)" },
+  { "metadata", TRUE, "com.endlessm.ContentMetadata", "Query",
+    "([{'search-terms': <'history'>, 'limit': <uint32 20>}],)" },
+  { "metadata2", TRUE, "com.endlessm.ContentMetadata2", "Query",
+    "([{'search-terms': <'history'>, 'limit': <uint32 20>}],)" },
+  { "feed-content", TRUE, "com.endlessm.DiscoveryFeedContent", "ArticleCardDescriptions",
+    "()" },
+  { "feed-artwork", TRUE, "com.endlessm.DiscoveryFeedArtwork", "ArtworkCardDescriptions",
+    "()" },
+  { "feed-quote", TRUE, "com.endlessm.DiscoveryFeedQuote", "GetQuoteOfTheDay",
+    "()" },
+  { "feed-word", TRUE, "com.endlessm.DiscoveryFeedWord", "GetWordOfTheDay",
+    "()" },
+  { "feed-news", TRUE, "com.endlessm.DiscoveryFeedNews", "GetRecentNews",
+    "()" },
+  { "feed-video", TRUE, "com.endlessm.DiscoveryFeedVideo", "GetVideos",
+    "()" },
+  { "feed-cards", TRUE, "com.endlessm.DiscoveryFeedCards", "GetCards",
+    "(['com.endlessm.DiscoveryFeedContent', 'com.endlessm.DiscoveryFeedWord'],)" },
+  { "federated", FALSE, "com.endlessm.FederatedSearch", "Search",
+    "(['history'], ['" BENCH_APP_ID "'], uint32 5, uint32 20)" },
+  { "metrics", FALSE, "com.endlessm.EknServices.Metrics", "GetReport",
+    "()" },
+};
+
+typedef struct {
+  GMainLoop *loop;
+  gint64 start_time;
+  // When the service took its name on the bus, or 0 if it hasn't yet
+  gint64 name_owned_time;
+  gint64 reply_time;
+  gboolean failed;
+} Measurement;
+
+static gchar *opt_service = NULL;
+static gchar *opt_content = NULL;
+static gchar *opt_calls = NULL;
+static gint opt_iterations = 10;
+
+static GOptionEntry options[] = {
+  { "service", 0, 0, G_OPTION_ARG_FILENAME, &opt_service,
+    "Path of the eks-search-provider-v4 binary to run", "PATH" },
+  { "content", 0, 0, G_OPTION_ARG_FILENAME, &opt_content,
+    "Data directory of an installed app, to serve as the content of the app called", "DIR" },
+  { "iterations", 0, 0, G_OPTION_ARG_INT, &opt_iterations,
+    "Number of times the service is started for each call (default: 10)", "N" },
+  { "calls", 0, 0, G_OPTION_ARG_STRING, &opt_calls,
+    "Comma-separated names of the calls to measure (default: all of them)", "CALLS" },
+  { NULL }
+};
+
+static void
+on_name_owner_changed (GDBusConnection *connection,
+                       const gchar     *sender_name,
+                       const gchar     *object_path,
+                       const gchar     *interface_name,
+                       const gchar     *signal_name,
+                       GVariant        *parameters,
+                       gpointer         user_data)
+{
+  Measurement *measurement = user_data;
+  const gchar *new_owner;
+
+  g_variant_get (parameters, "(&s&s&s)", NULL, NULL, &new_owner);
+
+  if (*new_owner != '\0' && measurement->name_owned_time == 0)
+    measurement->name_owned_time = g_get_monotonic_time ();
+}
+
+static void
+on_call_finished (GObject      *source,
+                  GAsyncResult *result,
+                  gpointer      user_data)
+{
+  Measurement *measurement = user_data;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) reply = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source),
+                                                             result,
+                                                             &error);
+
+  measurement->reply_time = g_get_monotonic_time ();
+
+  /* Failed calls are timed too: without content, the service still starts
+   * and dispatches the call, and only fails once it looks for the app */
+  measurement->failed = (reply == NULL);
+
+  g_main_loop_quit (measurement->loop);
+}
+
+static void
+measure_call (GDBusConnection   *connection,
+              const StartupCall *call,
+              const gchar       *app_path,
+              Measurement       *measurement)
+{
+  guint subscription_id =
+    g_dbus_connection_signal_subscribe (connection,
+                                        "org.freedesktop.DBus",
+                                        "org.freedesktop.DBus",
+                                        "NameOwnerChanged",
+                                        "/org/freedesktop/DBus",
+                                        SERVICE_BUS_NAME,
+                                        G_DBUS_SIGNAL_FLAGS_NONE,
+                                        on_name_owner_changed,
+                                        measurement,
+                                        NULL);
+
+  measurement->start_time = g_get_monotonic_time ();
+  g_dbus_connection_call (connection,
+                          SERVICE_BUS_NAME,
+                          call->on_app ? app_path : SERVICE_OBJECT_PATH,
+                          call->interface_name,
+                          call->method_name,
+                          g_variant_new_parsed (call->parameters),
+                          NULL,
+                          G_DBUS_CALL_FLAGS_NONE,
+                          CALL_TIMEOUT_MS,
+                          NULL,
+                          on_call_finished,
+                          measurement);
+  g_main_loop_run (measurement->loop);
+
+  g_dbus_connection_signal_unsubscribe (connection, subscription_id);
+}
+
+static void
+on_name_vanished (GDBusConnection *connection,
+                  const gchar     *name,
+                  gpointer         user_data)
+{
+  g_main_loop_quit (user_data);
+}
+
+static gboolean
+on_stop_timeout (gpointer user_data)
+{
+  g_printerr ("Gave up waiting for the service to exit\n");
+  g_main_loop_quit (user_data);
+  return G_SOURCE_REMOVE;
+}
+
+/* Stops the service and waits for it to be gone, so that the next call
+ * activates it again */
+static void
+stop_service (GDBusConnection *connection,
+              GMainLoop       *loop)
+{
+  g_autoptr(GVariant) reply = NULL;
+  g_autoptr(GSource) timeout = NULL;
+  guint32 pid;
+  guint watch_id;
+
+  reply = g_dbus_connection_call_sync (connection,
+                                       "org.freedesktop.DBus",
+                                       "/org/freedesktop/DBus",
+                                       "org.freedesktop.DBus",
+                                       "GetConnectionUnixProcessID",
+                                       g_variant_new ("(s)", SERVICE_BUS_NAME),
+                                       G_VARIANT_TYPE ("(u)"),
+                                       G_DBUS_CALL_FLAGS_NONE,
+                                       -1,
+                                       NULL,
+                                       NULL);
+
+  /* Not running, most likely because it crashed */
+  if (reply == NULL)
+    return;
+
+  g_variant_get (reply, "(u)", &pid);
+
+  watch_id = g_bus_watch_name_on_connection (connection,
+                                             SERVICE_BUS_NAME,
+                                             G_BUS_NAME_WATCHER_FLAGS_NONE,
+                                             NULL,
+                                             on_name_vanished,
+                                             loop,
+                                             NULL);
+  timeout = g_timeout_source_new_seconds (STOP_TIMEOUT_SECONDS);
+  g_source_set_callback (timeout, on_stop_timeout, loop, NULL);
+  g_source_attach (timeout, NULL);
+
+  kill ((pid_t) pid, SIGTERM);
+  g_main_loop_run (loop);
+
+  g_source_destroy (timeout);
+  g_bus_unwatch_name (watch_id);
+}
+
+static gboolean
+call_is_selected (const StartupCall  *call,
+                  GStrv               selected)
+{
+  return selected == NULL || g_strv_contains ((const gchar * const *) selected, call->name);
+}
+
+static void
+print_report_line (const StartupCall *call,
+                   GArray            *name_owned_latencies,
+                   GArray            *reply_latencies,
+                   guint              errors)
+{
+  g_array_sort (name_owned_latencies, eks_bench_compare_latencies);
+  g_array_sort (reply_latencies, eks_bench_compare_latencies);
+
+  g_print ("%-13s %6u %6u %12.1f %9.1f %9.1f %9.1f\n",
+           call->name,
+           reply_latencies->len,
+           errors,
+           eks_bench_percentile (name_owned_latencies, 50),
+           eks_bench_percentile (reply_latencies, 0),
+           eks_bench_percentile (reply_latencies, 50),
+           eks_bench_percentile (reply_latencies, 100));
+}
+
+static gboolean
+run (GError **error)
+{
+  g_autoptr(GTestDBus) bus = NULL;
+  g_autoptr(GDBusConnection) connection = NULL;
+  g_autoptr(GMainLoop) loop = NULL;
+  g_autofree gchar *root = NULL;
+  g_autofree gchar *services_dir = NULL;
+  g_autofree gchar *service_path = NULL;
+  g_autofree gchar *app_label = NULL;
+  g_autofree gchar *app_path = NULL;
+  g_auto(GStrv) selected = NULL;
+  g_autoptr(GFile) root_file = NULL;
+  g_autoptr(GPtrArray) app_ids = g_ptr_array_new_with_free_func (g_free);
+  gboolean ret = FALSE;
+
+  if (opt_service == NULL)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "The service to run must be given with --service");
+      return FALSE;
+    }
+
+  if (opt_iterations <= 0)
+    {
+      g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                   "The number of iterations must be positive");
+      return FALSE;
+    }
+
+  if (opt_calls != NULL)
+    {
+      selected = g_strsplit (opt_calls, ",", -1);
+
+      for (GStrv name = selected; *name != NULL; ++name)
+        {
+          gboolean known = FALSE;
+
+          for (guint i = 0; i < G_N_ELEMENTS (startup_calls) && !known; ++i)
+            known = g_strcmp0 (*name, startup_calls[i].name) == 0;
+
+          if (!known)
+            {
+              g_set_error (error, G_OPTION_ERROR, G_OPTION_ERROR_BAD_VALUE,
+                           "Unknown call \"%s\"", *name);
+              return FALSE;
+            }
+        }
+    }
+
+  service_path = eks_bench_absolute_path (opt_service);
+  app_label = bus_label_escape (BENCH_APP_ID);
+  app_path = g_strconcat (SERVICE_OBJECT_PATH "/", app_label, NULL);
+  g_ptr_array_add (app_ids, g_strdup (BENCH_APP_ID));
+
+  root = g_dir_make_tmp ("eks-startup-benchmark-XXXXXX", error);
+  if (root == NULL)
+    return FALSE;
+  root_file = g_file_new_for_path (root);
+
+  if (opt_content != NULL &&
+      !eks_bench_serve_content (root, opt_content, app_ids, error))
+    goto out;
+
+  services_dir = eks_bench_write_service_file (root, service_path, error);
+  if (services_dir == NULL)
+    goto out;
+
+  bus = g_test_dbus_new (G_TEST_DBUS_NONE);
+  g_test_dbus_add_service_dir (bus, services_dir);
+  g_test_dbus_up (bus);
+
+  connection = g_dbus_connection_new_for_address_sync (g_test_dbus_get_bus_address (bus),
+                                                       G_DBUS_CONNECTION_FLAGS_AUTHENTICATION_CLIENT |
+                                                       G_DBUS_CONNECTION_FLAGS_MESSAGE_BUS_CONNECTION,
+                                                       NULL,
+                                                       NULL,
+                                                       error);
+  if (connection == NULL)
+    goto out;
+
+  loop = g_main_loop_new (NULL, FALSE);
+
+  g_print ("Starting the service %d times for each call\n\n", opt_iterations);
+  g_print ("%-13s %6s %6s %12s %9s %9s %9s\n",
+           "call", "runs", "errors", "name p50 (ms)", "min (ms)", "p50 (ms)", "max (ms)");
+
+  for (guint i = 0; i < G_N_ELEMENTS (startup_calls); ++i)
+    {
+      const StartupCall *call = &startup_calls[i];
+      g_autoptr(GArray) name_owned_latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+      g_autoptr(GArray) reply_latencies = g_array_new (FALSE, FALSE, sizeof (gint64));
+      guint errors = 0;
+
+      if (!call_is_selected (call, selected))
+        continue;
+
+      for (gint iteration = 0; iteration < opt_iterations; ++iteration)
+        {
+          Measurement measurement = { loop, 0, };
+          gint64 latency;
+
+          measure_call (connection, call, app_path, &measurement);
+          stop_service (connection, loop);
+
+          if (measurement.failed)
+            errors++;
+
+          if (measurement.name_owned_time != 0)
+            {
+              latency = measurement.name_owned_time - measurement.start_time;
+              g_array_append_val (name_owned_latencies, latency);
+            }
+
+          latency = measurement.reply_time - measurement.start_time;
+          g_array_append_val (reply_latencies, latency);
+        }
+
+      print_report_line (call, name_owned_latencies, reply_latencies, errors);
+    }
+
+  ret = TRUE;
+
+out:
+  if (connection != NULL)
+    g_dbus_connection_close_sync (connection, NULL, NULL);
+  if (bus != NULL)
+    g_test_dbus_down (bus);
+  eks_bench_remove_recursively (root_file);
+
+  return ret;
+}
+
+gint
+main (gint   argc,
+      gchar *argv[])
+{
+  g_autoptr(GOptionContext) context = g_option_context_new ("- measure how long the knowledge services take to start");
+  g_autoptr(GError) error = NULL;
+
+  g_option_context_add_main_entries (context, options, NULL);
+
+  if (!g_option_context_parse (context, &argc, &argv, &error) ||
+      !run (&error))
+    {
+      g_printerr ("%s\n", error->message);
+      return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,122 @@
+/* Copyright 2016 Endless Mobile, Inc. */
+
+#include "eks-bus-label.h"
+
+#include <string.h>
+
+// The following code is adapted from
+// https://github.com/systemd/systemd/blob/master/src/basic/bus-label.c
+static gint
+unhexchar (gchar c)
+{
+  if (c >= '0' && c <= '9')
+    return c - '0';
+
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+
+  return -1;
+}
+
+/**
+ * bus_label_unescape:
+ * @f: an escaped object path element
+ *
+ * Returns: (transfer full): the string that was escaped into @f with
+ *   bus_label_escape()
+ */
+gchar *
+bus_label_unescape (const gchar *f) {
+  gchar *r, *t;
+  gsize i;
+  gsize l = f ? strlen (f) : 0;
+
+  /* Special case for the empty string */
+  if (l == 1 && *f == '_')
+    return g_strdup ("");
+
+  r = g_new (gchar, l + 1);
+  if (!r)
+    return NULL;
+
+  for (i = 0, t = r; i < l; ++i)
+    {
+      if (f[i] == '_')
+        {
+          int a, b;
+
+          if (l - i < 3 ||
+              (a = unhexchar (f[i + 1])) < 0 ||
+              (b = unhexchar (f[i + 2])) < 0)
+            {
+              /* Invalid escape code, let's take it literal then */
+              *(t++) = '_';
+            }
+          else
+            {
+              *(t++) = (gchar) ((a << 4) | b);
+              i += 2;
+            }
+        }
+      else
+        {
+          *(t++) = f[i];
+        }
+    }
+
+  *t = 0;
+
+  return r;
+}
+
+static gchar
+hexchar (gint x)
+{
+  static const gchar table[16] = "0123456789abcdef";
+
+  return table[x & 15];
+}
+
+/**
+ * bus_label_escape:
+ * @s: a string, such as an app id
+ *
+ * Returns: (transfer full): @s escaped into something which can be used as
+ *   an element of an object path
+ */
+gchar *
+bus_label_escape (const gchar *s)
+{
+  gchar *r, *t;
+  const gchar *f;
+
+  /* Special case for the empty string */
+  if (*s == 0)
+    return g_strdup ("_");
+
+  r = g_new (gchar, strlen (s) * 3 + 1);
+
+  for (f = s, t = r; *f; f++)
+    {
+      /* Escape everything that is not a-zA-Z0-9. We also
+       * escape 0-9 if it's the first character */
+      if (!g_ascii_isalpha (*f) &&
+          !(f > s && g_ascii_isdigit (*f)))
+        {
+          *(t++) = '_';
+          *(t++) = hexchar (*f >> 4);
+          *(t++) = hexchar (*f);
+        }
+      else
+        {
+          *(t++) = *f;
+        }
+    }
+
+  *t = 0;
+
+  return r;
+}
@@ -0,0 +1,13 @@
+/* Copyright 2016 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+gchar * bus_label_escape (const gchar *s);
+
+gchar * bus_label_unescape (const gchar *f);
+
+G_END_DECLS
@@ -0,0 +1,319 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#include "eks-discovery-feed-batch-provider.h"
+
+#include "eks-discovery-feed-provider.h"
+#include "eks-discovery-feed-provider-dbus.h"
+#include "eks-provider-iface.h"
+
+/* Enough to keep the engine busy while the slowest apps are being queried,
+ * without starting the queries for every installed app at once */
+#define MAX_CONCURRENT_APPS 4
+
+/**
+ * EksDiscoveryFeedBatchProvider:
+ *
+ * A provider for getting the Discovery Feed cards of many apps with a
+ * single call on the root object. The cards are computed by the
+ * #EksDiscoveryFeedProvider of each app, which is obtained through the
+ * #EksDiscoveryFeedBatchProvider::lookup-provider signal, and sent back to
+ * the caller as each app finishes.
+ */
+struct _EksDiscoveryFeedBatchProvider
+{
+  GObject parent_instance;
+
+  EksDiscoveryFeedBatch *skeleton;
+  guint next_batch_id;
+};
+
+static void eks_discovery_feed_batch_provider_interface_init (EksProviderInterface *);
+
+G_DEFINE_TYPE_WITH_CODE (EksDiscoveryFeedBatchProvider,
+                         eks_discovery_feed_batch_provider,
+                         G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (EKS_TYPE_PROVIDER,
+                                                eks_discovery_feed_batch_provider_interface_init));
+
+enum {
+  LOOKUP_PROVIDER,
+  NUM_SIGNALS,
+};
+static guint signals[NUM_SIGNALS];
+
+static void
+eks_discovery_feed_batch_provider_finalize (GObject *object)
+{
+  EksDiscoveryFeedBatchProvider *self = EKS_DISCOVERY_FEED_BATCH_PROVIDER (object);
+
+  g_clear_object (&self->skeleton);
+
+  G_OBJECT_CLASS (eks_discovery_feed_batch_provider_parent_class)->finalize (object);
+}
+
+static void
+eks_discovery_feed_batch_provider_class_init (EksDiscoveryFeedBatchProviderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = eks_discovery_feed_batch_provider_finalize;
+
+  /**
+   * EksDiscoveryFeedBatchProvider::lookup-provider:
+   * @provider: the batch provider
+   * @app_id: the app to get cards for
+   *
+   * Emitted to get the provider which computes the cards of an app.
+   *
+   * Returns: (transfer none): the #EksDiscoveryFeedProvider for @app_id
+   */
+  signals[LOOKUP_PROVIDER] = g_signal_new ("lookup-provider",
+                                           G_TYPE_FROM_CLASS (klass),
+                                           G_SIGNAL_RUN_LAST,
+                                           0,
+                                           g_signal_accumulator_first_wins, NULL, NULL,
+                                           EKS_TYPE_DISCOVERY_FEED_PROVIDER,
+                                           1, G_TYPE_STRING);
+}
+
+typedef struct
+{
+  gchar *app_id;
+  GStrv interfaces;
+} AppCardsRequest;
+
+static void
+app_cards_request_free (AppCardsRequest *request)
+{
+  g_free (request->app_id);
+  g_strfreev (request->interfaces);
+
+  g_slice_free (AppCardsRequest, request);
+}
+
+typedef struct
+{
+  EksDiscoveryFeedBatchProvider *self;
+  GDBusConnection *connection;
+  gchar *sender;
+  gchar *object_path;
+  guint batch_id;
+  // Queue of AppCardsRequest which haven't been started yet
+  GQueue pending;
+  guint n_running;
+} Batch;
+
+static void
+batch_free (Batch *batch)
+{
+  g_object_unref (batch->self);
+  g_object_unref (batch->connection);
+  g_free (batch->sender);
+  g_free (batch->object_path);
+  g_queue_clear_full (&batch->pending, (GDestroyNotify) app_cards_request_free);
+
+  g_slice_free (Batch, batch);
+}
+
+typedef struct
+{
+  Batch *batch;
+  AppCardsRequest *request;
+} RunningAppCards;
+
+/* Signals go to the caller only, rather than to everyone listening to the
+ * root object, since the batch ids are only meaningful to it */
+static void
+emit_batch_signal (Batch       *batch,
+                   const gchar *signal_name,
+                   GVariant    *parameters)
+{
+  g_autoptr(GError) error = NULL;
+
+  if (!g_dbus_connection_emit_signal (batch->connection,
+                                      batch->sender,
+                                      batch->object_path,
+                                      "com.endlessm.DiscoveryFeedBatch",
+                                      signal_name,
+                                      parameters,
+                                      &error))
+    g_warning ("Error sending %s for batch %u: %s",
+               signal_name, batch->batch_id, error->message);
+}
+
+static void
+emit_cards_ready (Batch           *batch,
+                  AppCardsRequest *request,
+                  GVariant        *cards,
+                  const GError    *error)
+{
+  if (cards != NULL)
+    {
+      g_autoptr(GVariant) shards = g_variant_get_child_value (cards, 0);
+      g_autoptr(GVariant) app_cards = g_variant_get_child_value (cards, 1);
+      g_autoptr(GVariant) errors = g_variant_get_child_value (cards, 2);
+
+      emit_batch_signal (batch, "CardsReady",
+                         g_variant_new ("(us@as@a{sv}@a{ss})",
+                                        batch->batch_id,
+                                        request->app_id,
+                                        shards,
+                                        app_cards,
+                                        errors));
+      return;
+    }
+
+  GVariantBuilder errors_builder;
+  g_variant_builder_init (&errors_builder, G_VARIANT_TYPE ("a{ss}"));
+  for (guint i = 0; request->interfaces[i] != NULL; ++i)
+    g_variant_builder_add (&errors_builder, "{ss}", request->interfaces[i], error->message);
+
+  emit_batch_signal (batch, "CardsReady",
+                     g_variant_new ("(usasa{sv}a{ss})",
+                                    batch->batch_id,
+                                    request->app_id,
+                                    NULL,
+                                    NULL,
+                                    &errors_builder));
+}
+
+static void start_next_app (Batch *batch);
+
+static void
+on_app_cards_ready (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  EksDiscoveryFeedProvider *provider = EKS_DISCOVERY_FEED_PROVIDER (source);
+  RunningAppCards *running = user_data;
+  Batch *batch = running->batch;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) cards = eks_discovery_feed_provider_get_cards_finish (provider,
+                                                                           result,
+                                                                           &error);
+
+  emit_cards_ready (batch, running->request, cards, error);
+  app_cards_request_free (running->request);
+  g_slice_free (RunningAppCards, running);
+
+  batch->n_running--;
+  start_next_app (batch);
+
+  if (batch->n_running > 0)
+    return;
+
+  emit_batch_signal (batch, "BatchFinished", g_variant_new ("(u)", batch->batch_id));
+  batch_free (batch);
+  g_application_release (g_application_get_default ());
+}
+
+static void
+start_next_app (Batch *batch)
+{
+  AppCardsRequest *request = g_queue_pop_head (&batch->pending);
+  EksDiscoveryFeedProvider *provider = NULL;
+
+  if (request == NULL)
+    return;
+
+  g_signal_emit (batch->self, signals[LOOKUP_PROVIDER], 0, request->app_id, &provider);
+  if (provider == NULL)
+    {
+      g_autoptr(GError) error = g_error_new (G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                                             "No provider for %s", request->app_id);
+      emit_cards_ready (batch, request, NULL, error);
+      app_cards_request_free (request);
+      start_next_app (batch);
+      return;
+    }
+
+  RunningAppCards *running = g_slice_new0 (RunningAppCards);
+  running->batch = batch;
+  running->request = request;
+  batch->n_running++;
+
+  eks_discovery_feed_provider_get_cards (provider,
+                                         (const gchar * const *) request->interfaces,
+                                         NULL,
+                                         on_app_cards_ready,
+                                         running);
+}
+
+static gboolean
+handle_request_cards (EksDiscoveryFeedBatch *skeleton,
+                      GDBusMethodInvocation *invocation,
+                      GVariant              *requests,
+                      gpointer               user_data)
+{
+  EksDiscoveryFeedBatchProvider *self = user_data;
+  Batch *batch = g_slice_new0 (Batch);
+  GVariantIter iter;
+  const gchar *app_id;
+  GVariant *interfaces;
+
+  batch->self = g_object_ref (self);
+  batch->connection = g_object_ref (g_dbus_method_invocation_get_connection (invocation));
+  batch->sender = g_strdup (g_dbus_method_invocation_get_sender (invocation));
+  batch->object_path = g_strdup (g_dbus_method_invocation_get_object_path (invocation));
+  batch->batch_id = ++self->next_batch_id;
+  g_queue_init (&batch->pending);
+
+  g_variant_iter_init (&iter, requests);
+  while (g_variant_iter_next (&iter, "(&s@as)", &app_id, &interfaces))
+    {
+      AppCardsRequest *request = g_slice_new0 (AppCardsRequest);
+      request->app_id = g_strdup (app_id);
+      request->interfaces = g_variant_dup_strv (interfaces, NULL);
+      g_queue_push_tail (&batch->pending, request);
+      g_variant_unref (interfaces);
+    }
+
+  /* The caller needs the id before the first signal arrives */
+  eks_discovery_feed_batch_complete_request_cards (skeleton, invocation, batch->batch_id);
+
+  g_application_hold (g_application_get_default ());
+
+  for (guint i = 0; i < MAX_CONCURRENT_APPS; ++i)
+    start_next_app (batch);
+
+  /* Nothing was started, either because there were no requests or because
+   * none of the apps had a provider */
+  if (batch->n_running == 0)
+    {
+      emit_batch_signal (batch, "BatchFinished", g_variant_new ("(u)", batch->batch_id));
+      batch_free (batch);
+      g_application_release (g_application_get_default ());
+    }
+
+  return TRUE;
+}
+
+static GDBusInterfaceSkeleton *
+eks_discovery_feed_batch_provider_skeleton_for_interface (EksProvider *provider,
+                                                          const gchar *interface)
+{
+  EksDiscoveryFeedBatchProvider *self = EKS_DISCOVERY_FEED_BATCH_PROVIDER (provider);
+  return G_DBUS_INTERFACE_SKELETON (self->skeleton);
+}
+
+/* Always kept, since it isn't specific to an app */
+static gboolean
+eks_discovery_feed_batch_provider_can_evict (EksProvider *provider)
+{
+  return FALSE;
+}
+
+static void
+eks_discovery_feed_batch_provider_interface_init (EksProviderInterface *iface)
+{
+  iface->skeleton_for_interface = eks_discovery_feed_batch_provider_skeleton_for_interface;
+  iface->can_evict = eks_discovery_feed_batch_provider_can_evict;
+}
+
+static void
+eks_discovery_feed_batch_provider_init (EksDiscoveryFeedBatchProvider *self)
+{
+  self->skeleton = eks_discovery_feed_batch_skeleton_new ();
+  g_signal_connect (self->skeleton, "handle-request-cards",
+                    G_CALLBACK (handle_request_cards), self);
+}
@@ -0,0 +1,12 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define EKS_TYPE_DISCOVERY_FEED_BATCH_PROVIDER eks_discovery_feed_batch_provider_get_type ()
+G_DECLARE_FINAL_TYPE (EksDiscoveryFeedBatchProvider, eks_discovery_feed_batch_provider, EKS, DISCOVERY_FEED_BATCH_PROVIDER, GObject)
+
+G_END_DECLS
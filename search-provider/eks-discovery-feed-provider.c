@@ -5,8 +5,11 @@
 
 #include "eks-errors.h"
 #include "eks-knowledge-app-dbus.h"
+#include "eks-metrics.h"
 #include "eks-discovery-feed-provider-dbus.h"
 #include "eks-query-util.h"
+#include "eks-trace.h"
+#include "eks-worker-pool.h"
 
 #include <dmodel.h>
 
@@ -28,7 +31,14 @@ struct _EksDiscoveryFeedProvider
   EksDiscoveryFeedNews *news_skeleton;
   EksDiscoveryFeedVideo *video_skeleton;
   EksDiscoveryFeedArtwork *artwork_skeleton;
+  EksDiscoveryFeedCards *cards_skeleton;
   GCancellable *cancellable;
+  // Fingerprint of the shards the caches below were computed from
+  gchar *shards_fingerprint;
+  // Hash table with query shape string keys, upper bound values
+  GHashTable *upper_bounds;
+  // Hash table with "date interface" string keys, DiscoveryFeedCachedResponse values
+  GHashTable *responses;
 };
 
 static void eks_discovery_feed_provider_interface_init (EksProviderInterface *iface);
@@ -97,7 +107,12 @@ eks_discovery_feed_provider_finalize (GObject *object)
   g_clear_object (&self->word_skeleton);
   g_clear_object (&self->news_skeleton);
   g_clear_object (&self->video_skeleton);
+  g_clear_object (&self->artwork_skeleton);
+  g_clear_object (&self->cards_skeleton);
   g_clear_object (&self->cancellable);
+  g_clear_pointer (&self->shards_fingerprint, g_free);
+  g_clear_pointer (&self->upper_bounds, g_hash_table_unref);
+  g_clear_pointer (&self->responses, g_hash_table_unref);
 
   G_OBJECT_CLASS (eks_discovery_feed_provider_parent_class)->finalize (object);
 }
@@ -120,29 +135,6 @@ eks_discovery_feed_provider_class_init (EksDiscoveryFeedProviderClass *klass)
                                      eks_discovery_feed_provider_props);
 }
 
-typedef struct {
-  GDBusMethodInvocation *invocation;
-  EksDiscoveryFeedProvider *provider;
-} DiscoveryFeedQueryState;
-
-static DiscoveryFeedQueryState *
-discovery_feed_query_state_new (GDBusMethodInvocation                  *invocation,
-                                EksDiscoveryFeedProvider *provider)
-{
-  DiscoveryFeedQueryState *state = g_slice_new0 (DiscoveryFeedQueryState);
-  state->invocation = g_object_ref (invocation);
-  state->provider = provider;
-
-  return state;
-}
-
-static void
-discovery_feed_query_state_free (DiscoveryFeedQueryState *state)
-{
-  g_object_unref (state->invocation);
-  g_slice_free (DiscoveryFeedQueryState, state);
-}
-
 static inline gchar *
 underscorify (const gchar *string)
 {
@@ -224,28 +216,15 @@ add_first_string_value_from_model_to_variant (DmContent       *model,
     add_key_value_pair_to_variant (builder, underscore_key, "");
 }
 
-static gint
-get_day_of_week (void)
-{
-  g_autoptr(GDateTime) datetime = g_date_time_new_now_local ();
-  return g_date_time_get_day_of_week (datetime);
-}
-
-static gint
-get_day_of_year (void)
-{
-  g_autoptr(GDateTime) datetime = g_date_time_new_now_local ();
-  return g_date_time_get_day_of_year (datetime);
-}
-
 static const char *
-select_string_from_array_from_day (JsonArray *array)
+select_string_from_array_from_day (JsonArray *array,
+                                   GDateTime *date)
 {
   guint size = json_array_get_length (array);
   if (size == 0)
     return NULL;
 
-  int ix = get_day_of_week () % size;
+  int ix = g_date_time_get_day_of_week (date) % size;
   return json_array_get_string_element (array, ix);
 }
 
@@ -254,38 +233,129 @@ typedef enum {
   DISCOVERY_FEED_SET_CUSTOM_TITLE = 1 << 0
 } DiscoveryFeedCustomProps;
 
+/* Drops everything that was computed from the app's content if its
+ * shards changed since the last time we looked */
+static void
+ensure_caches_for_current_shards (EksDiscoveryFeedProvider *self,
+                                  DmEngine                 *engine)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *fingerprint = shards_fingerprint_for_app (engine,
+                                                              self->application_id,
+                                                              &error);
+
+  /* If the app can't be loaded, the query itself will report the error */
+  if (g_strcmp0 (fingerprint, self->shards_fingerprint) == 0)
+    return;
+
+  g_hash_table_remove_all (self->upper_bounds);
+  g_hash_table_remove_all (self->responses);
+  g_free (self->shards_fingerprint);
+  self->shards_fingerprint = g_steal_pointer (&fingerprint);
+}
+
+/* Two queries have the same shape if they match the same set of models in
+ * the same order, no matter which window of that set they return */
+static gchar *
+query_shape_key (DmQuery *query)
+{
+  g_auto(GStrv) tags_match_any = NULL;
+  g_auto(GStrv) tags_match_all = NULL;
+  g_autofree gchar *content_type = NULL;
+  g_autofree gchar *search_terms = NULL;
+  g_autofree gchar *tags_match_any_str = NULL;
+  g_autofree gchar *tags_match_all_str = NULL;
+  DmQuerySort sort;
+  DmQueryOrder order;
+
+  g_object_get (query,
+                "tags-match-any", &tags_match_any,
+                "tags-match-all", &tags_match_all,
+                "content-type", &content_type,
+                "search-terms", &search_terms,
+                "sort", &sort,
+                "order", &order,
+                NULL);
+
+  tags_match_any_str = tags_match_any ? g_strjoinv (";", tags_match_any) : g_strdup ("");
+  tags_match_all_str = tags_match_all ? g_strjoinv (";", tags_match_all) : g_strdup ("");
+
+  return g_strdup_printf ("%s|%s|%s|%s|%d|%d",
+                          tags_match_any_str,
+                          tags_match_all_str,
+                          content_type ? content_type : "",
+                          search_terms ? search_terms : "",
+                          sort,
+                          order);
+}
+
+/* Computes an offset that always leaves a full window of limit models
+ * within the first wraparound_upper_bound models of the result set */
+static guint
+wraparound_offset (guint offset_within_upper_bound,
+                   guint upper_bound,
+                   guint wraparound_upper_bound,
+                   guint limit)
+{
+  guint window = MIN (upper_bound, wraparound_upper_bound);
+
+  /* Not enough content to rotate through, just show what there is */
+  if (window <= limit)
+    return 0;
+
+  return offset_within_upper_bound % (window - limit);
+}
+
 typedef struct _QueryPendingUpperBound {
-  DmQuery               *query;
-  guint                 offset_within_upper_bound;
-  guint                 wraparound_upper_bound;
-  GCancellable          *cancellable;
-  GDBusMethodInvocation *invocation;
-  GAsyncReadyCallback   main_query_ready_callback;
-  gpointer              main_query_ready_data;
-  GDestroyNotify        main_query_ready_destroy;
+  EksDiscoveryFeedProvider *provider;
+  DmQuery                  *query;
+  gchar                    *shape_key;
+  guint                    offset_within_upper_bound;
+  guint                    wraparound_upper_bound;
+  guint                    speculative_offset;
+  GAsyncResult             *speculative_result;
+  gint                     upper_bound;
+  GError                   *upper_bound_error;
+  guint                    n_pending;
+  GCancellable             *cancellable;
+  GAsyncReadyCallback      main_query_ready_callback;
+  gpointer                 main_query_ready_data;
+  GDestroyNotify           main_query_ready_destroy;
+  guint                    trace_id;
+  gint64                   count_query_begin;
 } QueryPendingUpperBound;
 
 static QueryPendingUpperBound *
-query_pending_upper_bound_new (DmQuery               *query,
-                               guint                  offset_within_upper_bound,
-                               guint                  wraparound_upper_bound,
-                               GDBusMethodInvocation *invocation,
-                               GCancellable          *cancellable,
-                               GAsyncReadyCallback    main_query_ready_callback,
-                               gpointer               main_query_ready_data,
-                               GDestroyNotify         main_query_ready_destroy)
+query_pending_upper_bound_new (EksDiscoveryFeedProvider *provider,
+                               DmQuery                  *query,
+                               const gchar              *shape_key,
+                               guint                     offset_within_upper_bound,
+                               guint                     wraparound_upper_bound,
+                               guint                     speculative_offset,
+                               GCancellable             *cancellable,
+                               GAsyncReadyCallback       main_query_ready_callback,
+                               gpointer                  main_query_ready_data,
+                               GDestroyNotify            main_query_ready_destroy,
+                               guint                     trace_id)
 {
   QueryPendingUpperBound *data = g_new0 (QueryPendingUpperBound, 1);
+  data->provider = g_object_ref (provider);
   data->query = g_object_ref (query);
+  data->shape_key = g_strdup (shape_key);
   data->offset_within_upper_bound = offset_within_upper_bound;
   data->wraparound_upper_bound = wraparound_upper_bound;
+  data->speculative_offset = speculative_offset;
 
   /* Keep cancellable alive if we got one, otherwise ignore it */
   data->cancellable = cancellable ? g_object_ref (cancellable) : NULL;
-  data->invocation = g_object_ref (invocation);
   data->main_query_ready_callback = main_query_ready_callback;
   data->main_query_ready_data = main_query_ready_data;
   data->main_query_ready_destroy = main_query_ready_destroy;
+  data->trace_id = trace_id;
+  data->count_query_begin = eks_trace_begin (trace_id);
+
+  /* One for the upper bound query and one for the speculative query */
+  data->n_pending = 2;
 
   return data;
 }
@@ -293,9 +363,12 @@ query_pending_upper_bound_new (DmQuery               *query,
 static void
 query_pending_upper_bound_free (QueryPendingUpperBound *data)
 {
+  g_object_unref (data->provider);
   g_object_unref (data->query);
+  g_free (data->shape_key);
+  g_clear_object (&data->speculative_result);
+  g_clear_error (&data->upper_bound_error);
   g_clear_object (&data->cancellable);
-  g_object_unref (data->invocation);
   g_clear_pointer (&data->main_query_ready_data, data->main_query_ready_destroy);
 
   g_free (data);
@@ -304,50 +377,103 @@ query_pending_upper_bound_free (QueryPendingUpperBound *data)
 G_DEFINE_AUTOPTR_CLEANUP_FUNC (QueryPendingUpperBound, query_pending_upper_bound_free)
 
 static void
-on_received_upper_bound_result (GObject      *source,
-                                GAsyncResult *result,
-                                gpointer     user_data)
+resolve_pending_upper_bound (DmEngine               *engine,
+                             QueryPendingUpperBound *pending)
 {
-  DmEngine *engine = DM_ENGINE (source);
-  g_autoptr(QueryPendingUpperBound) pending = user_data;
-  g_autoptr(GError) error = NULL;
-
-  g_autoptr(DmQueryResults) results = dm_engine_query_finish (engine, result, &error);
-
-  if (error != NULL)
+  if (pending->upper_bound_error != NULL)
     {
       g_warning ("Unable to get upper bound on results, aborting query: %s",
-                 error->message);
-      g_dbus_method_invocation_take_error (pending->invocation,
-                                           g_steal_pointer (&error));
-
-      /* No need to free_full the out models and shards here,
-       * g_slist_copy_deep is not called if this function returns early. */
+                 pending->upper_bound_error->message);
+
+      /* Hand the error over to the main callback as if it came from
+       * the query itself, so that it can report it */
+      g_task_report_error (engine,
+                           pending->main_query_ready_callback,
+                           g_steal_pointer (&pending->main_query_ready_data),
+                           dm_engine_query,
+                           g_steal_pointer (&pending->upper_bound_error));
       return;
     }
 
-  /* Now that we have results, we can read the upper bound and
-   * determine the actual offset */
   guint intended_limit;
   g_object_get (pending->query, "limit", &intended_limit, NULL);
-  int upper_bound = dm_query_results_get_upper_bound (results);
-  guint offset = pending->offset_within_upper_bound % (MIN (upper_bound,
-                                                            pending->wraparound_upper_bound) -
-                                                       intended_limit);
-
-  /* Get rid of the old query and construct a new one in its place */
-  DmQuery *query = dm_query_new_from_object (pending->query,
-                                             "offset", offset,
-                                             NULL);
-  g_set_object (&pending->query, query);
-
-  /* Okay, now fire off the *actual* query, passing the user data
-   * and callback that we were going to pass the first time */
-  dm_engine_query (engine, pending->query, pending->cancellable,
+  guint offset = wraparound_offset (pending->offset_within_upper_bound,
+                                    MAX (pending->upper_bound, 0),
+                                    pending->wraparound_upper_bound,
+                                    intended_limit);
+
+  /* The common case: the collection was at least as big as we guessed,
+   * so the speculative results are the right ones */
+  if (offset == pending->speculative_offset)
+    {
+      pending->main_query_ready_callback (G_OBJECT (engine),
+                                          pending->speculative_result,
+                                          pending->main_query_ready_data);
+
+      /* The callback took ownership of the data */
+      pending->main_query_ready_data = NULL;
+      return;
+    }
+
+  /* We guessed wrong, so fire off the query again with the right offset,
+   * passing the user data and callback that we were going to pass the
+   * first time */
+  g_autoptr(DmQuery) query = dm_query_new_from_object (pending->query,
+                                                       "offset", offset,
+                                                       NULL);
+  dm_engine_query (engine, query, pending->cancellable,
                    pending->main_query_ready_callback,
                    g_steal_pointer (&pending->main_query_ready_data));
 }
 
+static void
+on_received_upper_bound_result (GObject      *source,
+                                GAsyncResult *result,
+                                gpointer     user_data)
+{
+  DmEngine *engine = DM_ENGINE (source);
+  QueryPendingUpperBound *pending = user_data;
+  g_autoptr(DmQueryResults) results = dm_engine_query_finish (engine,
+                                                              result,
+                                                              &pending->upper_bound_error);
+
+  eks_trace_span (pending->trace_id, "count-query", pending->count_query_begin);
+
+  /* Now that we have results, we can read and remember the upper bound */
+  if (results != NULL)
+    {
+      pending->upper_bound = dm_query_results_get_upper_bound (results);
+      g_hash_table_insert (pending->provider->upper_bounds,
+                           g_strdup (pending->shape_key),
+                           GINT_TO_POINTER (pending->upper_bound));
+    }
+
+  if (--pending->n_pending > 0)
+    return;
+
+  resolve_pending_upper_bound (engine, pending);
+  query_pending_upper_bound_free (pending);
+}
+
+static void
+on_received_speculative_result (GObject      *source,
+                                GAsyncResult *result,
+                                gpointer      user_data)
+{
+  DmEngine *engine = DM_ENGINE (source);
+  QueryPendingUpperBound *pending = user_data;
+
+  /* Don't finish the result here, it may still be passed on to the
+   * main callback which will do that */
+  pending->speculative_result = g_object_ref (result);
+
+  if (--pending->n_pending > 0)
+    return;
+
+  resolve_pending_upper_bound (engine, pending);
+  query_pending_upper_bound_free (pending);
+}
+
 /* This function executes the given query with an offset computed
  * to be within the total number of results within the query set. The
  * caller should pass an offset that it would intend to use if
@@ -356,19 +482,69 @@ on_received_upper_bound_result (GObject      *source,
  * with respect to maximum of either the number of articles in the
  * result set or the wraparound_upper_bound, accounting for the fact
  * that we may want to fetch the full window of articles specified
- * in the limit parameter to the query
+ * in the limit parameter to the query.
+ *
+ * The number of results for each query shape is remembered until the
+ * app's shards change, so usually only the query itself needs to run.
+ * Otherwise, the query runs in parallel with the query for the number of
+ * results, guessing that there are at least wraparound_upper_bound of
+ * them, and is only run again if that guess turns out to be wrong.
  */
 static void
-query_with_wraparound_offset (DmEngine              *engine,
-                              DmQuery               *query,
-                              guint                  offset_within_upper_bound,
-                              guint                  wraparound_upper_bound,
-                              GDBusMethodInvocation *invocation,
-                              GCancellable          *cancellable,
-                              GAsyncReadyCallback    main_query_ready_callback,
-                              gpointer               main_query_ready_data,
-                              GDestroyNotify         main_query_ready_destroy)
+query_with_wraparound_offset (EksDiscoveryFeedProvider *self,
+                              DmEngine                 *engine,
+                              DmQuery                  *query,
+                              guint                     offset_within_upper_bound,
+                              guint                     wraparound_upper_bound,
+                              GCancellable             *cancellable,
+                              GAsyncReadyCallback       main_query_ready_callback,
+                              gpointer                  main_query_ready_data,
+                              GDestroyNotify            main_query_ready_destroy,
+                              guint                     trace_id)
 {
+  g_autofree gchar *shape_key = query_shape_key (query);
+  gpointer cached_upper_bound;
+  guint intended_limit;
+
+  g_object_get (query, "limit", &intended_limit, NULL);
+  ensure_caches_for_current_shards (self, engine);
+
+  if (g_hash_table_lookup_extended (self->upper_bounds,
+                                    shape_key,
+                                    NULL,
+                                    &cached_upper_bound))
+    {
+      guint offset = wraparound_offset (offset_within_upper_bound,
+                                        MAX (GPOINTER_TO_INT (cached_upper_bound), 0),
+                                        wraparound_upper_bound,
+                                        intended_limit);
+      g_autoptr(DmQuery) offset_query = dm_query_new_from_object (query,
+                                                                  "offset", offset,
+                                                                  NULL);
+
+      dm_engine_query (engine, offset_query, cancellable,
+                       main_query_ready_callback,
+                       main_query_ready_data);
+      return;
+    }
+
+  guint speculative_offset = wraparound_offset (offset_within_upper_bound,
+                                                wraparound_upper_bound,
+                                                wraparound_upper_bound,
+                                                intended_limit);
+  QueryPendingUpperBound *pending =
+    query_pending_upper_bound_new (self,
+                                   query,
+                                   shape_key,
+                                   offset_within_upper_bound,
+                                   wraparound_upper_bound,
+                                   speculative_offset,
+                                   cancellable,
+                                   main_query_ready_callback,
+                                   main_query_ready_data,
+                                   main_query_ready_destroy,
+                                   trace_id);
+
   /* Override the limit, setting it to one. In the returned query we'll get
    * nothing back, but Xapian will tell us how many models matched our query
    * which we'll use later. We have to ask for at least one article
@@ -376,19 +552,16 @@ query_with_wraparound_offset (DmEngine              *engine,
   g_autoptr(DmQuery) truncated_query = dm_query_new_from_object (query,
                                                                  "limit", 1,
                                                                  NULL);
+  g_autoptr(DmQuery) speculative_query = dm_query_new_from_object (query,
+                                                                   "offset", speculative_offset,
+                                                                   NULL);
 
-  /* Dispatch the query, when it comes back we'll know what to
-   * set the offset to */
   dm_engine_query (engine, truncated_query, cancellable,
                    on_received_upper_bound_result,
-                   query_pending_upper_bound_new (query,
-                                                  offset_within_upper_bound,
-                                                  wraparound_upper_bound,
-                                                  invocation,
-                                                  cancellable,
-                                                  main_query_ready_callback,
-                                                  main_query_ready_data,
-                                                  main_query_ready_destroy));
+                   pending);
+  dm_engine_query (engine, speculative_query, cancellable,
+                   on_received_speculative_result,
+                   pending);
 }
 
 static gboolean
@@ -400,45 +573,57 @@ model_has_thumbnail_uri (DmContent *model)
   return thumbnail_uri != NULL;
 }
 
-static void
-artwork_card_descriptions_cb (GObject *source,
-                              GAsyncResult *result,
-                              gpointer user_data)
+static DmQuery *
+create_article_cards_query (EksDiscoveryFeedProvider *self)
 {
-  DmEngine *engine = DM_ENGINE (source);
-  DiscoveryFeedQueryState *state = user_data;
-
-  g_application_release (g_application_get_default ());
-
-  GError *error = NULL;
-  GSList *models = NULL;
-  GSList *shards = NULL;
+  const char *tags_match_any[] = { "EknArticleObject", NULL };
+
+  return g_object_new (DM_TYPE_QUERY,
+                       "tags-match-any", tags_match_any,
+                       "sort", DM_QUERY_SORT_DATE,
+                       "order", DM_QUERY_ORDER_DESCENDING,
+                       "limit", NUMBER_OF_ARTICLES,
+                       "app-id", self->application_id,
+                       NULL);
+}
 
-  if (!models_and_shards_for_result (engine,
-                                     state->provider->application_id,
-                                     result,
-                                     &models,
-                                     &shards,
-                                     NULL,
-                                     &error))
-    {
-      g_dbus_method_invocation_take_error (state->invocation, error);
-      discovery_feed_query_state_free (state);
+static DmQuery *
+create_article_of_the_day_query (EksDiscoveryFeedProvider *self)
+{
+  const char *tags_match_any[] = { "EknArticleObject", NULL };
 
-      /* No need to free_full the out models and shards here,
-       * g_slist_copy_deep is not called if this function returns FALSE. */
-      return;
-    }
+  return g_object_new (DM_TYPE_QUERY,
+                       "tags-match-any", tags_match_any,
+                       "limit", 1,
+                       "app-id", self->application_id,
+                       NULL);
+}
 
-  g_auto(GStrv) shards_strv = strv_from_shard_list (shards);
+static DmQuery *
+create_video_query (EksDiscoveryFeedProvider *self)
+{
+  const char *tags_match_any[] = { "EknMediaObject", NULL };
+
+  return g_object_new (DM_TYPE_QUERY,
+                       "content-type", "video",
+                       "tags-match-any", tags_match_any,
+                       "limit", 1,
+                       "app-id", self->application_id,
+                       NULL);
+}
 
+static GVariant *
+build_artwork_card_descriptions_response (GSList     *models,
+                                          GStrv       shards,
+                                          GDateTime  *date,
+                                          GError    **error)
+{
   GVariantBuilder builder;
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{ss}"));
 
   for (GSList *l = models; l; l = l->next)
     {
       DmContent *model = l->data;
-      DiscoveryFeedCustomProps flags = DISCOVERY_FEED_NO_CUSTOM_PROPS;
 
       if (!model_has_thumbnail_uri (model))
         continue;
@@ -459,80 +644,17 @@ artwork_card_descriptions_cb (GObject *source,
       g_variant_builder_close (&builder);
     }
 
-  eks_discovery_feed_artwork_complete_artwork_card_descriptions (state->provider->artwork_skeleton,
-                                                                 state->invocation,
-                                                                 (const gchar * const *) shards_strv,
-                                                                 g_variant_builder_end (&builder));
-  g_slist_free_full (models, g_object_unref);
-  g_slist_free_full (shards, g_object_unref);
-  discovery_feed_query_state_free (state);
-}
-
-static gboolean
-handle_artwork_card_descriptions (EksDiscoveryFeedProvider *skeleton,
-                                  GDBusMethodInvocation    *invocation,
-                                  gpointer                  user_data)
-{
-    EksDiscoveryFeedProvider *self = user_data;
-    DmEngine *engine = dm_engine_get_default ();
-    const char *tags_match_any[] = { "EknArticleObject", NULL };
-
-    /* Hold the application so that it doesn't go away whilst we're handling
-     * the query */
-    g_application_hold (g_application_get_default ());
-
-    /* Create query and run it */
-    query_with_wraparound_offset (engine,
-                                  g_object_new (DM_TYPE_QUERY,
-                                                "tags-match-any", tags_match_any,
-                                                "sort", DM_QUERY_SORT_DATE,
-                                                "order", DM_QUERY_ORDER_DESCENDING,
-                                                "limit", NUMBER_OF_ARTICLES,
-                                                "app-id", self->application_id,
-                                                NULL),
-                                  get_day_of_year (),
-                                  DAYS_IN_YEAR,
-                                  invocation,
-                                  self->cancellable,
-                                  artwork_card_descriptions_cb,
-                                  discovery_feed_query_state_new (invocation, self),
-                                  (GDestroyNotify) discovery_feed_query_state_free);
-
-    return TRUE;
+  return g_variant_new ("(^as@aa{ss})",
+                        (const gchar * const *) shards,
+                        g_variant_builder_end (&builder));
 }
 
-static void
-content_article_card_descriptions_cb (GObject *source,
-                                      GAsyncResult *result,
-                                      gpointer user_data)
+static GVariant *
+build_content_article_card_descriptions_response (GSList     *models,
+                                                  GStrv       shards,
+                                                  GDateTime  *date,
+                                                  GError    **error)
 {
-  DmEngine *engine = DM_ENGINE (source);
-  DiscoveryFeedQueryState *state = user_data;
-
-  g_application_release (g_application_get_default ());
-
-  GError *error = NULL;
-  GSList *models = NULL;
-  GSList *shards = NULL;
-
-  if (!models_and_shards_for_result (engine,
-                                     state->provider->application_id,
-                                     result,
-                                     &models,
-                                     &shards,
-                                     NULL,
-                                     &error))
-    {
-      g_dbus_method_invocation_take_error (state->invocation, error);
-      discovery_feed_query_state_free (state);
-
-      /* No need to free_full the out models and shards here,
-       * g_slist_copy_deep is not called if this function returns FALSE. */
-      return;
-    }
-
-  g_auto(GStrv) shards_strv = strv_from_shard_list (shards);
-
   GVariantBuilder builder;
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{ss}"));
 
@@ -560,7 +682,7 @@ content_article_card_descriptions_cb (GObject *source,
         {
           JsonArray *blurbs = json_object_get_array_member (discovery_feed_content,
                                                             "blurbs");
-          const char *title = select_string_from_array_from_day (blurbs);
+          const char *title = select_string_from_array_from_day (blurbs, date);
 
           if (title)
             {
@@ -586,246 +708,72 @@ content_article_card_descriptions_cb (GObject *source,
       g_variant_builder_close (&builder);
     }
 
-  eks_discovery_feed_content_complete_article_card_descriptions (state->provider->content_skeleton,
-                                                                 state->invocation,
-                                                                 (const gchar * const *) shards_strv,
-                                                                 g_variant_builder_end (&builder));
-  g_slist_free_full (models, g_object_unref);
-  g_slist_free_full (shards, g_object_unref);
-  discovery_feed_query_state_free (state);
-}
-
-static gboolean
-handle_content_article_card_descriptions (EksDiscoveryFeedProvider *skeleton,
-                                          GDBusMethodInvocation    *invocation,
-                                          gpointer                  user_data)
-{
-    EksDiscoveryFeedProvider *self = user_data;
-    DmEngine *engine = dm_engine_get_default ();
-    const char *tags_match_any[] = { "EknArticleObject", NULL };
-
-    /* Hold the application so that it doesn't go away whilst we're handling
-     * the query */
-    g_application_hold (g_application_get_default ());
-
-    /* Create query and run it */
-    query_with_wraparound_offset (engine,
-                                  g_object_new (DM_TYPE_QUERY,
-                                                "tags-match-any", tags_match_any,
-                                                "sort", DM_QUERY_SORT_DATE,
-                                                "order", DM_QUERY_ORDER_DESCENDING,
-                                                "limit", NUMBER_OF_ARTICLES,
-                                                "app-id", self->application_id,
-                                                NULL),
-                                  get_day_of_year (),
-                                  DAYS_IN_YEAR,
-                                  invocation,
-                                  self->cancellable,
-                                  content_article_card_descriptions_cb,
-                                  discovery_feed_query_state_new (invocation, self),
-                                  (GDestroyNotify) discovery_feed_query_state_free);
-
-    return TRUE;
+  return g_variant_new ("(^as@aa{ss})",
+                        (const gchar * const *) shards,
+                        g_variant_builder_end (&builder));
 }
 
-
-static void
-get_word_of_the_day_content_cb (GObject *source,
-                                GAsyncResult *result,
-                                gpointer user_data)
+static GVariant *
+build_word_of_the_day_response (GSList     *models,
+                                GStrv       shards,
+                                GDateTime  *date,
+                                GError    **error)
 {
-  DmEngine *engine = DM_ENGINE (source);
-  DiscoveryFeedQueryState *state = user_data;
-
-  g_application_release (g_application_get_default ());
-
-  GError *error = NULL;
-  GSList *models = NULL;
-
-  if (!models_for_result (engine,
-                          state->provider->application_id,
-                          result,
-                          &models,
-                          NULL,
-                          &error))
-    {
-      g_dbus_method_invocation_take_error (state->invocation, error);
-      discovery_feed_query_state_free (state);
-      return;
-    }
-
   if (models == NULL)
     {
-      g_dbus_method_invocation_return_error_literal (state->invocation,
-                                                     EKS_ERROR,
-                                                     EKS_ERROR_MALFORMED_APP,
-                                                     "No results for word of the day");
-      discovery_feed_query_state_free (state);
-      return;
+      g_set_error_literal (error,
+                           EKS_ERROR,
+                           EKS_ERROR_MALFORMED_APP,
+                           "No results for word of the day");
+      return NULL;
     }
 
   GVariantBuilder builder;
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{ss}"));
 
-  DmContent *model = g_slist_nth (models, 0)->data;
+  DmContent *model = models->data;
 
   add_id_from_model_to_variant (model, &builder);
   add_key_value_pair_from_model_to_variant (model, &builder, "word");
   add_key_value_pair_from_model_to_variant (model, &builder, "definition");
   add_key_value_pair_from_model_to_variant (model, &builder, "part-of-speech");
 
-  eks_discovery_feed_word_complete_get_word_of_the_day (state->provider->word_skeleton,
-                                                        state->invocation,
-                                                        g_variant_builder_end (&builder));
-  g_slist_free_full (models, g_object_unref);
-  discovery_feed_query_state_free (state);
-}
-
-static gboolean
-handle_get_word_of_the_day (EksDiscoveryFeedProvider *skeleton,
-                            GDBusMethodInvocation    *invocation,
-                            gpointer                  user_data)
-{
-    EksDiscoveryFeedProvider *self = user_data;
-    DmEngine *engine = dm_engine_get_default ();
-    const char *tags_match_any[] = { "EknArticleObject", NULL };
-
-    /* Hold the application so that it doesn't go away whilst we're handling
-     * the query */
-    g_application_hold (g_application_get_default ());
-
-    /* Create query and run it */
-    query_with_wraparound_offset (engine,
-                                  g_object_new (DM_TYPE_QUERY,
-                                                "tags-match-any", tags_match_any,
-                                                "limit", 1,
-                                                "app-id", self->application_id,
-                                                NULL),
-                                  get_day_of_year (),
-                                  DAYS_IN_YEAR,
-                                  invocation,
-                                  self->cancellable,
-                                  get_word_of_the_day_content_cb,
-                                  discovery_feed_query_state_new (invocation, self),
-                                  (GDestroyNotify) discovery_feed_query_state_free);
-
-    return TRUE;
+  return g_variant_new ("(@a{ss})", g_variant_builder_end (&builder));
 }
 
-static void
-get_quote_of_the_day_content_cb (GObject *source,
-                                 GAsyncResult *result,
-                                 gpointer user_data)
+static GVariant *
+build_quote_of_the_day_response (GSList     *models,
+                                 GStrv       shards,
+                                 GDateTime  *date,
+                                 GError    **error)
 {
-  DmEngine *engine = DM_ENGINE (source);
-  DiscoveryFeedQueryState *state = user_data;
-
-  g_application_release (g_application_get_default ());
-
-  GError *error = NULL;
-  GSList *models = NULL;
-
-  if (!models_for_result (engine,
-                          state->provider->application_id,
-                          result,
-                          &models,
-                          NULL,
-                          &error))
-    {
-      g_dbus_method_invocation_take_error (state->invocation, error);
-      discovery_feed_query_state_free (state);
-      return;
-    }
-
   if (models == NULL)
     {
-      g_dbus_method_invocation_return_error_literal (state->invocation,
-                                                     EKS_ERROR,
-                                                     EKS_ERROR_MALFORMED_APP,
-                                                     "No results for quote of the day");
-      discovery_feed_query_state_free (state);
-      return;
+      g_set_error_literal (error,
+                           EKS_ERROR,
+                           EKS_ERROR_MALFORMED_APP,
+                           "No results for quote of the day");
+      return NULL;
     }
 
   GVariantBuilder builder;
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{ss}"));
 
-  DmContent *model = g_slist_nth (models, 0)->data;
+  DmContent *model = models->data;
 
   add_id_from_model_to_variant (model, &builder);
   add_key_value_pair_from_model_to_variant (model, &builder, "title");
   add_first_string_value_from_model_to_variant (model, &builder, "authors", "author");
 
-  eks_discovery_feed_quote_complete_get_quote_of_the_day (state->provider->quote_skeleton,
-                                                          state->invocation,
-                                                          g_variant_builder_end (&builder));
-  g_slist_free_full (models, g_object_unref);
-  discovery_feed_query_state_free (state);
-}
-
-static gboolean
-handle_get_quote_of_the_day (EksDiscoveryFeedProvider *skeleton,
-                             GDBusMethodInvocation    *invocation,
-                             gpointer                  user_data)
-{
-    EksDiscoveryFeedProvider *self = user_data;
-    DmEngine *engine = dm_engine_get_default ();
-    const char *tags_match_any[] = { "EknArticleObject", NULL };
-
-    /* Hold the application so that it doesn't go away whilst we're handling
-     * the query */
-    g_application_hold (g_application_get_default ());
-
-    /* Create query and run it */
-    query_with_wraparound_offset (engine,
-                                  g_object_new (DM_TYPE_QUERY,
-                                                "tags-match-any", tags_match_any,
-                                                "limit", 1,
-                                                "app-id", self->application_id,
-                                                NULL),
-                                  get_day_of_year (),
-                                  DAYS_IN_YEAR,
-                                  invocation,
-                                  self->cancellable,
-                                  get_quote_of_the_day_content_cb,
-                                  discovery_feed_query_state_new (invocation, self),
-                                  (GDestroyNotify) discovery_feed_query_state_free);
-
-    return TRUE;
+  return g_variant_new ("(@a{ss})", g_variant_builder_end (&builder));
 }
 
-static void
-recent_news_articles_cb (GObject *source,
-                         GAsyncResult *result,
-                         gpointer user_data)
+static GVariant *
+build_recent_news_response (GSList     *models,
+                            GStrv       shards,
+                            GDateTime  *date,
+                            GError    **error)
 {
-  DmEngine *engine = DM_ENGINE (source);
-  DiscoveryFeedQueryState *state = user_data;
-
-  g_application_release (g_application_get_default ());
-
-  GError *error = NULL;
-  GSList *models = NULL;
-  GSList *shards = NULL;
-
-  if (!models_and_shards_for_result (engine,
-                                     state->provider->application_id,
-                                     result,
-                                     &models,
-                                     &shards,
-                                     NULL,
-                                     &error))
-    {
-      g_dbus_method_invocation_take_error (state->invocation, error);
-      discovery_feed_query_state_free (state);
-
-      /* No need to free_full the out models and shards here,
-       * g_slist_copy_deep is not called if this function returns FALSE. */
-      return;
-    }
-
-  g_auto(GStrv) shards_strv = strv_from_shard_list (shards);
-
   GVariantBuilder builder;
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{ss}"));
   for (GSList *l = models; l; l = l->next)
@@ -848,75 +796,18 @@ recent_news_articles_cb (GObject *source,
       /* Stop building object */
       g_variant_builder_close (&builder);
     }
-  eks_discovery_feed_news_complete_get_recent_news (state->provider->news_skeleton,
-                                                    state->invocation,
-                                                    (const gchar * const *) shards_strv,
-                                                    g_variant_builder_end (&builder));
-  g_slist_free_full (models, g_object_unref);
-  g_slist_free_full (shards, g_object_unref);
-  discovery_feed_query_state_free (state);
-}
-
-static gboolean
-handle_get_recent_news (EksDiscoveryFeedProvider *skeleton,
-                        GDBusMethodInvocation    *invocation,
-                        gpointer                  user_data)
-{
-    EksDiscoveryFeedProvider *self = user_data;
-    DmEngine *engine = dm_engine_get_default ();
-    const char *tags_match_any[] = { "EknArticleObject", NULL };
-
-    /* Create query and run it */
-    g_autoptr(DmQuery) query = g_object_new (DM_TYPE_QUERY,
-                                             "tags-match-any", tags_match_any,
-                                             "sort", DM_QUERY_SORT_DATE,
-                                             "order", DM_QUERY_ORDER_DESCENDING,
-                                             "limit", NUMBER_OF_ARTICLES,
-                                             "app-id", self->application_id,
-                                             NULL);
 
-    /* Hold the application so that it doesn't go away whilst we're handling
-     * the query */
-    g_application_hold (g_application_get_default ());
-
-    dm_engine_query (engine, query, self->cancellable, recent_news_articles_cb,
-                     discovery_feed_query_state_new (invocation, self));
-
-    return TRUE;
+  return g_variant_new ("(^as@aa{ss})",
+                        (const gchar * const *) shards,
+                        g_variant_builder_end (&builder));
 }
 
-static void
-relevant_video_cb (GObject *source,
-                   GAsyncResult *result,
-                   gpointer user_data)
+static GVariant *
+build_videos_response (GSList     *models,
+                       GStrv       shards,
+                       GDateTime  *date,
+                       GError    **error)
 {
-  DmEngine *engine = DM_ENGINE (source);
-  DiscoveryFeedQueryState *state = user_data;
-
-  g_application_release (g_application_get_default ());
-
-  GError *error = NULL;
-  GSList *models = NULL;
-  GSList *shards = NULL;
-
-  if (!models_and_shards_for_result (engine,
-                                     state->provider->application_id,
-                                     result,
-                                     &models,
-                                     &shards,
-                                     NULL,
-                                     &error))
-    {
-      g_dbus_method_invocation_take_error (state->invocation, error);
-      discovery_feed_query_state_free (state);
-
-      /* No need to free_full the out models and shards here,
-       * g_slist_copy_deep is not called if this function returns FALSE. */
-      return;
-    }
-
-  g_auto(GStrv) shards_strv = strv_from_shard_list (shards);
-
   GVariantBuilder builder;
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{ss}"));
 
@@ -942,100 +833,1077 @@ relevant_video_cb (GObject *source,
       /* Stop building object */
       g_variant_builder_close (&builder);
     }
-  eks_discovery_feed_video_complete_get_videos (state->provider->video_skeleton,
-                                                state->invocation,
-                                                (const gchar * const *) shards_strv,
-                                                g_variant_builder_end (&builder));
-  g_slist_free_full (models, g_object_unref);
-  g_slist_free_full (shards, g_object_unref);
-  discovery_feed_query_state_free (state);
+
+  return g_variant_new ("(^as@aa{ss})",
+                        (const gchar * const *) shards,
+                        g_variant_builder_end (&builder));
 }
 
-static gboolean
-handle_get_videos (EksDiscoveryFeedProvider *skeleton,
-                   GDBusMethodInvocation    *invocation,
-                   gpointer                  user_data)
+/* Each kind of card corresponds to one of the Discovery Feed interfaces.
+ * The response is the full return value of the interface's only method. */
+typedef struct _DiscoveryFeedCardKind {
+  const gchar *interface_name;
+  DmQuery *  (*create_query)   (EksDiscoveryFeedProvider *self);
+  /* Whether to rotate through the content, using an offset depending on
+   * the day of the year */
+  gboolean     rotate;
+  GVariant * (*build_response) (GSList     *models,
+                                GStrv       shards,
+                                GDateTime  *date,
+                                GError    **error);
+} DiscoveryFeedCardKind;
+
+typedef enum {
+  DISCOVERY_FEED_CARD_CONTENT,
+  DISCOVERY_FEED_CARD_ARTWORK,
+  DISCOVERY_FEED_CARD_NEWS,
+  DISCOVERY_FEED_CARD_WORD,
+  DISCOVERY_FEED_CARD_QUOTE,
+  DISCOVERY_FEED_CARD_VIDEO,
+  DISCOVERY_FEED_N_CARD_KINDS
+} DiscoveryFeedCardKindId;
+
+static const DiscoveryFeedCardKind card_kinds[DISCOVERY_FEED_N_CARD_KINDS] = {
+  [DISCOVERY_FEED_CARD_CONTENT] = {
+    "com.endlessm.DiscoveryFeedContent",
+    create_article_cards_query,
+    TRUE,
+    build_content_article_card_descriptions_response
+  },
+  [DISCOVERY_FEED_CARD_ARTWORK] = {
+    "com.endlessm.DiscoveryFeedArtwork",
+    create_article_cards_query,
+    TRUE,
+    build_artwork_card_descriptions_response
+  },
+  [DISCOVERY_FEED_CARD_NEWS] = {
+    "com.endlessm.DiscoveryFeedNews",
+    create_article_cards_query,
+    FALSE,
+    build_recent_news_response
+  },
+  [DISCOVERY_FEED_CARD_WORD] = {
+    "com.endlessm.DiscoveryFeedWord",
+    create_article_of_the_day_query,
+    TRUE,
+    build_word_of_the_day_response
+  },
+  [DISCOVERY_FEED_CARD_QUOTE] = {
+    "com.endlessm.DiscoveryFeedQuote",
+    create_article_of_the_day_query,
+    TRUE,
+    build_quote_of_the_day_response
+  },
+  [DISCOVERY_FEED_CARD_VIDEO] = {
+    "com.endlessm.DiscoveryFeedVideo",
+    create_video_query,
+    TRUE,
+    build_videos_response
+  }
+};
+
+typedef struct _DiscoveryFeedCachedResponse {
+  gchar    *date;
+  GVariant *response;
+} DiscoveryFeedCachedResponse;
+
+static DiscoveryFeedCachedResponse *
+discovery_feed_cached_response_new (const gchar *date,
+                                    GVariant    *response)
 {
-    EksDiscoveryFeedProvider *self = user_data;
-    DmEngine *engine = dm_engine_get_default ();
-    const char *tags_match_any[] = { "EknMediaObject", NULL };
-
-    /* Hold the application so that it doesn't go away whilst we're handling
-     * the query */
-    g_application_hold (g_application_get_default ());
-
-    /* Create query and run it */
-    query_with_wraparound_offset (engine,
-                                  g_object_new (DM_TYPE_QUERY,
-                                                "content-type", "video",
-                                                "tags-match-any", tags_match_any,
-                                                "limit", 1,
-                                                "app-id", self->application_id,
-                                                NULL),
-                                  get_day_of_year (),
-                                  DAYS_IN_YEAR,
-                                  invocation,
-                                  self->cancellable,
-                                  relevant_video_cb,
-                                  discovery_feed_query_state_new (invocation, self),
-                                  (GDestroyNotify) discovery_feed_query_state_free);
+  DiscoveryFeedCachedResponse *cached = g_new0 (DiscoveryFeedCachedResponse, 1);
+  cached->date = g_strdup (date);
+  cached->response = g_variant_ref_sink (response);
 
-    return TRUE;
+  return cached;
 }
 
-static GDBusInterfaceSkeleton *
-eks_discovery_feed_provider_skeleton_for_interface (EksProvider *provider,
-                                                    const char  *interface)
+static void
+discovery_feed_cached_response_free (DiscoveryFeedCachedResponse *cached)
 {
-  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (provider);
-
-  if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedContent") == 0)
-      return G_DBUS_INTERFACE_SKELETON (self->content_skeleton);
-  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedQuote") == 0)
-      return G_DBUS_INTERFACE_SKELETON(self->quote_skeleton);
-  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedWord") == 0)
-      return G_DBUS_INTERFACE_SKELETON(self->word_skeleton);
-  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedNews") == 0)
-      return G_DBUS_INTERFACE_SKELETON (self->news_skeleton);
-  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedVideo") == 0)
-      return G_DBUS_INTERFACE_SKELETON (self->video_skeleton);
-  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedArtwork") == 0)
-      return G_DBUS_INTERFACE_SKELETON (self->artwork_skeleton);
+  g_free (cached->date);
+  g_variant_unref (cached->response);
 
-  g_assert_not_reached ();
-  return NULL;
+  g_free (cached);
 }
 
-static void
-eks_discovery_feed_provider_interface_init (EksProviderInterface *iface)
+/* Responses only change once per day, so they are cached by local date */
+static gchar *
+date_key (GDateTime *date)
 {
-  iface->skeleton_for_interface = eks_discovery_feed_provider_skeleton_for_interface;
+  return g_date_time_format (date, "%Y-%m-%d");
 }
 
-static void
-eks_discovery_feed_provider_init (EksDiscoveryFeedProvider *self)
+static gchar *
+response_cache_key (const DiscoveryFeedCardKind *kind,
+                    const gchar                 *date)
 {
-  self->content_skeleton = eks_discovery_feed_content_skeleton_new ();
-  g_signal_connect (self->content_skeleton, "handle-article-card-descriptions",
-                    G_CALLBACK (handle_content_article_card_descriptions), self);
+  return g_strconcat (date, " ", kind->interface_name, NULL);
+}
 
-  self->quote_skeleton = eks_discovery_feed_quote_skeleton_new ();
-  g_signal_connect (self->quote_skeleton, "handle-get-quote-of-the-day",
-                    G_CALLBACK (handle_get_quote_of_the_day), self);
+static GVariant *
+lookup_cached_response (EksDiscoveryFeedProvider    *self,
+                        const DiscoveryFeedCardKind *kind,
+                        GDateTime                   *date)
+{
+  g_autofree gchar *date_str = date_key (date);
+  g_autofree gchar *key = response_cache_key (kind, date_str);
+  DiscoveryFeedCachedResponse *cached = g_hash_table_lookup (self->responses, key);
 
-  self->word_skeleton = eks_discovery_feed_word_skeleton_new ();
-  g_signal_connect (self->word_skeleton, "handle-get-word-of-the-day",
-                    G_CALLBACK (handle_get_word_of_the_day), self);
+  return cached != NULL ? cached->response : NULL;
+}
 
-  self->news_skeleton = eks_discovery_feed_news_skeleton_new ();
-  g_signal_connect (self->news_skeleton, "handle-get-recent-news",
-                    G_CALLBACK (handle_get_recent_news), self);
+static gboolean
+cached_response_is_older_than (gpointer key,
+                               gpointer value,
+                               gpointer user_data)
+{
+  DiscoveryFeedCachedResponse *cached = value;
+  const gchar *date = user_data;
 
-  self->video_skeleton = eks_discovery_feed_video_skeleton_new ();
-  g_signal_connect (self->video_skeleton, "handle-get-videos",
-                    G_CALLBACK (handle_get_videos), self);
+  return g_strcmp0 (cached->date, date) < 0;
+}
 
-  self->artwork_skeleton = eks_discovery_feed_artwork_skeleton_new ();
-  g_signal_connect (self->artwork_skeleton, "handle-artwork-card-descriptions",
-                    G_CALLBACK (handle_artwork_card_descriptions), self);
+static void
+store_cached_response (EksDiscoveryFeedProvider    *self,
+                       const DiscoveryFeedCardKind *kind,
+                       GDateTime                   *date,
+                       GVariant                    *response)
+{
+  g_autoptr(GDateTime) now = g_date_time_new_now_local ();
+  g_autofree gchar *today = date_key (now);
+  g_autofree gchar *date_str = date_key (date);
+
+  /* Responses from previous days will never be served again */
+  g_hash_table_foreach_remove (self->responses,
+                               cached_response_is_older_than,
+                               today);
+
+  g_hash_table_insert (self->responses,
+                       response_cache_key (kind, date_str),
+                       discovery_feed_cached_response_new (date_str, response));
+}
+
+/* The response computed for one kind of card, or why it couldn't be */
+typedef struct _CardResult {
+  const DiscoveryFeedCardKind *kind;
+  GVariant                    *response;
+  GError                      *error;
+} CardResult;
+
+static void
+card_result_clear (CardResult *card_result)
+{
+  g_clear_pointer (&card_result->response, g_variant_unref);
+  g_clear_error (&card_result->error);
+}
+
+typedef struct _CardRequest {
+  // Array of CardResult, for kinds of card which share a query
+  GArray    *results;
+  GDateTime *date;
+  // List of DmContent, the results of the shared query
+  GSList    *models;
+  GStrv      shards;
+  gint64     start_time;
+  guint      trace_id;
+} CardRequest;
+
+static CardRequest *
+card_request_new (GPtrArray   *kinds,
+                  GDateTime   *date,
+                  const gchar *app_id)
+{
+  const DiscoveryFeedCardKind *kind = g_ptr_array_index (kinds, 0);
+  CardRequest *request = g_new0 (CardRequest, 1);
+  request->results = g_array_sized_new (FALSE, TRUE, sizeof (CardResult), kinds->len);
+  g_array_set_clear_func (request->results, (GDestroyNotify) card_result_clear);
+  request->date = g_date_time_ref (date);
+  request->start_time = g_get_monotonic_time ();
+  request->trace_id = eks_trace_request_begin (app_id, kind->interface_name);
+
+  for (guint i = 0; i < kinds->len; ++i)
+    {
+      CardResult card_result = { g_ptr_array_index (kinds, i), NULL, NULL };
+      g_array_append_val (request->results, card_result);
+    }
+
+  return request;
+}
+
+static void
+card_request_free (CardRequest *request)
+{
+  g_array_unref (request->results);
+  g_date_time_unref (request->date);
+  g_slist_free_full (request->models, g_object_unref);
+  g_strfreev (request->shards);
+  eks_trace_request_end (request->trace_id);
+
+  g_free (request);
+}
+
+/* Kinds of card which run the same query with the same offset get the
+ * same models, they only differ in how they turn them into cards */
+static gboolean
+card_kinds_share_query (const DiscoveryFeedCardKind *kind,
+                        const DiscoveryFeedCardKind *other)
+{
+  return kind->create_query == other->create_query &&
+         kind->rotate == other->rotate;
+}
+
+/* Returns an array of arrays of DiscoveryFeedCardKind, one for each query
+ * that needs to run to compute the responses of all of kinds */
+static GPtrArray *
+group_card_kinds_by_query (GPtrArray *kinds)
+{
+  GPtrArray *groups = g_ptr_array_new_with_free_func ((GDestroyNotify) g_ptr_array_unref);
+
+  for (guint i = 0; i < kinds->len; ++i)
+    {
+      const DiscoveryFeedCardKind *kind = g_ptr_array_index (kinds, i);
+      GPtrArray *group = NULL;
+
+      for (guint j = 0; j < groups->len && group == NULL; ++j)
+        {
+          GPtrArray *candidate = g_ptr_array_index (groups, j);
+          if (card_kinds_share_query (g_ptr_array_index (candidate, 0), kind))
+            group = candidate;
+        }
+
+      if (group == NULL)
+        {
+          group = g_ptr_array_new ();
+          g_ptr_array_add (groups, group);
+        }
+
+      g_ptr_array_add (group, (gpointer) kind);
+    }
+
+  return groups;
+}
+
+/* Turns the models of a request into the responses for each of its kinds
+ * of card. This runs in a worker thread, so it leaves caching the
+ * responses to on_card_responses_built(), back on the main thread. */
+static void
+build_card_responses_in_thread (GTask        *task,
+                                gpointer      source_object,
+                                gpointer      task_data,
+                                GCancellable *cancellable)
+{
+  CardRequest *request = task_data;
+
+  for (guint i = 0; i < request->results->len; ++i)
+    {
+      CardResult *card_result = &g_array_index (request->results, CardResult, i);
+      gint64 start_time = g_get_monotonic_time ();
+      GVariant *response = card_result->kind->build_response (request->models,
+                                                              request->shards,
+                                                              request->date,
+                                                              &card_result->error);
+
+      eks_metrics_record_phase (eks_metrics_get_default (),
+                                card_result->kind->interface_name,
+                                EKS_METRICS_PHASE_SERIALIZATION,
+                                g_get_monotonic_time () - start_time);
+      eks_trace_span (request->trace_id, "serialization", start_time);
+
+      if (response == NULL)
+        continue;
+
+      card_result->response = g_variant_ref_sink (response);
+    }
+
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+on_card_responses_built (GObject      *source,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (source);
+  g_autoptr(GTask) task = user_data;
+  CardRequest *request = g_task_get_task_data (task);
+
+  g_application_release (g_application_get_default ());
+
+  for (guint i = 0; i < request->results->len; ++i)
+    {
+      CardResult *card_result = &g_array_index (request->results, CardResult, i);
+
+      if (card_result->response != NULL)
+        store_cached_response (self,
+                               card_result->kind,
+                               request->date,
+                               card_result->response);
+    }
+
+  g_task_return_pointer (task,
+                         g_array_ref (request->results),
+                         (GDestroyNotify) g_array_unref);
+}
+
+static void
+on_card_query_finished (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  DmEngine *engine = DM_ENGINE (source);
+  g_autoptr(GTask) task = user_data;
+  EksDiscoveryFeedProvider *self = g_task_get_source_object (task);
+  CardRequest *request = g_task_get_task_data (task);
+
+  g_autoptr(GError) error = NULL;
+  GSList *shards = NULL;
+  gint64 engine_time = g_get_monotonic_time () - request->start_time;
+
+  for (guint i = 0; i < request->results->len; ++i)
+    eks_metrics_record_phase (eks_metrics_get_default (),
+                              g_array_index (request->results, CardResult, i).kind->interface_name,
+                              EKS_METRICS_PHASE_ENGINE,
+                              engine_time);
+  eks_trace_span (request->trace_id, "engine-query", request->start_time);
+
+  gint64 results_begin = eks_trace_begin (request->trace_id);
+  gboolean have_results = models_and_shards_for_result (engine,
+                                                        self->application_id,
+                                                        result,
+                                                        &request->models,
+                                                        &shards,
+                                                        NULL,
+                                                        &error);
+  eks_trace_span (request->trace_id, "results-and-shards", results_begin);
+
+  if (!have_results)
+    {
+      g_application_release (g_application_get_default ());
+
+      /* No need to free_full the out models and shards here,
+       * g_slist_copy_deep is not called if this function returns FALSE. */
+      for (guint i = 0; i < request->results->len; ++i)
+        g_array_index (request->results, CardResult, i).error = g_error_copy (error);
+
+      g_task_return_pointer (task,
+                             g_array_ref (request->results),
+                             (GDestroyNotify) g_array_unref);
+      return;
+    }
+
+  request->shards = strv_from_shard_list (shards);
+  g_slist_free_full (shards, g_object_unref);
+
+  /* The application stays held until the responses are built. The inner
+   * task shares the request with the outer one, which it keeps alive. */
+  g_autoptr(GTask) build_task = g_task_new (self,
+                                            NULL,
+                                            on_card_responses_built,
+                                            g_steal_pointer (&task));
+  g_task_set_task_data (build_task, request, NULL);
+
+  eks_worker_pool_run (eks_worker_pool_get_default (),
+                       self->application_id,
+                       build_task,
+                       build_card_responses_in_thread);
+}
+
+/* Runs the query shared by the given kinds of card as it should be shown
+ * on the given date, and caches the responses for that date */
+static void
+compute_card_responses (EksDiscoveryFeedProvider *self,
+                        GPtrArray                *kinds,
+                        GDateTime                *date,
+                        GCancellable             *cancellable,
+                        GAsyncReadyCallback       callback,
+                        gpointer                  user_data)
+{
+  DmEngine *engine = dm_engine_get_default ();
+  const DiscoveryFeedCardKind *kind = g_ptr_array_index (kinds, 0);
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  g_autoptr(DmQuery) query = kind->create_query (self);
+  CardRequest *request = card_request_new (kinds, date, self->application_id);
+
+  g_task_set_task_data (task, request, (GDestroyNotify) card_request_free);
+
+  /* Hold the application so that it doesn't go away whilst we're handling
+   * the query */
+  g_application_hold (g_application_get_default ());
+
+  if (kind->rotate)
+    query_with_wraparound_offset (self,
+                                  engine,
+                                  query,
+                                  g_date_time_get_day_of_year (date),
+                                  DAYS_IN_YEAR,
+                                  cancellable,
+                                  on_card_query_finished,
+                                  g_object_ref (task),
+                                  g_object_unref,
+                                  request->trace_id);
+  else
+    dm_engine_query (engine, query, cancellable, on_card_query_finished,
+                     g_object_ref (task));
+}
+
+/* Returns: (transfer full): an array of CardResult in the order of the
+ * kinds passed to compute_card_responses(), or %NULL if the operation
+ * failed as a whole */
+static GArray *
+compute_card_responses_finish (EksDiscoveryFeedProvider  *self,
+                               GAsyncResult              *result,
+                               GError                   **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+on_card_response_ready (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (source);
+  g_autoptr(GDBusMethodInvocation) invocation = user_data;
+  GError *error = NULL;
+  g_autoptr(GArray) results = compute_card_responses_finish (self,
+                                                             result,
+                                                             &error);
+
+  if (results == NULL)
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
+      return;
+    }
+
+  CardResult *card_result = &g_array_index (results, CardResult, 0);
+  if (card_result->error != NULL)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, card_result->error);
+      return;
+    }
+
+  g_dbus_method_invocation_return_value (invocation, card_result->response);
+}
+
+static gboolean
+handle_card_request (EksDiscoveryFeedProvider *self,
+                     DiscoveryFeedCardKindId   kind_id,
+                     GDBusMethodInvocation    *invocation)
+{
+  const DiscoveryFeedCardKind *kind = &card_kinds[kind_id];
+  g_autoptr(GDateTime) today = g_date_time_new_now_local ();
+  g_autoptr(GPtrArray) kinds = NULL;
+  GVariant *cached_response = NULL;
+
+  ensure_caches_for_current_shards (self, dm_engine_get_default ());
+  cached_response = lookup_cached_response (self, kind, today);
+
+  if (cached_response != NULL)
+    {
+      g_dbus_method_invocation_return_value (invocation, cached_response);
+      return TRUE;
+    }
+
+  kinds = g_ptr_array_new ();
+  g_ptr_array_add (kinds, (gpointer) kind);
+  compute_card_responses (self,
+                          kinds,
+                          today,
+                          self->cancellable,
+                          on_card_response_ready,
+                          g_object_ref (invocation));
+  return TRUE;
+}
+
+static gboolean
+handle_artwork_card_descriptions (EksDiscoveryFeedProvider *skeleton,
+                                  GDBusMethodInvocation    *invocation,
+                                  gpointer                  user_data)
+{
+  return handle_card_request (user_data,
+                              DISCOVERY_FEED_CARD_ARTWORK,
+                              invocation);
+}
+
+static gboolean
+handle_content_article_card_descriptions (EksDiscoveryFeedProvider *skeleton,
+                                          GDBusMethodInvocation    *invocation,
+                                          gpointer                  user_data)
+{
+  return handle_card_request (user_data,
+                              DISCOVERY_FEED_CARD_CONTENT,
+                              invocation);
+}
+
+static gboolean
+handle_get_word_of_the_day (EksDiscoveryFeedProvider *skeleton,
+                            GDBusMethodInvocation    *invocation,
+                            gpointer                  user_data)
+{
+  return handle_card_request (user_data,
+                              DISCOVERY_FEED_CARD_WORD,
+                              invocation);
+}
+
+static gboolean
+handle_get_quote_of_the_day (EksDiscoveryFeedProvider *skeleton,
+                             GDBusMethodInvocation    *invocation,
+                             gpointer                  user_data)
+{
+  return handle_card_request (user_data,
+                              DISCOVERY_FEED_CARD_QUOTE,
+                              invocation);
+}
+
+static gboolean
+handle_get_recent_news (EksDiscoveryFeedProvider *skeleton,
+                        GDBusMethodInvocation    *invocation,
+                        gpointer                  user_data)
+{
+  return handle_card_request (user_data,
+                              DISCOVERY_FEED_CARD_NEWS,
+                              invocation);
+}
+
+static gboolean
+handle_get_videos (EksDiscoveryFeedProvider *skeleton,
+                   GDBusMethodInvocation    *invocation,
+                   gpointer                  user_data)
+{
+  return handle_card_request (user_data,
+                              DISCOVERY_FEED_CARD_VIDEO,
+                              invocation);
+}
+
+static const DiscoveryFeedCardKind *
+card_kind_for_interface (const gchar *interface)
+{
+  for (gsize i = 0; i < G_N_ELEMENTS (card_kinds); ++i)
+    {
+      if (g_strcmp0 (card_kinds[i].interface_name, interface) == 0)
+        return &card_kinds[i];
+    }
+
+  return NULL;
+}
+
+typedef struct _CardsRequest {
+  GVariantBuilder cards;
+  GVariantBuilder errors;
+  GError          *error;
+  guint            n_pending;
+} CardsRequest;
+
+static void
+cards_request_free (CardsRequest *request)
+{
+  g_variant_builder_clear (&request->cards);
+  g_variant_builder_clear (&request->errors);
+  g_clear_error (&request->error);
+
+  g_free (request);
+}
+
+/* The cards are the last member of each card kind's response, after the
+ * shards for those kinds which return them */
+static void
+add_card_response_to_request (CardsRequest                *request,
+                              const DiscoveryFeedCardKind *kind,
+                              GVariant                    *response)
+{
+  gsize n_children = g_variant_n_children (response);
+
+  g_variant_builder_add (&request->cards, "{sv}",
+                         kind->interface_name,
+                         g_variant_get_child_value (response, n_children - 1));
+}
+
+static void
+return_cards (GTask *task)
+{
+  EksDiscoveryFeedProvider *self = g_task_get_source_object (task);
+  CardsRequest *request = g_task_get_task_data (task);
+  g_autoptr(GError) error = NULL;
+
+  if (request->error != NULL)
+    {
+      g_task_return_error (task, g_steal_pointer (&request->error));
+      return;
+    }
+
+  DmDomain *domain = dm_engine_get_domain_for_app (dm_engine_get_default (),
+                                                   self->application_id,
+                                                   &error);
+  if (domain == NULL)
+    {
+      g_task_return_error (task, eks_map_error_to_eks_error (error));
+      return;
+    }
+
+  g_auto(GStrv) shards_strv = strv_from_shard_list (dm_domain_get_shards (domain));
+  GVariant *cards = g_variant_new ("(^asa{sv}a{ss})",
+                                   shards_strv,
+                                   &request->cards,
+                                   &request->errors);
+  g_task_return_pointer (task,
+                         g_variant_ref_sink (cards),
+                         (GDestroyNotify) g_variant_unref);
+}
+
+static void
+on_cards_response_ready (GObject      *source,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (source);
+  g_autoptr(GTask) task = user_data;
+  CardsRequest *request = g_task_get_task_data (task);
+  GError *error = NULL;
+  g_autoptr(GArray) results = compute_card_responses_finish (self,
+                                                             result,
+                                                             &error);
+
+  if (results == NULL && request->error == NULL)
+    request->error = error;
+  else if (results == NULL)
+    g_error_free (error);
+
+  for (guint i = 0; results != NULL && i < results->len; ++i)
+    {
+      CardResult *card_result = &g_array_index (results, CardResult, i);
+
+      if (card_result->error != NULL)
+        g_variant_builder_add (&request->errors, "{ss}",
+                               card_result->kind->interface_name,
+                               card_result->error->message);
+      else
+        add_card_response_to_request (request, card_result->kind, card_result->response);
+    }
+
+  if (--request->n_pending > 0)
+    return;
+
+  return_cards (task);
+}
+
+/**
+ * eks_discovery_feed_provider_get_cards:
+ * @self: the discovery feed provider
+ * @interfaces: the Discovery Feed interfaces to get the cards of
+ * @cancellable: a #GCancellable
+ * @callback: called when the cards of all the interfaces are ready
+ * @user_data: data for @callback
+ *
+ * Gets today's cards for each of @interfaces, from the cache or by running
+ * the queries that they need, each only once.
+ */
+void
+eks_discovery_feed_provider_get_cards (EksDiscoveryFeedProvider *self,
+                                       const gchar * const      *interfaces,
+                                       GCancellable             *cancellable,
+                                       GAsyncReadyCallback       callback,
+                                       gpointer                  user_data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  g_autoptr(GDateTime) today = g_date_time_new_now_local ();
+  g_autoptr(GPtrArray) kinds = g_ptr_array_new ();
+  g_autoptr(GPtrArray) groups = NULL;
+  gboolean seen[DISCOVERY_FEED_N_CARD_KINDS] = { FALSE, };
+  CardsRequest *request = g_new0 (CardsRequest, 1);
+
+  g_variant_builder_init (&request->cards, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_init (&request->errors, G_VARIANT_TYPE ("a{ss}"));
+  g_task_set_task_data (task, request, (GDestroyNotify) cards_request_free);
+
+  ensure_caches_for_current_shards (self, dm_engine_get_default ());
+
+  for (const gchar * const *iter = interfaces; *iter != NULL; ++iter)
+    {
+      const DiscoveryFeedCardKind *kind = card_kind_for_interface (*iter);
+
+      if (kind == NULL)
+        {
+          g_task_return_new_error (task,
+                                   EKS_ERROR,
+                                   EKS_ERROR_INVALID_REQUEST,
+                                   "Unknown kind of card '%s'",
+                                   *iter);
+          return;
+        }
+
+      if (seen[kind - card_kinds])
+        continue;
+      seen[kind - card_kinds] = TRUE;
+
+      GVariant *cached_response = lookup_cached_response (self, kind, today);
+      if (cached_response != NULL)
+        add_card_response_to_request (request, kind, cached_response);
+      else
+        g_ptr_array_add (kinds, (gpointer) kind);
+    }
+
+  groups = group_card_kinds_by_query (kinds);
+  if (groups->len == 0)
+    {
+      return_cards (task);
+      return;
+    }
+
+  request->n_pending = groups->len;
+  for (guint i = 0; i < groups->len; ++i)
+    compute_card_responses (self,
+                            g_ptr_array_index (groups, i),
+                            today,
+                            cancellable,
+                            on_cards_response_ready,
+                            g_object_ref (task));
+}
+
+/**
+ * eks_discovery_feed_provider_get_cards_finish:
+ * @self: the discovery feed provider
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Returns: (transfer full): a "(asa{sv}a{ss})" tuple with the shards of the
+ *   app, the cards of each interface and the errors of the interfaces whose
+ *   cards couldn't be computed, or %NULL on error
+ */
+GVariant *
+eks_discovery_feed_provider_get_cards_finish (EksDiscoveryFeedProvider  *self,
+                                              GAsyncResult              *result,
+                                              GError                   **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), NULL);
+
+  return g_task_propagate_pointer (G_TASK (result), error);
+}
+
+static void
+on_get_cards_ready (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (source);
+  g_autoptr(GDBusMethodInvocation) invocation = user_data;
+  GError *error = NULL;
+  g_autoptr(GVariant) cards = eks_discovery_feed_provider_get_cards_finish (self,
+                                                                           result,
+                                                                           &error);
+
+  if (cards == NULL)
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
+      return;
+    }
+
+  g_dbus_method_invocation_return_value (invocation, cards);
+}
+
+static gboolean
+handle_get_cards (EksDiscoveryFeedCards *skeleton,
+                  GDBusMethodInvocation *invocation,
+                  const gchar * const   *interfaces,
+                  gpointer               user_data)
+{
+  EksDiscoveryFeedProvider *self = user_data;
+
+  eks_discovery_feed_provider_get_cards (self,
+                                         interfaces,
+                                         self->cancellable,
+                                         on_get_cards_ready,
+                                         g_object_ref (invocation));
+  return TRUE;
+}
+
+static void
+on_precomputed_card_response (GObject      *source,
+                              GAsyncResult *result,
+                              gpointer      user_data)
+{
+  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (source);
+  g_autoptr(GTask) task = user_data;
+  guint *n_pending = g_task_get_task_data (task);
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GArray) results = compute_card_responses_finish (self,
+                                                             result,
+                                                             &error);
+
+  /* Not every app has content for all the interfaces it claims to
+   * support, the error will be reported when the feed asks for it */
+  if (results == NULL)
+    g_debug ("Could not precompute cards for %s: %s",
+             self->application_id, error->message);
+
+  for (guint i = 0; results != NULL && i < results->len; ++i)
+    {
+      CardResult *card_result = &g_array_index (results, CardResult, i);
+      if (card_result->error != NULL)
+        g_debug ("Could not precompute %s cards for %s: %s",
+                 card_result->kind->interface_name,
+                 self->application_id,
+                 card_result->error->message);
+    }
+
+  if (--(*n_pending) > 0)
+    return;
+
+  g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * eks_discovery_feed_provider_precompute:
+ * @self: the discovery feed provider
+ * @interfaces: the Discovery Feed interfaces to compute responses for
+ * @date: the date the responses will be shown on
+ * @cancellable: a #GCancellable
+ * @callback: called when all the responses have been computed
+ * @user_data: data for @callback
+ *
+ * Computes the responses of each of @interfaces as they should be shown on
+ * @date, so that they can be served from the cache once that date comes.
+ * Responses which are already cached are not computed again.
+ */
+void
+eks_discovery_feed_provider_precompute (EksDiscoveryFeedProvider *self,
+                                        const gchar * const      *interfaces,
+                                        GDateTime                *date,
+                                        GCancellable             *cancellable,
+                                        GAsyncReadyCallback       callback,
+                                        gpointer                  user_data)
+{
+  g_autoptr(GTask) task = g_task_new (self, cancellable, callback, user_data);
+  g_autoptr(GPtrArray) kinds = g_ptr_array_new ();
+  g_autoptr(GPtrArray) groups = NULL;
+  guint *n_pending = g_new0 (guint, 1);
+
+  g_task_set_task_data (task, n_pending, g_free);
+  ensure_caches_for_current_shards (self, dm_engine_get_default ());
+
+  for (const gchar * const *iter = interfaces; iter != NULL && *iter != NULL; ++iter)
+    {
+      const DiscoveryFeedCardKind *kind = card_kind_for_interface (*iter);
+
+      if (kind == NULL || lookup_cached_response (self, kind, date) != NULL)
+        continue;
+
+      g_ptr_array_add (kinds, (gpointer) kind);
+    }
+
+  groups = group_card_kinds_by_query (kinds);
+  for (guint i = 0; i < groups->len; ++i)
+    {
+      ++(*n_pending);
+      compute_card_responses (self,
+                              g_ptr_array_index (groups, i),
+                              date,
+                              cancellable,
+                              on_precomputed_card_response,
+                              g_object_ref (task));
+    }
+
+  if (*n_pending == 0)
+    g_task_return_boolean (task, TRUE);
+}
+
+/**
+ * eks_discovery_feed_provider_precompute_finish:
+ * @self: the discovery feed provider
+ * @result: the #GAsyncResult passed to the callback
+ * @error: return location for a #GError
+ *
+ * Returns: %TRUE unless the operation was cancelled.
+ */
+gboolean
+eks_discovery_feed_provider_precompute_finish (EksDiscoveryFeedProvider  *self,
+                                               GAsyncResult              *result,
+                                               GError                   **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/* Apps only use some of the interfaces, and the batch provider none of
+ * them, so each skeleton is created the first time its interface is called */
+static GDBusInterfaceSkeleton *
+ensure_skeleton (EksDiscoveryFeedProvider  *self,
+                 gpointer                  *skeleton,
+                 GType                      skeleton_type,
+                 const gchar               *handler_signal,
+                 GCallback                  handler)
+{
+  if (*skeleton == NULL)
+    {
+      *skeleton = g_object_new (skeleton_type, NULL);
+      g_signal_connect (*skeleton, handler_signal, handler, self);
+    }
+
+  return G_DBUS_INTERFACE_SKELETON (*skeleton);
+}
+
+static GDBusInterfaceSkeleton *
+eks_discovery_feed_provider_skeleton_for_interface (EksProvider *provider,
+                                                    const char  *interface)
+{
+  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (provider);
+
+  if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedContent") == 0)
+      return ensure_skeleton (self, (gpointer *) &self->content_skeleton,
+                              EKS_TYPE_DISCOVERY_FEED_CONTENT_SKELETON,
+                              "handle-article-card-descriptions",
+                              G_CALLBACK (handle_content_article_card_descriptions));
+  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedQuote") == 0)
+      return ensure_skeleton (self, (gpointer *) &self->quote_skeleton,
+                              EKS_TYPE_DISCOVERY_FEED_QUOTE_SKELETON,
+                              "handle-get-quote-of-the-day",
+                              G_CALLBACK (handle_get_quote_of_the_day));
+  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedWord") == 0)
+      return ensure_skeleton (self, (gpointer *) &self->word_skeleton,
+                              EKS_TYPE_DISCOVERY_FEED_WORD_SKELETON,
+                              "handle-get-word-of-the-day",
+                              G_CALLBACK (handle_get_word_of_the_day));
+  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedNews") == 0)
+      return ensure_skeleton (self, (gpointer *) &self->news_skeleton,
+                              EKS_TYPE_DISCOVERY_FEED_NEWS_SKELETON,
+                              "handle-get-recent-news",
+                              G_CALLBACK (handle_get_recent_news));
+  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedVideo") == 0)
+      return ensure_skeleton (self, (gpointer *) &self->video_skeleton,
+                              EKS_TYPE_DISCOVERY_FEED_VIDEO_SKELETON,
+                              "handle-get-videos",
+                              G_CALLBACK (handle_get_videos));
+  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedArtwork") == 0)
+      return ensure_skeleton (self, (gpointer *) &self->artwork_skeleton,
+                              EKS_TYPE_DISCOVERY_FEED_ARTWORK_SKELETON,
+                              "handle-artwork-card-descriptions",
+                              G_CALLBACK (handle_artwork_card_descriptions));
+  else if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedCards") == 0)
+      return ensure_skeleton (self, (gpointer *) &self->cards_skeleton,
+                              EKS_TYPE_DISCOVERY_FEED_CARDS_SKELETON,
+                              "handle-get-cards",
+                              G_CALLBACK (handle_get_cards));
+
+  g_assert_not_reached ();
+  return NULL;
+}
+
+static gboolean
+cached_response_is_newer_than (gpointer key,
+                               gpointer value,
+                               gpointer user_data)
+{
+  DiscoveryFeedCachedResponse *cached = value;
+  const gchar *date = user_data;
+
+  return g_strcmp0 (cached->date, date) > 0;
+}
+
+/* Responses precomputed for a day that hasn't started yet would be lost */
+static gboolean
+eks_discovery_feed_provider_can_evict (EksProvider *provider)
+{
+  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (provider);
+  g_autoptr(GDateTime) now = g_date_time_new_now_local ();
+  g_autofree gchar *today = date_key (now);
+
+  return g_hash_table_find (self->responses,
+                            cached_response_is_newer_than,
+                            today) == NULL;
+}
+
+static GVariant *
+eks_discovery_feed_provider_save_state (EksProvider *provider)
+{
+  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (provider);
+  g_autoptr(GDateTime) now = g_date_time_new_now_local ();
+  g_autofree gchar *today = date_key (now);
+  GVariantBuilder upper_bounds, responses;
+  GVariantDict state;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  /* Nothing was computed from the shards yet */
+  if (self->shards_fingerprint == NULL)
+    return NULL;
+
+  g_variant_builder_init (&upper_bounds, G_VARIANT_TYPE ("a{si}"));
+  g_hash_table_iter_init (&iter, self->upper_bounds);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&upper_bounds, "{si}", key, GPOINTER_TO_INT (value));
+
+  g_variant_builder_init (&responses, G_VARIANT_TYPE ("a{s(sv)}"));
+  g_hash_table_iter_init (&iter, self->responses);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      DiscoveryFeedCachedResponse *cached = value;
+
+      if (g_strcmp0 (cached->date, today) >= 0)
+        g_variant_builder_add (&responses, "{s(sv)}", key, cached->date, cached->response);
+    }
+
+  g_variant_dict_init (&state, NULL);
+  g_variant_dict_insert_value (&state, "upper-bounds", g_variant_builder_end (&upper_bounds));
+  g_variant_dict_insert_value (&state, "responses", g_variant_builder_end (&responses));
+  return g_variant_dict_end (&state);
+}
+
+static void
+eks_discovery_feed_provider_restore_state (EksProvider *provider,
+                                           GVariant    *state)
+{
+  EksDiscoveryFeedProvider *self = EKS_DISCOVERY_FEED_PROVIDER (provider);
+  g_autoptr(GDateTime) now = g_date_time_new_now_local ();
+  g_autofree gchar *today = date_key (now);
+  g_autoptr(GVariant) upper_bounds = g_variant_lookup_value (state, "upper-bounds",
+                                                             G_VARIANT_TYPE ("a{si}"));
+  g_autoptr(GVariant) responses = g_variant_lookup_value (state, "responses",
+                                                          G_VARIANT_TYPE ("a{s(sv)}"));
+  GVariantIter iter;
+  const gchar *key, *date;
+  gint32 upper_bound;
+  GVariant *response;
+
+  /* The state was saved from the same shards as the current ones, so the
+   * caches are for those from now on */
+  ensure_caches_for_current_shards (self, dm_engine_get_default ());
+
+  if (upper_bounds != NULL)
+    {
+      g_variant_iter_init (&iter, upper_bounds);
+      while (g_variant_iter_next (&iter, "{&si}", &key, &upper_bound))
+        g_hash_table_insert (self->upper_bounds, g_strdup (key), GINT_TO_POINTER (upper_bound));
+    }
+
+  if (responses != NULL)
+    {
+      g_variant_iter_init (&iter, responses);
+      while (g_variant_iter_loop (&iter, "{&s(&sv)}", &key, &date, &response))
+        {
+          if (g_strcmp0 (date, today) >= 0)
+            g_hash_table_insert (self->responses,
+                                 g_strdup (key),
+                                 discovery_feed_cached_response_new (date, response));
+        }
+    }
+}
+
+static void
+eks_discovery_feed_provider_interface_init (EksProviderInterface *iface)
+{
+  iface->skeleton_for_interface = eks_discovery_feed_provider_skeleton_for_interface;
+  iface->can_evict = eks_discovery_feed_provider_can_evict;
+  iface->save_state = eks_discovery_feed_provider_save_state;
+  iface->restore_state = eks_discovery_feed_provider_restore_state;
+}
+
+static void
+eks_discovery_feed_provider_init (EksDiscoveryFeedProvider *self)
+{
+  self->upper_bounds = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  self->responses = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                           (GDestroyNotify) discovery_feed_cached_response_free);
 }
@@ -9,4 +9,25 @@ G_BEGIN_DECLS
 #define EKS_TYPE_DISCOVERY_FEED_PROVIDER eks_discovery_feed_provider_get_type ()
 G_DECLARE_FINAL_TYPE (EksDiscoveryFeedProvider, eks_discovery_feed_provider, EKS, DISCOVERY_FEED_PROVIDER, GObject)
 
+void eks_discovery_feed_provider_precompute (EksDiscoveryFeedProvider *self,
+                                             const gchar * const      *interfaces,
+                                             GDateTime                *date,
+                                             GCancellable             *cancellable,
+                                             GAsyncReadyCallback       callback,
+                                             gpointer                  user_data);
+
+gboolean eks_discovery_feed_provider_precompute_finish (EksDiscoveryFeedProvider  *self,
+                                                        GAsyncResult              *result,
+                                                        GError                   **error);
+
+void eks_discovery_feed_provider_get_cards (EksDiscoveryFeedProvider *self,
+                                            const gchar * const      *interfaces,
+                                            GCancellable             *cancellable,
+                                            GAsyncReadyCallback       callback,
+                                            gpointer                  user_data);
+
+GVariant * eks_discovery_feed_provider_get_cards_finish (EksDiscoveryFeedProvider  *self,
+                                                         GAsyncResult              *result,
+                                                         GError                   **error);
+
 G_END_DECLS
@@ -57,7 +57,8 @@ static const GDBusErrorEntry eks_error_entries[] =
   { EKS_ERROR_UNSUPPORTED_VERSION, "com.endlessm.EknServices.SearchProvider.UnsupportedVersion" },
   { EKS_ERROR_ID_NOT_FOUND, "com.endlessm.EknServices.SearchProvider.IdNotFound" },
   { EKS_ERROR_MALFORMED_APP, "com.endlessm.EknServices.SearchProvider.MalformedApp" },
-  { EKS_ERROR_INVALID_REQUEST, "com.endlessm.EknServices.SearchProvider.InvalidRequest" }
+  { EKS_ERROR_INVALID_REQUEST, "com.endlessm.EknServices.SearchProvider.InvalidRequest" },
+  { EKS_ERROR_CURSOR_EXPIRED, "com.endlessm.EknServices.SearchProvider.CursorExpired" }
 };
 
 GQuark
@@ -13,6 +13,8 @@ G_BEGIN_DECLS
  * @EKS_ERROR_ID_NOT_FOUND: Requested ID not found
  * @EKS_ERROR_MALFORMED_APP: App was not well-formed
  * @EKS_ERROR_INVALID_REQUEST: Caller made a malformed request
+ * @EKS_ERROR_CURSOR_EXPIRED: Query cursor is unknown, too old, or the
+ *   app's content changed since it was created
  *
  * Error enumeration for domain related errors.
  */
@@ -21,7 +23,8 @@ typedef enum {
   EKS_ERROR_UNSUPPORTED_VERSION,
   EKS_ERROR_ID_NOT_FOUND,
   EKS_ERROR_MALFORMED_APP,
-  EKS_ERROR_INVALID_REQUEST
+  EKS_ERROR_INVALID_REQUEST,
+  EKS_ERROR_CURSOR_EXPIRED
 } EksError;
 
 #define EKS_ERROR eks_error_quark ()
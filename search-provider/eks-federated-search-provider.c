@@ -0,0 +1,301 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#include "eks-federated-search-provider.h"
+
+#include "eks-errors.h"
+#include "eks-federated-search-dbus.h"
+#include "eks-provider-iface.h"
+#include "eks-query-util.h"
+
+#include <dmodel.h>
+
+#define DEFAULT_PER_APP_LIMIT 5
+#define MAX_PER_APP_LIMIT 100
+
+/**
+ * EksFederatedSearchProvider:
+ *
+ * A provider for searching the content of several knowledge apps with a
+ * single call, exported on the root of the subtree rather than for each
+ * app. The searches for all the apps run in the engine at the same time.
+ */
+struct _EksFederatedSearchProvider
+{
+  GObject parent_instance;
+
+  EksFederatedSearch *skeleton;
+};
+
+static void eks_federated_search_provider_interface_init (EksProviderInterface *);
+
+G_DEFINE_TYPE_WITH_CODE (EksFederatedSearchProvider,
+                         eks_federated_search_provider,
+                         G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (EKS_TYPE_PROVIDER,
+                                                eks_federated_search_provider_interface_init));
+
+static void
+eks_federated_search_provider_finalize (GObject *object)
+{
+  EksFederatedSearchProvider *self = EKS_FEDERATED_SEARCH_PROVIDER (object);
+
+  g_clear_object (&self->skeleton);
+
+  G_OBJECT_CLASS (eks_federated_search_provider_parent_class)->finalize (object);
+}
+
+static void
+eks_federated_search_provider_class_init (EksFederatedSearchProviderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = eks_federated_search_provider_finalize;
+}
+
+typedef struct _FederatedSearchState FederatedSearchState;
+
+typedef struct
+{
+  FederatedSearchState *state;
+  gchar *app_id;
+  GSList *models;
+  GStrv shards;  // NULL if the search failed
+} AppSearch;
+
+static void
+app_search_free (AppSearch *app)
+{
+  g_free (app->app_id);
+  g_slist_free_full (app->models, g_object_unref);
+  g_strfreev (app->shards);
+
+  g_slice_free (AppSearch, app);
+}
+
+struct _FederatedSearchState
+{
+  EksFederatedSearchProvider *self;
+  GDBusMethodInvocation *invocation;
+  // Array of AppSearch, in the order they were requested
+  GPtrArray *apps;
+  guint max_results;
+  guint n_pending;
+};
+
+static void
+federated_search_state_free (FederatedSearchState *state)
+{
+  g_object_unref (state->self);
+  g_object_unref (state->invocation);
+  g_ptr_array_unref (state->apps);
+
+  g_slice_free (FederatedSearchState, state);
+}
+
+static GVariant *
+result_for_model (const gchar *app_id,
+                  DmContent   *model)
+{
+  g_autofree gchar *id = NULL;
+  g_autofree gchar *original_title = NULL;
+  g_autofree gchar *title = NULL;
+  g_autofree gchar *synopsis = NULL;
+  g_object_get (model,
+                "id", &id,
+                "original-title", &original_title,
+                "title", &title,
+                "synopsis", &synopsis,
+                NULL);
+
+  const gchar *visible_title = (original_title && *original_title) ? original_title : title;
+
+  GVariantBuilder builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "app-id", g_variant_new_string (app_id));
+  g_variant_builder_add (&builder, "{sv}", "id", g_variant_new_string (id));
+  g_variant_builder_add (&builder, "{sv}", "title",
+                         g_variant_new_string (visible_title ? visible_title : ""));
+  if (synopsis)
+    g_variant_builder_add (&builder, "{sv}", "synopsis", g_variant_new_string (synopsis));
+  return g_variant_builder_end (&builder);
+}
+
+/* Relevance scores from different databases can't be compared, so the apps
+ * take turns instead: all the first results, then all the second results,
+ * and so on */
+static void
+return_merged_results (FederatedSearchState *state)
+{
+  guint n_apps = state->apps->len;
+  g_autofree GSList **next_models = g_new0 (GSList *, n_apps);
+  guint n_results = 0;
+  gboolean more = TRUE;
+
+  GVariantBuilder results_builder;
+  g_variant_builder_init (&results_builder, G_VARIANT_TYPE ("aa{sv}"));
+  GVariantBuilder shards_builder;
+  g_variant_builder_init (&shards_builder, G_VARIANT_TYPE ("a{sas}"));
+
+  for (guint i = 0; i < n_apps; i++)
+    {
+      AppSearch *app = g_ptr_array_index (state->apps, i);
+      next_models[i] = app->models;
+      if (app->shards != NULL)
+        g_variant_builder_add (&shards_builder, "{s^as}", app->app_id, app->shards);
+    }
+
+  while (more && (state->max_results == 0 || n_results < state->max_results))
+    {
+      more = FALSE;
+      for (guint i = 0; i < n_apps; i++)
+        {
+          AppSearch *app = g_ptr_array_index (state->apps, i);
+          if (next_models[i] == NULL)
+            continue;
+          if (state->max_results > 0 && n_results == state->max_results)
+            break;
+
+          g_variant_builder_add_value (&results_builder,
+                                       result_for_model (app->app_id, next_models[i]->data));
+          next_models[i] = next_models[i]->next;
+          n_results++;
+          more = TRUE;
+        }
+    }
+
+  g_dbus_method_invocation_return_value (state->invocation,
+                                         g_variant_new ("(aa{sv}a{sas})",
+                                                        &results_builder,
+                                                        &shards_builder));
+}
+
+static void
+on_app_search_finished (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  DmEngine *engine = DM_ENGINE (source);
+  AppSearch *app = user_data;
+  FederatedSearchState *state = app->state;
+  g_autoptr(GError) error = NULL;
+  GSList *shards = NULL;
+
+  if (models_and_shards_for_result (engine, app->app_id, result,
+                                    &app->models, &shards, NULL, &error))
+    {
+      app->shards = strv_from_shard_list (shards);
+      g_slist_free_full (shards, g_object_unref);
+    }
+  else
+    {
+      /* One app failing, for instance because it was uninstalled, shouldn't
+       * prevent the others from being searched */
+      g_warning ("Error searching %s: %s", app->app_id, error->message);
+    }
+
+  if (--state->n_pending > 0)
+    return;
+
+  return_merged_results (state);
+  federated_search_state_free (state);
+  g_application_release (g_application_get_default ());
+}
+
+static gboolean
+handle_search (EksFederatedSearch    *skeleton,
+               GDBusMethodInvocation *invocation,
+               const gchar * const   *terms,
+               const gchar * const   *app_ids,
+               guint                  per_app_limit,
+               guint                  max_results,
+               gpointer               user_data)
+{
+  EksFederatedSearchProvider *self = user_data;
+
+  if (per_app_limit > MAX_PER_APP_LIMIT)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             EKS_ERROR,
+                                             EKS_ERROR_INVALID_REQUEST,
+                                             "PerAppLimit can't be more than %d",
+                                             MAX_PER_APP_LIMIT);
+      return TRUE;
+    }
+
+  g_autofree gchar *search_terms = g_strjoinv (" ", (gchar **) terms);
+  g_autoptr(GHashTable) seen_app_ids = g_hash_table_new (g_str_hash, g_str_equal);
+  FederatedSearchState *state = g_slice_new0 (FederatedSearchState);
+  state->self = g_object_ref (self);
+  state->invocation = g_object_ref (invocation);
+  state->apps = g_ptr_array_new_with_free_func ((GDestroyNotify) app_search_free);
+  state->max_results = max_results;
+
+  for (guint i = 0; app_ids[i] != NULL; i++)
+    {
+      if (!g_hash_table_add (seen_app_ids, (gpointer) app_ids[i]))
+        continue;
+
+      AppSearch *app = g_slice_new0 (AppSearch);
+      app->state = state;
+      app->app_id = g_strdup (app_ids[i]);
+      g_ptr_array_add (state->apps, app);
+    }
+
+  if (*search_terms == '\0' || state->apps->len == 0)
+    {
+      g_ptr_array_set_size (state->apps, 0);
+      return_merged_results (state);
+      federated_search_state_free (state);
+      return TRUE;
+    }
+
+  g_application_hold (g_application_get_default ());
+
+  const char *tags_match_any[] = { "EknArticleObject", NULL };
+
+  state->n_pending = state->apps->len;
+  for (guint i = 0; i < state->apps->len; i++)
+    {
+      AppSearch *app = g_ptr_array_index (state->apps, i);
+      g_autoptr(DmQuery) query = g_object_new (DM_TYPE_QUERY,
+                                               "search-terms", search_terms,
+                                               "limit", per_app_limit > 0 ? per_app_limit : DEFAULT_PER_APP_LIMIT,
+                                               "app-id", app->app_id,
+                                               "tags-match-any", tags_match_any,
+                                               NULL);
+      dm_engine_query (dm_engine_get_default (), query, NULL,
+                       on_app_search_finished, app);
+    }
+
+  return TRUE;
+}
+
+static GDBusInterfaceSkeleton *
+eks_federated_search_provider_skeleton_for_interface (EksProvider *provider,
+                                                      const gchar *interface)
+{
+  EksFederatedSearchProvider *self = EKS_FEDERATED_SEARCH_PROVIDER (provider);
+  return G_DBUS_INTERFACE_SKELETON (self->skeleton);
+}
+
+/* Always kept, since it isn't specific to an app */
+static gboolean
+eks_federated_search_provider_can_evict (EksProvider *provider)
+{
+  return FALSE;
+}
+
+static void
+eks_federated_search_provider_interface_init (EksProviderInterface *iface)
+{
+  iface->skeleton_for_interface = eks_federated_search_provider_skeleton_for_interface;
+  iface->can_evict = eks_federated_search_provider_can_evict;
+}
+
+static void
+eks_federated_search_provider_init (EksFederatedSearchProvider *self)
+{
+  self->skeleton = eks_federated_search_skeleton_new ();
+  g_signal_connect (self->skeleton, "handle-search",
+                    G_CALLBACK (handle_search), self);
+}
@@ -0,0 +1,12 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define EKS_TYPE_FEDERATED_SEARCH_PROVIDER eks_federated_search_provider_get_type ()
+G_DECLARE_FINAL_TYPE (EksFederatedSearchProvider, eks_federated_search_provider, EKS, FEDERATED_SEARCH_PROVIDER, GObject)
+
+G_END_DECLS
@@ -0,0 +1,275 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#include "eks-lru-cache.h"
+
+#include <string.h>
+
+/**
+ * EksLruCache:
+ *
+ * A string-keyed cache which keeps at most a fixed number of entries and
+ * bytes, evicting the least recently used entries first. The size of each
+ * value is given by the caller when inserting it; the cache accounts for its
+ * own bookkeeping on top of that.
+ */
+struct _EksLruCache
+{
+  guint max_entries;
+  gsize max_bytes;
+  GDestroyNotify value_destroy_func;
+
+  // Hash table with key string keys, GList links into entries values
+  GHashTable *links;
+  // Queue of LruEntry, most recently used first
+  GQueue entries;
+  gsize n_bytes;
+
+  guint64 hits;
+  guint64 misses;
+};
+
+typedef struct
+{
+  gchar *key;
+  gpointer value;
+  gsize size;
+} LruEntry;
+
+static gsize
+lru_entry_size (const gchar *key,
+                gsize        value_size)
+{
+  return sizeof (LruEntry) + sizeof (GList) + strlen (key) + 1 + value_size;
+}
+
+static void
+lru_entry_free (EksLruCache *cache,
+                LruEntry    *entry)
+{
+  if (cache->value_destroy_func != NULL)
+    cache->value_destroy_func (entry->value);
+  g_free (entry->key);
+
+  g_slice_free (LruEntry, entry);
+}
+
+static void
+remove_link (EksLruCache *cache,
+             GList       *link)
+{
+  LruEntry *entry = link->data;
+
+  g_hash_table_remove (cache->links, entry->key);
+  g_queue_delete_link (&cache->entries, link);
+  cache->n_bytes -= entry->size;
+
+  lru_entry_free (cache, entry);
+}
+
+static void
+evict_to_limits (EksLruCache *cache)
+{
+  while (cache->entries.length > cache->max_entries ||
+         (cache->n_bytes > cache->max_bytes && cache->entries.length > 0))
+    remove_link (cache, cache->entries.tail);
+}
+
+/**
+ * eks_lru_cache_new:
+ * @max_entries: the maximum number of entries to keep
+ * @max_bytes: the maximum total size of the entries to keep
+ * @value_destroy_func: (nullable): function to free values with
+ *
+ * Returns: (transfer full): a new, empty cache
+ */
+EksLruCache *
+eks_lru_cache_new (guint          max_entries,
+                   gsize          max_bytes,
+                   GDestroyNotify value_destroy_func)
+{
+  EksLruCache *cache = g_slice_new0 (EksLruCache);
+
+  cache->max_entries = max_entries;
+  cache->max_bytes = max_bytes;
+  cache->value_destroy_func = value_destroy_func;
+  cache->links = g_hash_table_new (g_str_hash, g_str_equal);
+  g_queue_init (&cache->entries);
+
+  return cache;
+}
+
+void
+eks_lru_cache_free (EksLruCache *cache)
+{
+  eks_lru_cache_remove_all (cache);
+  g_hash_table_unref (cache->links);
+
+  g_slice_free (EksLruCache, cache);
+}
+
+/**
+ * eks_lru_cache_lookup:
+ * @cache: the cache
+ * @key: the key to look up
+ *
+ * Looks up @key and marks it as the most recently used entry.
+ *
+ * Returns: (transfer none) (nullable): the value for @key, or %NULL
+ */
+gpointer
+eks_lru_cache_lookup (EksLruCache *cache,
+                      const gchar *key)
+{
+  GList *link = g_hash_table_lookup (cache->links, key);
+
+  if (link == NULL)
+    {
+      cache->misses++;
+      return NULL;
+    }
+
+  cache->hits++;
+  g_queue_unlink (&cache->entries, link);
+  g_queue_push_head_link (&cache->entries, link);
+
+  return ((LruEntry *) link->data)->value;
+}
+
+/**
+ * eks_lru_cache_insert:
+ * @cache: the cache
+ * @key: the key to insert @value at
+ * @value: (transfer full): the value
+ * @size: the number of bytes used by @value
+ *
+ * Inserts @value as the most recently used entry, replacing any previous
+ * value for @key, and evicts the least recently used entries until the cache
+ * is back within its limits. A value larger than the whole cache is freed
+ * immediately.
+ */
+void
+eks_lru_cache_insert (EksLruCache *cache,
+                      const gchar *key,
+                      gpointer     value,
+                      gsize        size)
+{
+  LruEntry *entry = g_slice_new0 (LruEntry);
+
+  eks_lru_cache_remove (cache, key);
+
+  entry->key = g_strdup (key);
+  entry->value = value;
+  entry->size = lru_entry_size (key, size);
+
+  g_queue_push_head (&cache->entries, entry);
+  g_hash_table_insert (cache->links, entry->key, cache->entries.head);
+  cache->n_bytes += entry->size;
+
+  evict_to_limits (cache);
+}
+
+/**
+ * eks_lru_cache_update_size:
+ * @cache: the cache
+ * @key: the key of the entry whose value changed size
+ * @size: the new number of bytes used by the value
+ *
+ * Updates the size of a value which was modified in place, and evicts the
+ * least recently used entries if the cache went over its limits. This does
+ * not count as a use of the entry.
+ *
+ * Returns: %TRUE if there was an entry for @key
+ */
+gboolean
+eks_lru_cache_update_size (EksLruCache *cache,
+                           const gchar *key,
+                           gsize        size)
+{
+  GList *link = g_hash_table_lookup (cache->links, key);
+  LruEntry *entry;
+
+  if (link == NULL)
+    return FALSE;
+
+  entry = link->data;
+  cache->n_bytes -= entry->size;
+  entry->size = lru_entry_size (key, size);
+  cache->n_bytes += entry->size;
+
+  evict_to_limits (cache);
+  return TRUE;
+}
+
+/**
+ * eks_lru_cache_remove:
+ * @cache: the cache
+ * @key: the key to remove
+ *
+ * Returns: %TRUE if there was an entry for @key
+ */
+gboolean
+eks_lru_cache_remove (EksLruCache *cache,
+                      const gchar *key)
+{
+  GList *link = g_hash_table_lookup (cache->links, key);
+
+  if (link == NULL)
+    return FALSE;
+
+  remove_link (cache, link);
+  return TRUE;
+}
+
+void
+eks_lru_cache_remove_all (EksLruCache *cache)
+{
+  while (cache->entries.tail != NULL)
+    remove_link (cache, cache->entries.tail);
+}
+
+/**
+ * eks_lru_cache_foreach:
+ * @cache: the cache
+ * @func: the function to call with each key and value
+ * @user_data: user data to pass to @func
+ *
+ * Calls @func on every entry, from the least to the most recently used, so
+ * that inserting the entries into another cache in the same order keeps
+ * their order. This does not count as a use of the entries, and @func must
+ * not modify the cache.
+ */
+void
+eks_lru_cache_foreach (EksLruCache *cache,
+                       GHFunc       func,
+                       gpointer     user_data)
+{
+  for (GList *link = cache->entries.tail; link != NULL; link = link->prev)
+    {
+      LruEntry *entry = link->data;
+      func (entry->key, entry->value, user_data);
+    }
+}
+
+guint
+eks_lru_cache_get_n_entries (EksLruCache *cache)
+{
+  return cache->entries.length;
+}
+
+gsize
+eks_lru_cache_get_n_bytes (EksLruCache *cache)
+{
+  return cache->n_bytes;
+}
+
+guint64
+eks_lru_cache_get_hits (EksLruCache *cache)
+{
+  return cache->hits;
+}
+
+guint64
+eks_lru_cache_get_misses (EksLruCache *cache)
+{
+  return cache->misses;
+}
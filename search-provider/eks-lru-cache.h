@@ -0,0 +1,48 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EksLruCache EksLruCache;
+
+EksLruCache * eks_lru_cache_new (guint          max_entries,
+                                 gsize          max_bytes,
+                                 GDestroyNotify value_destroy_func);
+
+void eks_lru_cache_free (EksLruCache *cache);
+
+gpointer eks_lru_cache_lookup (EksLruCache *cache,
+                               const gchar *key);
+
+void eks_lru_cache_insert (EksLruCache *cache,
+                           const gchar *key,
+                           gpointer     value,
+                           gsize        size);
+
+gboolean eks_lru_cache_update_size (EksLruCache *cache,
+                                    const gchar *key,
+                                    gsize        size);
+
+gboolean eks_lru_cache_remove (EksLruCache *cache,
+                               const gchar *key);
+
+void eks_lru_cache_remove_all (EksLruCache *cache);
+
+void eks_lru_cache_foreach (EksLruCache *cache,
+                            GHFunc       func,
+                            gpointer     user_data);
+
+guint eks_lru_cache_get_n_entries (EksLruCache *cache);
+
+gsize eks_lru_cache_get_n_bytes (EksLruCache *cache);
+
+guint64 eks_lru_cache_get_hits (EksLruCache *cache);
+
+guint64 eks_lru_cache_get_misses (EksLruCache *cache);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EksLruCache, eks_lru_cache_free)
+
+G_END_DECLS
@@ -4,18 +4,39 @@
 #include "dm-enums.h"
 
 #include "eks-errors.h"
+#include "eks-lru-cache.h"
+#include "eks-metrics.h"
 #include "eks-provider-iface.h"
 #include "eks-query-util.h"
+#include "eks-trace.h"
+#include "eks-worker-pool.h"
 
 #include "eks-knowledge-app-dbus.h"
 #include "eks-metadata-provider.h"
 #include "eks-metadata-provider-dbus.h"
 
+#include <gio/gunixfdlist.h>
 #include <json-glib/json-glib.h>
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Cursors are dropped when unused for this long, or when there are too many
+ * of them; each one keeps the IDs of the results fetched so far */
+#define CURSOR_LIFETIME_USEC (10 * 60 * G_USEC_PER_SEC)
+#define CURSOR_CACHE_MAX_ENTRIES 32
+#define CURSOR_CACHE_MAX_BYTES (4 * 1024 * 1024)
+/* The ranked results of a cursor are extended in batches covering the page
+ * asked for, plus as many results again as were already ranked, at least a
+ * page and at most this many, so that paging through the results runs the
+ * query once every few pages without loading many more models than a page
+ * needs */
+#define CURSOR_MAX_PREFETCH 200
 
 struct _EksMetadataProvider
 {
@@ -23,7 +44,9 @@ struct _EksMetadataProvider
 
   char *application_id;
   EksContentMetadata *skeleton;
-  GHashTable *translation_infos;
+  EksContentMetadata2 *skeleton2;
+  // LRU cache with cursor token string keys, MetadataCursor values
+  EksLruCache *cursors;
 };
 
 static void eks_metadata_provider_interface_init (EksProviderInterface *iface);
@@ -88,7 +111,9 @@ eks_metadata_provider_finalize (GObject *object)
 
   g_clear_pointer (&self->application_id, g_free);
   g_clear_object (&self->skeleton);
-  g_clear_pointer (&self->translation_infos, g_hash_table_unref);
+  g_clear_object (&self->skeleton2);
+  eks_metrics_remove_cache (eks_metrics_get_default (), self->cursors);
+  g_clear_pointer (&self->cursors, eks_lru_cache_free);
 
   G_OBJECT_CLASS (eks_metadata_provider_parent_class)->finalize (object);
 }
@@ -111,18 +136,134 @@ eks_metadata_provider_class_init (EksMetadataProviderClass *klass)
                                      eks_metadata_provider_props);
 }
 
-typedef struct _MetadataQueryState {
+/* The results of a query which the client pages through with a cursor.
+ * Only the IDs of the results ranked so far are kept, in order; pages
+ * within them are looked up by ID, and the query is only run again, from
+ * the end of them, for pages past it. */
+typedef struct _MetadataCursor {
+  gint      ref_count;
+  DmQuery  *query;
+  gchar    *shards_fingerprint;
+  // Array of the ID strings of the results ranked so far, in order
+  GPtrArray *ids;
+  gsize     ids_size;
+  gint      upper_bound;
+  gboolean  exhausted;
+  // Array of MetadataQueryGroup waiting for a batch of results to be
+  // ranked, or NULL if none is being fetched
+  GPtrArray *waiting_groups;
+  gint64    last_used;
+} MetadataCursor;
+
+static MetadataCursor *
+metadata_cursor_new (DmQuery     *query,
+                     const gchar *shards_fingerprint)
+{
+  MetadataCursor *cursor = g_new0 (MetadataCursor, 1);
+  cursor->ref_count = 1;
+  cursor->query = g_object_ref (query);
+  cursor->shards_fingerprint = g_strdup (shards_fingerprint);
+  cursor->ids = g_ptr_array_new_with_free_func (g_free);
+  cursor->last_used = g_get_monotonic_time ();
+
+  return cursor;
+}
+
+static MetadataCursor *
+metadata_cursor_ref (MetadataCursor *cursor)
+{
+  cursor->ref_count++;
+  return cursor;
+}
+
+static void
+metadata_cursor_unref (MetadataCursor *cursor)
+{
+  if (--cursor->ref_count > 0)
+    return;
+
+  g_clear_object (&cursor->query);
+  g_free (cursor->shards_fingerprint);
+  g_ptr_array_unref (cursor->ids);
+  g_clear_pointer (&cursor->waiting_groups, g_ptr_array_unref);
+
+  g_free (cursor);
+}
+
+static gsize
+metadata_cursor_size (MetadataCursor *cursor)
+{
+  return sizeof (MetadataCursor) + cursor->ids_size;
+}
+
+static gint
+metadata_cursor_upper_bound (MetadataCursor *cursor)
+{
+  return cursor->exhausted ? (gint) cursor->ids->len : cursor->upper_bound;
+}
+
+typedef struct _MetadataQueryState MetadataQueryState;
+
+/* All the queries in a single Query call which only differ in their
+ * "offset" and "limit" parameters, and whose windows overlap or touch,
+ * share a single engine execution, which covers the union of their
+ * windows. Queries using a cursor each have a group of their own. */
+typedef struct _MetadataQueryGroup {
+  MetadataQueryState *state;
+  DmQuery            *query;
+  guint               offset;
+  guint               end;
+  GSList             *models;
+  gint                upper_bound;
+  MetadataCursor     *cursor;
+  gchar              *cursor_token;
+} MetadataQueryGroup;
+
+typedef struct _MetadataQueryEntry {
+  guint   offset;
+  guint   limit;
+  guint   group_index;
+  guint32 fields;
+  guint   max_text_length;
+} MetadataQueryEntry;
+
+struct _MetadataQueryState {
   EksMetadataProvider   *provider;
   GDBusMethodInvocation *invocation;
-} MetadataQueryState;
+  GArray                *entries;
+  GPtrArray             *groups;
+  guint                  n_pending;
+  GError                *error;
+  gboolean               results_in_fd;
+  GStrv                  shards;
+  GUnixFDList           *fd_list;
+  gint64                 start_time;
+  guint                  trace_id;
+};
+
+static void
+metadata_query_group_free (MetadataQueryGroup *group)
+{
+  g_clear_object (&group->query);
+  g_slist_free_full (group->models, g_object_unref);
+  g_clear_pointer (&group->cursor, metadata_cursor_unref);
+  g_free (group->cursor_token);
+
+  g_free (group);
+}
 
 static MetadataQueryState *
 metadata_query_state_new (EksMetadataProvider   *provider,
                           GDBusMethodInvocation *invocation)
 {
   MetadataQueryState *state = g_new0 (MetadataQueryState, 1);
-  state->provider = provider;
+  state->provider = g_object_ref (provider);
   state->invocation = g_object_ref (invocation);
+  state->start_time = g_get_monotonic_time ();
+  state->trace_id = eks_trace_request_begin (provider->application_id,
+                                             g_dbus_method_invocation_get_interface_name (invocation));
+  state->entries = g_array_new (FALSE, TRUE, sizeof (MetadataQueryEntry));
+  state->groups = g_ptr_array_new_with_free_func ((GDestroyNotify) metadata_query_group_free);
 
   return state;
 }
@@ -130,7 +271,14 @@ metadata_query_state_new (EksMetadataProvider   *provider,
 static void
 metadata_query_state_free (MetadataQueryState *state)
 {
+  g_clear_object (&state->provider);
   g_clear_object (&state->invocation);
+  g_clear_pointer (&state->entries, g_array_unref);
+  g_clear_pointer (&state->groups, g_ptr_array_unref);
+  g_clear_error (&state->error);
+  g_clear_pointer (&state->shards, g_strfreev);
+  g_clear_object (&state->fd_list);
+  eks_trace_request_end (state->trace_id);
 
   g_free (state);
 }
@@ -149,306 +297,991 @@ add_key_value_pair_to_variant (GVariantBuilder *builder,
   g_variant_builder_close (builder);
 }
 
-static void add_dbus_friendly_keys_recurse_into_json_structure (JsonBuilder  *builder,
-                                                                JsonNode     *node,
-                                                                JsonNodeType  node_type);
+static void add_json_node_to_builder (GVariantBuilder *builder,
+                                      JsonNode        *node);
 
 static void
-copy_non_null_json_object_key (JsonObject  *source_object,
-                               const gchar *member_name,
-                               JsonNode    *member_node,
-                               gpointer     user_data)
+add_json_object_member_to_builder (JsonObject  *object,
+                                   const gchar *member_name,
+                                   JsonNode    *member_node,
+                                   gpointer     user_data)
 {
-  JsonBuilder *builder = user_data;
-  JsonNodeType member_node_type = json_node_get_node_type (member_node);
+  GVariantBuilder *builder = user_data;
+
+  if (JSON_NODE_HOLDS_NULL (member_node))
+    return;
+
+  g_variant_builder_open (builder, G_VARIANT_TYPE ("{sv}"));
+  g_variant_builder_add (builder, "s", member_name);
+  g_variant_builder_open (builder, G_VARIANT_TYPE_VARIANT);
+  add_json_node_to_builder (builder, member_node);
+  g_variant_builder_close (builder);
+  g_variant_builder_close (builder);
+}
+
+static void
+add_json_array_element_to_builder (JsonArray *array,
+                                   guint      index,
+                                   JsonNode  *element_node,
+                                   gpointer   user_data)
+{
+  GVariantBuilder *builder = user_data;
+
+  if (JSON_NODE_HOLDS_NULL (element_node))
+    return;
+
+  g_variant_builder_open (builder, G_VARIANT_TYPE_VARIANT);
+  add_json_node_to_builder (builder, element_node);
+  g_variant_builder_close (builder);
+}
 
-  switch (member_node_type)
+/* The d-bus wire protocol doesn't support maybe types,
+ * but GVariant does. The way that this is handled in consuming
+ * applications is to check if the property exists on the vardict,
+ * so all NULL-valued members and elements are left out, recursively.
+ *
+ * Otherwise, this produces the same types as json_gvariant_deserialize()
+ * without a signature: objects become a{sv}, arrays become av, and values
+ * become x, d, b or s. */
+static void
+add_json_node_to_builder (GVariantBuilder *builder,
+                          JsonNode        *node)
+{
+  switch (json_node_get_node_type (node))
     {
       case JSON_NODE_OBJECT:
+        g_variant_builder_open (builder, G_VARIANT_TYPE_VARDICT);
+        json_object_foreach_member (json_node_get_object (node),
+                                    add_json_object_member_to_builder,
+                                    builder);
+        g_variant_builder_close (builder);
+        break;
       case JSON_NODE_ARRAY:
-        json_builder_set_member_name (builder, member_name);
-        add_dbus_friendly_keys_recurse_into_json_structure (builder,
-                                                            member_node,
-                                                            member_node_type);
+        g_variant_builder_open (builder, G_VARIANT_TYPE ("av"));
+        json_array_foreach_element (json_node_get_array (node),
+                                    add_json_array_element_to_builder,
+                                    builder);
+        g_variant_builder_close (builder);
         break;
       case JSON_NODE_VALUE:
-        json_builder_set_member_name (builder, member_name);
-        json_builder_add_value (builder, json_node_ref (member_node));
+        switch (json_node_get_value_type (node))
+          {
+            case G_TYPE_INT64:
+              g_variant_builder_add (builder, "x", json_node_get_int (node));
+              break;
+            case G_TYPE_DOUBLE:
+              g_variant_builder_add (builder, "d", json_node_get_double (node));
+              break;
+            case G_TYPE_BOOLEAN:
+              g_variant_builder_add (builder, "b", json_node_get_boolean (node));
+              break;
+            case G_TYPE_STRING:
+              g_variant_builder_add (builder, "s", json_node_get_string (node));
+              break;
+            default:
+              g_assert_not_reached ();
+          }
         break;
       case JSON_NODE_NULL:
-        break;
+        g_assert_not_reached ();
+    }
+}
+
+typedef struct _ModelVariantTypes {
+  const gchar        *prop_name;
+  const GVariantType *variant_type;
+  gboolean            long_text;
+} ModelVariantTypes;
+
+static const ModelVariantTypes model_variant_types[] = {
+  { "child_tags", G_VARIANT_TYPE_STRING_ARRAY, FALSE },
+  { "content_type", G_VARIANT_TYPE_STRING, FALSE },
+  { "copyright_holder", G_VARIANT_TYPE_STRING, FALSE },
+  { "discovery_feed_content", G_VARIANT_TYPE_VARDICT, FALSE },
+  { "featured", G_VARIANT_TYPE_BOOLEAN, FALSE },
+  { "id", G_VARIANT_TYPE_STRING, FALSE },
+  { "language", G_VARIANT_TYPE_STRING, FALSE },
+  { "last_modified_date", G_VARIANT_TYPE_STRING, FALSE },
+  { "license", G_VARIANT_TYPE_STRING, FALSE },
+  { "original_title", G_VARIANT_TYPE_STRING, FALSE },
+  { "original_uri", G_VARIANT_TYPE_STRING, FALSE },
+  { "synopsis", G_VARIANT_TYPE_STRING, TRUE },
+  { "tags", G_VARIANT_TYPE_STRING_ARRAY, FALSE },
+  { "temporal_coverage", G_VARIANT_TYPE_STRING_ARRAY, FALSE },
+  { "title", G_VARIANT_TYPE_STRING, FALSE },
+  { "thumbnail_uri", G_VARIANT_TYPE_STRING, FALSE }
+};
+static const gsize model_variant_types_n = G_N_ELEMENTS (model_variant_types);
+
+/* Selected fields are a bitmask of indices into model_variant_types */
+G_STATIC_ASSERT (G_N_ELEMENTS (model_variant_types) <= 32);
+#define ALL_MODEL_FIELDS G_MAXUINT32
+
+static gboolean
+model_fields_from_names (const char * const  *names,
+                         guint32             *fields,
+                         GError             **error)
+{
+  *fields = 0;
+
+  for (const char * const *iter = names; *iter != NULL; ++iter)
+    {
+      gsize i = 0;
+
+      for (; i < model_variant_types_n; ++i)
+        {
+          if (g_strcmp0 (model_variant_types[i].prop_name, *iter) == 0)
+            break;
+        }
+
+      if (i == model_variant_types_n)
+        {
+          g_set_error (error,
+                       EKS_ERROR,
+                       EKS_ERROR_INVALID_REQUEST,
+                       "Invalid field: %s",
+                       *iter);
+          return FALSE;
+        }
+
+      *fields |= 1u << i;
     }
+
+  return TRUE;
+}
+
+/* Cuts str to at most max_length characters, or returns NULL if it
+ * is already short enough */
+static gchar *
+truncate_utf8_string (const gchar *str,
+                      guint        max_length)
+{
+  const gchar *end = str;
+
+  for (guint i = 0; i < max_length && *end != '\0'; ++i)
+    end = g_utf8_next_char (end);
+
+  if (*end == '\0')
+    return NULL;
+
+  return g_strndup (str, end - str);
+}
+
+typedef struct _ModelFieldAccessor ModelFieldAccessor;
+
+/* Adds the key and the converted value to the vardict being built, unless
+ * the property is not set. A max_text_length of 0 means no truncation. */
+typedef void (*ModelFieldConvertFunc) (const ModelFieldAccessor *accessor,
+                                       const GValue             *value,
+                                       guint                     max_text_length,
+                                       GVariantBuilder          *builder);
+
+/* Everything needed to read one of model_variant_types from models of a
+ * given type, resolved once per type */
+struct _ModelFieldAccessor {
+  guint                   field_index;
+  GParamSpec             *pspec;
+  guint                   param_id;
+  GObjectGetPropertyFunc  get_property;
+  ModelFieldConvertFunc   convert;
+};
+
+static inline const char *
+model_field_accessor_key (const ModelFieldAccessor *accessor)
+{
+  return model_variant_types[accessor->field_index].prop_name;
+}
+
+static void
+convert_string_field (const ModelFieldAccessor *accessor,
+                      const GValue             *value,
+                      guint                     max_text_length,
+                      GVariantBuilder          *builder)
+{
+  const gchar *str = g_value_get_string (value);
+  gchar *truncated = NULL;
+
+  if (str == NULL)
+    return;
+
+  if (max_text_length > 0 &&
+      (truncated = truncate_utf8_string (str, max_text_length)) != NULL)
+    {
+      add_key_value_pair_to_variant (builder,
+                                     model_field_accessor_key (accessor),
+                                     g_variant_new_take_string (truncated));
+      return;
+    }
+
+  add_key_value_pair_to_variant (builder,
+                                 model_field_accessor_key (accessor),
+                                 g_variant_new_string (str));
+}
+
+static void
+convert_strv_field (const ModelFieldAccessor *accessor,
+                    const GValue             *value,
+                    guint                     max_text_length,
+                    GVariantBuilder          *builder)
+{
+  const gchar * const *strv = g_value_get_boxed (value);
+
+  if (strv == NULL)
+    return;
+
+  add_key_value_pair_to_variant (builder,
+                                 model_field_accessor_key (accessor),
+                                 g_variant_new_strv (strv, -1));
+}
+
+static void
+convert_boolean_field (const ModelFieldAccessor *accessor,
+                       const GValue             *value,
+                       guint                     max_text_length,
+                       GVariantBuilder          *builder)
+{
+  add_key_value_pair_to_variant (builder,
+                                 model_field_accessor_key (accessor),
+                                 g_variant_new_boolean (g_value_get_boolean (value)));
 }
 
+/* Writes the object straight into the models' builder in a single pass,
+ * without copying it first */
 static void
-build_dbus_friendly_json_object_from_object (JsonBuilder *builder,
-                                             JsonObject  *object)
+convert_json_object_field (const ModelFieldAccessor *accessor,
+                           const GValue             *value,
+                           guint                     max_text_length,
+                           GVariantBuilder          *builder)
 {
-  json_builder_begin_object (builder);
+  JsonObject *object = g_value_get_boxed (value);
+
+  if (object == NULL)
+    return;
+
+  g_variant_builder_open (builder, G_VARIANT_TYPE ("{sv}"));
+  g_variant_builder_add (builder, "s", model_field_accessor_key (accessor));
+  g_variant_builder_open (builder, G_VARIANT_TYPE_VARIANT);
+  g_variant_builder_open (builder, G_VARIANT_TYPE_VARDICT);
   json_object_foreach_member (object,
-                              copy_non_null_json_object_key,
+                              add_json_object_member_to_builder,
                               builder);
-  json_builder_end_object (builder);
+  g_variant_builder_close (builder);
+  g_variant_builder_close (builder);
+  g_variant_builder_close (builder);
 }
 
 static void
-copy_non_null_json_array_element (JsonArray  *source_array,
-                                  guint       member_index,
-                                  JsonNode   *member_node,
-                                  gpointer    user_data)
+convert_other_field (const ModelFieldAccessor *accessor,
+                     const GValue             *value,
+                     guint                     max_text_length,
+                     GVariantBuilder          *builder)
+{
+  g_autoptr(GVariant) converted =
+    g_dbus_gvalue_to_gvariant (value,
+                               model_variant_types[accessor->field_index].variant_type);
+
+  /* If we got NULL here it just means that the source property was NULL,
+   * so don't add it. */
+  if (converted == NULL)
+    return;
+
+  add_key_value_pair_to_variant (builder,
+                                 model_field_accessor_key (accessor),
+                                 converted);
+}
+
+static ModelFieldConvertFunc
+convert_func_for_field (const ModelVariantTypes *model_prop,
+                        GType                    value_type)
+{
+  if (model_prop->variant_type == G_VARIANT_TYPE_VARDICT)
+    return convert_json_object_field;
+  if (value_type == G_TYPE_STRING &&
+      g_variant_type_equal (model_prop->variant_type, G_VARIANT_TYPE_STRING))
+    return convert_string_field;
+  if (value_type == G_TYPE_STRV &&
+      g_variant_type_equal (model_prop->variant_type, G_VARIANT_TYPE_STRING_ARRAY))
+    return convert_strv_field;
+  if (value_type == G_TYPE_BOOLEAN &&
+      g_variant_type_equal (model_prop->variant_type, G_VARIANT_TYPE_BOOLEAN))
+    return convert_boolean_field;
+
+  return convert_other_field;
+}
+
+/* Resolves the properties of model_variant_types in the same way as
+ * g_object_get_property() does, including overridden properties */
+static GArray *
+model_field_accessors_new (GType type)
 {
-  JsonBuilder *builder = user_data;
-  JsonNodeType member_node_type = json_node_get_node_type (member_node);
+  GObjectClass *klass = g_type_class_peek (type);
+  GArray *accessors = g_array_new (FALSE, TRUE, sizeof (ModelFieldAccessor));
 
-  switch (member_node_type)
+  for (gsize i = 0; i < model_variant_types_n; ++i)
     {
-      case JSON_NODE_OBJECT:
-      case JSON_NODE_ARRAY:
-        add_dbus_friendly_keys_recurse_into_json_structure (builder,
-                                                            member_node,
-                                                            member_node_type);
-        break;
-      case JSON_NODE_VALUE:
-        json_builder_add_value (builder, json_node_ref (member_node));
-        break;
-      case JSON_NODE_NULL:
-        break;
+      const ModelVariantTypes *model_prop = &model_variant_types[i];
+      GParamSpec *pspec = g_object_class_find_property (klass,
+                                                        model_prop->prop_name);
+      GParamSpec *redirect = NULL;
+      ModelFieldAccessor accessor;
+
+      if (pspec == NULL || (pspec->flags & G_PARAM_READABLE) == 0)
+        continue;
+
+      accessor.field_index = i;
+      accessor.param_id = pspec->param_id;
+      accessor.get_property = G_OBJECT_CLASS (g_type_class_peek (pspec->owner_type))->get_property;
+
+      redirect = g_param_spec_get_redirect_target (pspec);
+      accessor.pspec = redirect != NULL ? redirect : pspec;
+      accessor.convert = convert_func_for_field (model_prop,
+                                                 accessor.pspec->value_type);
+
+      g_array_append_val (accessors, accessor);
     }
+
+  return accessors;
+}
+
+G_LOCK_DEFINE_STATIC (model_field_accessors);
+// Hash table with GType keys, GArray of ModelFieldAccessor values
+static GHashTable *model_field_accessors = NULL;
+
+static GArray *
+model_field_accessors_for_type (GType type)
+{
+  GArray *accessors = NULL;
+
+  G_LOCK (model_field_accessors);
+
+  if (model_field_accessors == NULL)
+    model_field_accessors = g_hash_table_new (g_direct_hash, g_direct_equal);
+
+  accessors = g_hash_table_lookup (model_field_accessors, GSIZE_TO_POINTER (type));
+  if (accessors == NULL)
+    {
+      accessors = model_field_accessors_new (type);
+      g_hash_table_insert (model_field_accessors, GSIZE_TO_POINTER (type), accessors);
+    }
+
+  G_UNLOCK (model_field_accessors);
+
+  return accessors;
 }
 
 static void
-build_dbus_friendly_json_array_from_array (JsonBuilder *builder,
-                                           JsonArray   *array)
+add_model_field_to_variant (DmContent                *model,
+                            const ModelFieldAccessor *accessor,
+                            GVariantBuilder          *builder,
+                            guint                     max_text_length)
 {
-  json_builder_begin_array (builder);
-  json_array_foreach_element (array,
-                              copy_non_null_json_array_element,
-                              builder);
-  json_builder_end_array (builder);
+  const ModelVariantTypes *model_prop = &model_variant_types[accessor->field_index];
+  g_auto(GValue) value = G_VALUE_INIT;
+
+  g_value_init (&value, accessor->pspec->value_type);
+  accessor->get_property (G_OBJECT (model),
+                          accessor->param_id,
+                          &value,
+                          accessor->pspec);
+
+  accessor->convert (accessor,
+                     &value,
+                     model_prop->long_text ? max_text_length : 0,
+                     builder);
+}
+
+/* Serializes the given fields of at most max_models models, starting from
+ * the head of models. Long text fields are cut to max_text_length
+ * characters, unless it is 0. */
+static GVariant *
+build_models_variants (GSList  *models,
+                       guint    max_models,
+                       guint32  fields,
+                       guint    max_text_length)
+{
+  g_auto(GVariantBuilder) builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+
+  GType accessors_type = G_TYPE_INVALID;
+  GArray *accessors = NULL;
+
+  for (GSList *l = models; l && max_models > 0; l = l->next, --max_models)
+    {
+      DmContent *model = l->data;
+
+      /* Results are usually all of the same few types */
+      if (G_OBJECT_TYPE (model) != accessors_type)
+        {
+          accessors_type = G_OBJECT_TYPE (model);
+          accessors = model_field_accessors_for_type (accessors_type);
+        }
+
+      g_variant_builder_open (&builder, G_VARIANT_TYPE_VARDICT);
+
+      for (guint i = 0; i < accessors->len; ++i)
+        {
+          const ModelFieldAccessor *accessor = &g_array_index (accessors,
+                                                               ModelFieldAccessor,
+                                                               i);
+
+          if ((fields & (1u << accessor->field_index)) == 0)
+            continue;
+
+          add_model_field_to_variant (model,
+                                      accessor,
+                                      &builder,
+                                      max_text_length);
+        }
+
+      g_variant_builder_close (&builder);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+/* Returns a file descriptor for a sealed, read-only in-memory file with the
+ * given contents, or -1 on error */
+static int
+create_sealed_memfd (const void  *data,
+                     gsize        size,
+                     GError     **error)
+{
+  const char *name = "eks-query-results";
+  const guint8 *remaining = data;
+  int fd;
+
+#ifdef HAVE_MEMFD_CREATE
+  fd = memfd_create (name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+  /* Without memfd, fall back to an unlinked temporary file, which can't
+   * be sealed */
+  g_autofree char *path = NULL;
+  fd = g_file_open_tmp ("eks-query-results-XXXXXX", &path, error);
+  if (fd < 0)
+    return -1;
+  unlink (path);
+#endif
+
+  if (fd < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Could not create %s: %s", name, g_strerror (errsv));
+      return -1;
+    }
+
+  while (size > 0)
+    {
+      gssize written = write (fd, remaining, size);
+
+      if (written < 0)
+        {
+          int errsv = errno;
+
+          if (errsv == EINTR)
+            continue;
+
+          g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                       "Could not write %s: %s", name, g_strerror (errsv));
+          close (fd);
+          return -1;
+        }
+
+      remaining += written;
+      size -= written;
+    }
+
+#ifdef HAVE_MEMFD_CREATE
+  if (fcntl (fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Could not seal %s: %s", name, g_strerror (errsv));
+      close (fd);
+      return -1;
+    }
+#endif
+
+  return fd;
 }
 
+/* Builds the reply to a Query call from the finished state. This runs in a
+ * worker thread, so it must only read the state, which the main thread
+ * leaves alone until the task returns. */
 static void
-add_dbus_friendly_keys_recurse_into_json_structure (JsonBuilder  *builder,
-			                            JsonNode     *node,
-			                            JsonNodeType  node_type)
+build_metadata_reply_in_thread (GTask        *task,
+                                gpointer      source_object,
+                                gpointer      task_data,
+                                GCancellable *cancellable)
 {
-  switch (node_type)
+  MetadataQueryState *state = task_data;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) results = NULL;
+  g_auto(GVariantBuilder) results_builder;
+  GVariant *reply = NULL;
+  gint64 start_time = g_get_monotonic_time ();
+
+  g_variant_builder_init (&results_builder, G_VARIANT_TYPE ("a(a{sv}aa{sv})"));
+
+  for (guint i = 0; i < state->entries->len; ++i)
     {
-      case JSON_NODE_OBJECT:
-        build_dbus_friendly_json_object_from_object (builder,
-                                                     json_node_get_object (node));
-        break;
-      case JSON_NODE_ARRAY:
-        build_dbus_friendly_json_array_from_array (builder,
-                                                   json_node_get_array (node));
-        break;
-      default:
-        g_assert_not_reached();
+      const MetadataQueryEntry *entry = &g_array_index (state->entries,
+                                                        MetadataQueryEntry,
+                                                        i);
+      MetadataQueryGroup *group = g_ptr_array_index (state->groups,
+                                                     entry->group_index);
+      GSList *first_model = g_slist_nth (group->models,
+                                         entry->offset - group->offset);
+      g_autoptr(GVariant) models_variant = NULL;
+      g_auto(GVariantDict) result_metadata;
+
+      g_variant_dict_init (&result_metadata, NULL);
+
+      models_variant = g_variant_ref_sink (build_models_variants (first_model,
+                                                                  entry->limit,
+                                                                  entry->fields,
+                                                                  entry->max_text_length));
+      g_variant_dict_insert (&result_metadata, "upper_bound", "i", group->upper_bound);
+      if (group->cursor_token != NULL)
+        g_variant_dict_insert (&result_metadata, "cursor", "s", group->cursor_token);
+      g_variant_builder_add (&results_builder,
+                             "(@a{sv}@aa{sv})",
+                             g_variant_dict_end (&result_metadata),
+                             models_variant);
     }
+
+  results = g_variant_ref_sink (g_variant_builder_end (&results_builder));
+
+  if (state->results_in_fd)
+    {
+      /* The serialized results go in a file descriptor instead of the
+       * message, so that the bus daemon doesn't have to copy them */
+      gsize size = g_variant_get_size (results);
+      int fd = create_sealed_memfd (g_variant_get_data (results), size, &error);
+
+      if (fd < 0)
+        {
+          g_task_return_error (task, g_steal_pointer (&error));
+          return;
+        }
+
+      state->fd_list = g_unix_fd_list_new_from_array (&fd, 1);
+      reply = g_variant_new ("(^asht)", state->shards, 0, (guint64) size);
+    }
+  else
+    {
+      /* Same reply for both versions of the interface */
+      reply = g_variant_new ("(^as@a(a{sv}aa{sv}))", state->shards, results);
+    }
+
+  eks_metrics_record_phase (eks_metrics_get_default (),
+                            g_dbus_method_invocation_get_interface_name (state->invocation),
+                            EKS_METRICS_PHASE_SERIALIZATION,
+                            g_get_monotonic_time () - start_time);
+  eks_trace_span (state->trace_id, "serialization", start_time);
+
+  g_task_return_pointer (task,
+                         g_variant_ref_sink (reply),
+                         (GDestroyNotify) g_variant_unref);
 }
 
-/* The d-bus wire protocol doesn't support maybe types,
- * but GVariant does. The way that this is handled in consuming
- * applications is to check if the property exists on the vardict,
- * so remove all NULL-valued properties from this object recursively. */
-static JsonNode *
-json_node_from_object_with_nulls_recursively_removed (JsonObject *object)
-{
-  g_autoptr(JsonBuilder) builder = json_builder_new ();
+static void
+on_metadata_reply_built (GObject      *source,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  MetadataQueryState *state = g_task_get_task_data (G_TASK (result));
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GVariant) reply = g_task_propagate_pointer (G_TASK (result), &error);
+
+  g_application_release (g_application_get_default ());
+
+  if (reply == NULL)
+    {
+      g_dbus_method_invocation_take_error (state->invocation,
+                                           g_steal_pointer (&error));
+      return;
+    }
+
+  /* Without results in a file descriptor, fd_list is NULL and this is the
+   * same as g_dbus_method_invocation_return_value() */
+  g_dbus_method_invocation_return_value_with_unix_fd_list (state->invocation,
+                                                           reply,
+                                                           state->fd_list);
+}
+
+/* Takes ownership of state, and replies to its invocation once the results
+ * have been serialized in a worker thread */
+static void
+complete_metadata_query (MetadataQueryState *state)
+{
+  DmEngine *engine = dm_engine_get_default ();
+  g_autoptr(MetadataQueryState) owned_state = state;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GTask) task = NULL;
+  DmDomain *domain = NULL;
+
+  if (state->groups->len > 0)
+    {
+      eks_metrics_record_phase (eks_metrics_get_default (),
+                                g_dbus_method_invocation_get_interface_name (state->invocation),
+                                EKS_METRICS_PHASE_ENGINE,
+                                g_get_monotonic_time () - state->start_time);
+      eks_trace_span (state->trace_id, "engine-query", state->start_time);
+    }
+
+  if (state->error != NULL)
+    {
+      g_dbus_method_invocation_take_error (state->invocation,
+                                           g_steal_pointer (&state->error));
+      return;
+    }
+
+  /* The shards are the same for every query, so only look them up once,
+   * here on the main thread where the engine lives */
+  gint64 domain_begin = eks_trace_begin (state->trace_id);
+  domain = dm_engine_get_domain_for_app (engine,
+                                         state->provider->application_id,
+                                         &error);
+  eks_trace_span (state->trace_id, "domain-lookup", domain_begin);
+
+  if (domain == NULL)
+    {
+      g_dbus_method_invocation_take_error (state->invocation,
+                                           eks_map_error_to_eks_error (error));
+      return;
+    }
+
+  state->shards = strv_from_shard_list (dm_domain_get_shards (domain));
+
+  task = g_task_new (state->provider, NULL, on_metadata_reply_built, NULL);
+  g_task_set_task_data (task,
+                        g_steal_pointer (&owned_state),
+                        (GDestroyNotify) metadata_query_state_free);
+
+  /* Hold the application so that it doesn't go away whilst the reply is
+   * being built */
+  g_application_hold (g_application_get_default ());
+
+  eks_worker_pool_run (eks_worker_pool_get_default (),
+                       state->provider->application_id,
+                       task,
+                       build_metadata_reply_in_thread);
+}
+
+static void
+metadata_query_group_done (MetadataQueryState *state)
+{
+  if (--state->n_pending > 0)
+    return;
+
+  g_application_release (g_application_get_default ());
+
+  complete_metadata_query (state);
+}
+
+static void
+on_received_query_results (GObject      *source,
+                           GAsyncResult *result,
+                           gpointer      user_data)
+{
+  DmEngine *engine = DM_ENGINE (source);
+  MetadataQueryGroup *group = user_data;
+  MetadataQueryState *state = group->state;
+  g_autoptr(GError) error = NULL;
+
+  if (!models_for_result (engine,
+                          state->provider->application_id,
+                          result,
+                          &group->models,
+                          &group->upper_bound,
+                          &error))
+    {
+      /* If any one query fails, the whole call fails, so only the
+       * first error needs to be kept around. */
+      if (state->error == NULL)
+        state->error = eks_map_error_to_eks_error (error);
+    }
+
+  metadata_query_group_done (state);
+}
+
+static void
+on_received_cursor_page (GObject      *source,
+                         GAsyncResult *result,
+                         gpointer      user_data)
+{
+  DmEngine *engine = DM_ENGINE (source);
+  MetadataQueryGroup *group = user_data;
+  MetadataQueryState *state = group->state;
+  g_autoptr(GHashTable) models_by_id = g_hash_table_new_full (g_str_hash,
+                                                              g_str_equal,
+                                                              g_free,
+                                                              g_object_unref);
+  g_autoptr(GError) error = NULL;
+  GSList *models = NULL;
+
+  if (!models_for_result (engine,
+                          state->provider->application_id,
+                          result,
+                          &models,
+                          NULL,
+                          &error))
+    {
+      if (state->error == NULL)
+        state->error = eks_map_error_to_eks_error (error);
+
+      metadata_query_group_done (state);
+      return;
+    }
+
+  for (GSList *l = models; l; l = l->next)
+    {
+      g_autofree char *id = NULL;
+      g_object_get (l->data, "id", &id, NULL);
+      g_hash_table_insert (models_by_id, g_steal_pointer (&id), l->data);
+    }
+  g_slist_free (models);
+
+  /* The engine doesn't return results by ID in the order they were asked
+   * for, so put them back in the order of the cursor */
+  for (guint i = MIN (group->end, group->cursor->ids->len); i > group->offset; --i)
+    {
+      const char *id = g_ptr_array_index (group->cursor->ids, i - 1);
+      DmContent *model = g_hash_table_lookup (models_by_id, id);
+
+      if (model != NULL)
+        group->models = g_slist_prepend (group->models, g_object_ref (model));
+    }
 
-  build_dbus_friendly_json_object_from_object (builder, object);
-  return json_builder_get_root (builder);
+  group->upper_bound = metadata_cursor_upper_bound (group->cursor);
+  metadata_query_group_done (state);
 }
 
-/* Returns a non-floating reference via its out-param */
-static gboolean
-gvalue_to_variant_internal (GValue              *value,
-                            const GVariantType  *expected_type,
-                            GVariant           **out_variant,
-                            GError             **error)
+/* Looks up the results in the group's window among those already fetched
+ * into its cursor */
+static void
+fetch_cursor_page_by_ids (MetadataQueryGroup *group)
 {
-  g_return_val_if_fail (out_variant != NULL, FALSE);
+  MetadataQueryState *state = group->state;
+  MetadataCursor *cursor = group->cursor;
+  guint start = MIN (group->offset, cursor->ids->len);
+  guint end = MIN (group->end, cursor->ids->len);
+  g_autoptr(GPtrArray) ids = g_ptr_array_new ();
+  g_autoptr(DmQuery) query = NULL;
 
-  /* Special case: if expected_type is G_VARIANT_TYPE_VARDICT then we need
-   * to deserialize from JsonObject. */
-  if (expected_type == G_VARIANT_TYPE_VARDICT)
+  if (start == end)
     {
-      JsonObject *object = g_value_get_boxed (value);
-
-      if (object == NULL)
-        return TRUE;
-
-      g_autoptr(JsonNode) node =
-        json_node_from_object_with_nulls_recursively_removed (object);
-      *out_variant = g_variant_ref_sink (json_gvariant_deserialize (node,
-                                                                    NULL,
-                                                                    error));
-
-      return *out_variant != NULL;
+      group->upper_bound = metadata_cursor_upper_bound (cursor);
+      metadata_query_group_done (state);
+      return;
     }
 
-  *out_variant = g_dbus_gvalue_to_gvariant (value, expected_type);
-  return *out_variant != NULL;
+  for (guint i = start; i < end; ++i)
+    g_ptr_array_add (ids, g_ptr_array_index (cursor->ids, i));
+  g_ptr_array_add (ids, NULL);
+
+  query = g_object_new (DM_TYPE_QUERY,
+                        "app-id", state->provider->application_id,
+                        "ids", (const char * const *) ids->pdata,
+                        "limit", end - start,
+                        NULL);
+  dm_engine_query (dm_engine_get_default (),
+                   query,
+                   NULL,
+                   on_received_cursor_page,
+                   group);
 }
 
-static gboolean
-maybe_add_key_value_pair_from_model_to_variant (DmContent           *model,
-                                                GVariantBuilder     *builder,
-                                                const char          *key,
-                                                const GVariantType  *expected_type,
-                                                GError             **error)
+static inline guint
+saturating_add (guint a,
+                guint b)
 {
-  g_auto(GValue) value = G_VALUE_INIT;
-  GParamSpec *pspec = g_object_class_find_property (G_OBJECT_GET_CLASS (model),
-                                                    key);
-  g_autoptr(GVariant) converted = NULL;
+  return (a > G_MAXUINT - b) ? G_MAXUINT : a + b;
+}
 
-  if (pspec == NULL)
-    return TRUE;
+/* A batch of results ranked past the end of those of a cursor */
+typedef struct {
+  EksMetadataProvider *provider;
+  MetadataCursor      *cursor;
+  gchar               *cursor_token;
+  guint                fetch_offset;
+  guint                fetch_limit;
+  GSList              *models;
+  // Array of the ID strings of models, read in a worker thread
+  GPtrArray           *ids;
+  gsize                ids_size;
+  gint                 upper_bound;
+} CursorBatch;
 
-  g_value_init (&value, pspec->value_type);
-  g_object_get_property (G_OBJECT (model), key, &value);
+static void
+cursor_batch_free (CursorBatch *batch)
+{
+  g_object_unref (batch->provider);
+  metadata_cursor_unref (batch->cursor);
+  g_free (batch->cursor_token);
+  g_slist_free_full (batch->models, g_object_unref);
+  g_clear_pointer (&batch->ids, g_ptr_array_unref);
 
-  if (!gvalue_to_variant_internal (&value, expected_type, &converted, error))
-    return FALSE;
+  g_free (batch);
+}
 
-  /* If we got NULL here it just means that the source property was NULL,
-   * so don't add it. */
-  if (converted == NULL)
-    return TRUE;
+/* Reading the IDs of a batch of models would hold up the main loop */
+static void
+read_cursor_ids_in_thread (GTask        *task,
+                           gpointer      source_object,
+                           gpointer      task_data,
+                           GCancellable *cancellable)
+{
+  CursorBatch *batch = task_data;
 
-  add_key_value_pair_to_variant (builder,
-                                 key,
-                                 converted);
-  return TRUE;
-}
+  batch->ids = g_ptr_array_new_with_free_func (g_free);
+  for (GSList *l = batch->models; l; l = l->next)
+    {
+      char *id = NULL;
+      g_object_get (l->data, "id", &id, NULL);
+      g_ptr_array_add (batch->ids, id);
+      batch->ids_size += sizeof (gpointer) + strlen (id) + 1;
+    }
 
-typedef struct _ModelVariantTypes {
-  const gchar        *prop_name;
-  const GVariantType *variant_type;
-} ModelVariantTypes;
+  g_task_return_boolean (task, TRUE);
+}
 
-static const ModelVariantTypes model_variant_types[] = {
-  { "child_tags", G_VARIANT_TYPE_STRING_ARRAY },
-  { "content_type", G_VARIANT_TYPE_STRING },
-  { "copyright_holder", G_VARIANT_TYPE_STRING },
-  { "discovery_feed_content", G_VARIANT_TYPE_VARDICT },
-  { "featured", G_VARIANT_TYPE_BOOLEAN },
-  { "id", G_VARIANT_TYPE_STRING },
-  { "language", G_VARIANT_TYPE_STRING },
-  { "last_modified_date", G_VARIANT_TYPE_STRING },
-  { "license", G_VARIANT_TYPE_STRING },
-  { "original_title", G_VARIANT_TYPE_STRING },
-  { "original_uri", G_VARIANT_TYPE_STRING },
-  { "tags", G_VARIANT_TYPE_STRING_ARRAY },
-  { "temporal_coverage", G_VARIANT_TYPE_STRING_ARRAY },
-  { "title", G_VARIANT_TYPE_STRING },
-  { "thumbnail_uri", G_VARIANT_TYPE_STRING }
-};
-static const gsize model_variant_types_n = G_N_ELEMENTS (model_variant_types);
+static void fetch_cursor_page (MetadataQueryGroup *group);
 
-static GVariant *
-build_models_variants (GSList  *models,
-                       GError **error)
+/* Answers the groups which were waiting for a batch, from the models of
+ * the batch if their page is in it, or fails them all if batch is NULL */
+static void
+finish_cursor_batch (MetadataCursor *cursor,
+                     CursorBatch    *batch,
+                     GError         *error)
 {
-  g_auto(GVariantBuilder) builder;
-  g_variant_builder_init (&builder, G_VARIANT_TYPE ("aa{sv}"));
+  g_autoptr(GPtrArray) waiting_groups = g_steal_pointer (&cursor->waiting_groups);
 
-  for (GSList *l = models; l; l = l->next)
+  for (guint i = 0; i < waiting_groups->len; ++i)
     {
-      DmContent *model = l->data;
-      gsize i = 0;
+      MetadataQueryGroup *group = g_ptr_array_index (waiting_groups, i);
+      guint batch_end, n_models = 0;
 
-      g_variant_builder_open (&builder, G_VARIANT_TYPE_VARDICT);
+      if (batch == NULL)
+        {
+          if (group->state->error == NULL)
+            group->state->error = g_error_copy (error);
+          metadata_query_group_done (group->state);
+          continue;
+        }
 
-      for (; i < model_variant_types_n; ++i)
+      batch_end = batch->fetch_offset + batch->ids->len;
+      if (group->offset < batch->fetch_offset ||
+          (group->end > batch_end && !cursor->exhausted))
         {
-          const ModelVariantTypes *model_prop = &model_variant_types[i];
-
-          if (!maybe_add_key_value_pair_from_model_to_variant (model,
-                                                               &builder,
-                                                               model_prop->prop_name,
-                                                               model_prop->variant_type,
-                                                               error))
-            return NULL;
+          fetch_cursor_page (group);
+          continue;
         }
 
-      g_variant_builder_close (&builder);
+      for (GSList *l = g_slist_nth (batch->models, group->offset - batch->fetch_offset);
+           l != NULL && n_models < group->end - group->offset;
+           l = l->next, ++n_models)
+        group->models = g_slist_prepend (group->models, g_object_ref (l->data));
+      group->models = g_slist_reverse (group->models);
+      group->upper_bound = metadata_cursor_upper_bound (cursor);
+      metadata_query_group_done (group->state);
     }
+}
 
-  return g_variant_builder_end (&builder);
+static void
+on_cursor_ids_read (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  EksMetadataProvider *self = EKS_METADATA_PROVIDER (source);
+  CursorBatch *batch = g_task_get_task_data (G_TASK (result));
+  MetadataCursor *cursor = batch->cursor;
+
+  for (guint i = 0; i < batch->ids->len; ++i)
+    g_ptr_array_add (cursor->ids, g_strdup (g_ptr_array_index (batch->ids, i)));
+  cursor->ids_size += batch->ids_size;
+  cursor->upper_bound = batch->upper_bound;
+  cursor->exhausted = batch->ids->len < batch->fetch_limit;
+  eks_lru_cache_update_size (self->cursors, batch->cursor_token, metadata_cursor_size (cursor));
+
+  finish_cursor_batch (cursor, batch, NULL);
 }
 
 static void
-on_received_query_results (GObject      *source,
-                           GAsyncResult *result,
-                           gpointer      user_data)
+on_received_cursor_batch (GObject      *source,
+                          GAsyncResult *result,
+                          gpointer      user_data)
 {
   DmEngine *engine = DM_ENGINE (source);
-  g_autoptr(MetadataQueryState) state = user_data;
-
-  /* Careful here, these two need to be cleaned up manually */
-  GSList *models = NULL;
-  GSList *shards = NULL;
-
-  g_auto(GStrv) shards_strv = NULL;
-  GVariant *results_tuple_array[1];
-  g_autoptr(GVariant) models_variant = NULL;
-  g_auto(GVariantDict) result_metadata;
-  gint upper_bound = 0;
+  CursorBatch *batch = user_data;
+  EksMetadataProvider *provider = batch->provider;
   g_autoptr(GError) error = NULL;
+  g_autoptr(GTask) task = NULL;
+
+  if (!models_for_result (engine,
+                          provider->application_id,
+                          result,
+                          &batch->models,
+                          &batch->upper_bound,
+                          &error))
+    {
+      g_autoptr(GError) mapped_error = eks_map_error_to_eks_error (error);
+      finish_cursor_batch (batch->cursor, NULL, mapped_error);
+      cursor_batch_free (batch);
+      return;
+    }
 
-  /* Make sure to init the vardict first before any return path
-   * otherwise g_auto will attempt to clear uninitialized memory */
-  g_variant_dict_init (&result_metadata, NULL);
+  task = g_task_new (provider, NULL, on_cursor_ids_read, NULL);
+  g_task_set_task_data (task, batch, (GDestroyNotify) cursor_batch_free);
+  eks_worker_pool_run (eks_worker_pool_get_default (),
+                       provider->application_id,
+                       task,
+                       read_cursor_ids_in_thread);
+}
 
-  g_application_release (g_application_get_default ());
+static void
+fetch_cursor_page (MetadataQueryGroup *group)
+{
+  MetadataCursor *cursor = group->cursor;
+  g_autoptr(DmQuery) query = NULL;
+  CursorBatch *batch = NULL;
+  guint page_size = group->end - group->offset;
 
-  if (!models_and_shards_for_result (engine,
-                                     state->provider->application_id,
-                                     result,
-                                     &models,
-                                     &shards,
-                                     &upper_bound,
-                                     &error))
+  /* Another call using the same cursor is fetching a batch already */
+  if (cursor->waiting_groups != NULL)
     {
-      g_dbus_method_invocation_take_error (state->invocation,
-                                           eks_map_error_to_eks_error (error));
-      g_slist_free_full (models, g_object_unref);
-      g_slist_free_full (shards, g_object_unref);
+      g_ptr_array_add (cursor->waiting_groups, group);
       return;
     }
 
-  shards_strv = strv_from_shard_list (shards);
-  models_variant = g_variant_ref_sink (build_models_variants (models, &error));
-
-  if (models_variant == NULL)
+  if (cursor->exhausted || group->end <= cursor->ids->len)
     {
-      g_dbus_method_invocation_take_error (state->invocation,
-                                           eks_map_error_to_eks_error (error));
-      g_slist_free_full (models, g_object_unref);
-      g_slist_free_full (shards, g_object_unref);
+      fetch_cursor_page_by_ids (group);
       return;
     }
 
-  g_variant_dict_insert (&result_metadata, "upper_bound", "i", upper_bound);
-
-  /* Easier than using GVariantBuilder. Note that if a child
-   * has a floating reference the container takes ownership of
-   * them via g_variant_ref_sink, so we need to steal the pointer */
-  results_tuple_array[0] = g_variant_new ("(@a{sv}@aa{sv})",
-                                          g_variant_dict_end (&result_metadata),
-                                          models_variant);
-
-  eks_content_metadata_complete_query (state->provider->skeleton,
-                                       state->invocation,
-                                       (const char * const *) shards_strv,
-                                       g_variant_new_array (G_VARIANT_TYPE ("(a{sv}aa{sv})"),
-                                                            results_tuple_array,
-                                                            1));
-
-  g_slist_free_full (models, g_object_unref);
-  g_slist_free_full (shards, g_object_unref);
+  cursor->waiting_groups = g_ptr_array_new ();
+  g_ptr_array_add (cursor->waiting_groups, group);
+
+  batch = g_new0 (CursorBatch, 1);
+  batch->provider = g_object_ref (group->state->provider);
+  batch->cursor = metadata_cursor_ref (cursor);
+  batch->cursor_token = g_strdup (group->cursor_token);
+  batch->fetch_offset = cursor->ids->len;
+  batch->fetch_limit = saturating_add (group->end - batch->fetch_offset,
+                                       MIN (MAX (batch->fetch_offset, page_size),
+                                            CURSOR_MAX_PREFETCH));
+
+  query = dm_query_new_from_object (cursor->query,
+                                    "offset", batch->fetch_offset,
+                                    "limit", batch->fetch_limit,
+                                    NULL);
+  dm_engine_query (dm_engine_get_default (),
+                   query,
+                   NULL,
+                   on_received_cursor_batch,
+                   batch);
 }
 
 static void
@@ -569,6 +1402,33 @@ append_construction_prop_from_variant_enum_transform (const char  *key,
                                                 error);
 }
 
+/* For parameters which are not properties of the query object and are
+ * handled separately, only checks that they have the expected type */
+static gboolean
+append_construction_prop_check_type (const char  *key,
+                                     GVariant    *variant,
+                                     GArray      *values_array,
+                                     GPtrArray   *props_array,
+                                     gpointer     extra_data,
+                                     GError     **error)
+{
+  const GVariantType *expected_type = extra_data;
+
+  if (!g_variant_is_of_type (variant, expected_type))
+    {
+      g_set_error (error,
+                   EKS_ERROR,
+                   EKS_ERROR_INVALID_REQUEST,
+                   "Query parameter %s must be of type %.*s",
+                   key,
+                   (int) g_variant_type_get_string_length (expected_type),
+                   g_variant_type_peek_string (expected_type));
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 typedef gboolean (*AppendConstructionPropFromVariantWithTransformFunc) (const char  *key,
                                                                         GVariant    *variant,
                                                                         GArray      *values_array,
@@ -666,6 +1526,57 @@ article_metadata_query_construction_props_translation_table (void)
   return g_steal_pointer (&table);
 }
 
+/* Parameters of com.endlessm.ContentMetadata2.Query */
+static GHashTable *
+article_metadata_query2_construction_props_translation_table (void)
+{
+  GHashTable *table = article_metadata_query_construction_props_translation_table ();
+
+  g_hash_table_insert (table,
+                       g_strdup ("cursor"),
+                       value_translation_info_new (append_construction_prop_check_type,
+                                                   (gpointer) G_VARIANT_TYPE_STRING,
+                                                   NULL));
+  g_hash_table_insert (table,
+                       g_strdup ("fields"),
+                       value_translation_info_new (append_construction_prop_check_type,
+                                                   (gpointer) G_VARIANT_TYPE_STRING_ARRAY,
+                                                   NULL));
+  g_hash_table_insert (table,
+                       g_strdup ("max-text-length"),
+                       value_translation_info_new (append_construction_prop_check_type,
+                                                   (gpointer) G_VARIANT_TYPE_UINT32,
+                                                   NULL));
+
+  return table;
+}
+
+/* The translation tables never change, so they are built once, the first
+ * time a query needs them, and shared by every provider */
+static GHashTable *
+query_translation_infos (void)
+{
+  static gsize translation_infos = 0;
+
+  if (g_once_init_enter (&translation_infos))
+    g_once_init_leave (&translation_infos,
+                       (gsize) article_metadata_query_construction_props_translation_table ());
+
+  return (GHashTable *) translation_infos;
+}
+
+static GHashTable *
+query2_translation_infos (void)
+{
+  static gsize translation_infos = 0;
+
+  if (g_once_init_enter (&translation_infos))
+    g_once_init_leave (&translation_infos,
+                       (gsize) article_metadata_query2_construction_props_translation_table ());
+
+  return (GHashTable *) translation_infos;
+}
+
 static DmQuery *
 create_query_from_dbus_query_parameters (GVariant     *query_parameters,
                                          const char   *application_id,
@@ -720,79 +1631,365 @@ create_query_from_dbus_query_parameters (GVariant     *query_parameters,
                                                  (const GValue *) values_array->data));
 }
 
-static gboolean
-handle_query (EksContentMetadata    *skeleton,
-              GDBusMethodInvocation *invocation,
-              GVariant              *queries,
-              gpointer               user_data)
+static gint
+compare_dict_entries_by_key (gconstpointer a,
+                             gconstpointer b)
+{
+  GVariant *entry_a = *((GVariant **) a);
+  GVariant *entry_b = *((GVariant **) b);
+  const char *key_a = NULL;
+  const char *key_b = NULL;
+
+  g_variant_get_child (entry_a, 0, "&s", &key_a);
+  g_variant_get_child (entry_b, 0, "&s", &key_b);
+
+  return g_strcmp0 (key_a, key_b);
+}
+
+/* Returns a string which is equal for any two sets of query parameters
+ * that only differ in their "offset" and "limit", or in how the results
+ * are serialized, regardless of the order in which the parameters were
+ * given. */
+static char *
+query_group_key_from_parameters (GVariant *query_parameters)
+{
+  g_autoptr(GPtrArray) entries = g_ptr_array_new_with_free_func ((GDestroyNotify) g_variant_unref);
+  g_autoptr(GVariant) shape = NULL;
+  GVariantIter iter;
+  GVariant *entry;
+
+  g_variant_iter_init (&iter, query_parameters);
+  while ((entry = g_variant_iter_next_value (&iter)) != NULL)
+    {
+      const char *key = NULL;
+      g_variant_get_child (entry, 0, "&s", &key);
+
+      if (g_strcmp0 (key, "offset") == 0 ||
+          g_strcmp0 (key, "limit") == 0 ||
+          g_strcmp0 (key, "fields") == 0 ||
+          g_strcmp0 (key, "max-text-length") == 0)
+        {
+          g_variant_unref (entry);
+          continue;
+        }
+
+      g_ptr_array_add (entries, entry);
+    }
+
+  g_ptr_array_sort (entries, compare_dict_entries_by_key);
+  shape = g_variant_ref_sink (g_variant_new_array (G_VARIANT_TYPE ("{sv}"),
+                                                   (GVariant * const *) entries->pdata,
+                                                   entries->len));
+
+  return g_variant_print (shape, FALSE);
+}
+
+/* An empty token starts a new cursor for query, otherwise the cursor must
+ * still be around and the app's shards must not have changed since it was
+ * started. Returns a new reference to the cursor and its token. */
+static MetadataCursor *
+lookup_or_create_cursor (EksMetadataProvider  *self,
+                         DmQuery              *query,
+                         const char           *token,
+                         char                **out_token,
+                         GError              **error)
 {
-  EksMetadataProvider *self = user_data;
   DmEngine *engine = dm_engine_get_default ();
+  gint64 now = g_get_monotonic_time ();
   g_autoptr(GError) local_error = NULL;
-  g_autoptr(DmQuery) query = NULL;
-  g_autoptr(GVariant) first_child = NULL;
-  guint n_children = g_variant_n_children (queries);
+  g_autofree char *fingerprint = shards_fingerprint_for_app (engine,
+                                                             self->application_id,
+                                                             &local_error);
+  MetadataCursor *cursor = NULL;
 
-  /* XXX: For now, we only support one query in the array, but the
-   * interface contract may be extended to support multiple queries. */
-  if (n_children != 1)
+  if (fingerprint == NULL)
     {
-      g_dbus_method_invocation_take_error (invocation,
-                                           g_error_new (G_IO_ERROR,
-                                                        G_IO_ERROR_FAILED,
-                                                        "This version of eks-search-provider "
-                                                        "can only perform one query, not %u",
-                                                        n_children));
-      return TRUE;
+      g_propagate_error (error, eks_map_error_to_eks_error (local_error));
+      return NULL;
     }
 
-  first_child = g_variant_get_child_value (queries, 0);
-  query =
-    create_query_from_dbus_query_parameters (first_child,
-                                             self->application_id,
-                                             self->translation_infos,
-                                             &local_error);
+  if (*token == '\0')
+    {
+      cursor = metadata_cursor_new (query, fingerprint);
+      *out_token = g_uuid_string_random ();
+      eks_lru_cache_insert (self->cursors,
+                            *out_token,
+                            metadata_cursor_ref (cursor),
+                            metadata_cursor_size (cursor));
+      return cursor;
+    }
 
-  if (query == NULL)
+  cursor = eks_lru_cache_lookup (self->cursors, token);
+  if (cursor == NULL ||
+      now - cursor->last_used > CURSOR_LIFETIME_USEC ||
+      g_strcmp0 (cursor->shards_fingerprint, fingerprint) != 0)
     {
-      g_dbus_method_invocation_take_error (invocation,
-                                           g_steal_pointer (&local_error));
-      return TRUE;
+      eks_lru_cache_remove (self->cursors, token);
+      g_set_error (error,
+                   EKS_ERROR,
+                   EKS_ERROR_CURSOR_EXPIRED,
+                   "Cursor %s has expired",
+                   token);
+      return NULL;
+    }
+
+  cursor->last_used = now;
+  *out_token = g_strdup (token);
+  return metadata_cursor_ref (cursor);
+}
+
+static void
+run_query (EksMetadataProvider   *self,
+           GDBusMethodInvocation *invocation,
+           GVariant              *queries,
+           GHashTable            *translation_infos,
+           gboolean               version2,
+           gboolean               results_in_fd)
+{
+  DmEngine *engine = dm_engine_get_default ();
+  g_autoptr(GError) local_error = NULL;
+  g_autoptr(MetadataQueryState) state = metadata_query_state_new (self, invocation);
+  // Hash table with group key string keys, values of arrays of the indices
+  // of the groups for that key
+  g_autoptr(GHashTable) group_indices = g_hash_table_new_full (g_str_hash,
+                                                               g_str_equal,
+                                                               g_free,
+                                                               (GDestroyNotify) g_array_unref);
+  guint n_children = g_variant_n_children (queries);
+
+  state->results_in_fd = results_in_fd;
+
+  for (guint i = 0; i < n_children; ++i)
+    {
+      g_autoptr(GVariant) query_parameters = g_variant_get_child_value (queries, i);
+      g_autoptr(DmQuery) query =
+        create_query_from_dbus_query_parameters (query_parameters,
+                                                 self->application_id,
+                                                 translation_infos,
+                                                 &local_error);
+      const char *cursor_token = NULL;
+      g_autofree char *group_key = NULL;
+      GArray *key_group_indices = NULL;
+      guint end;
+      MetadataQueryEntry entry;
+      MetadataQueryGroup *group = NULL;
+
+      if (query == NULL)
+        {
+          g_dbus_method_invocation_take_error (invocation,
+                                               g_steal_pointer (&local_error));
+          return;
+        }
+
+      g_object_get (query,
+                    "offset", &entry.offset,
+                    "limit", &entry.limit,
+                    NULL);
+      entry.fields = ALL_MODEL_FIELDS;
+      entry.max_text_length = 0;
+
+      if (version2)
+        {
+          g_autofree const char **field_names = NULL;
+
+          if (g_variant_lookup (query_parameters, "fields", "^a&s", &field_names) &&
+              !model_fields_from_names (field_names, &entry.fields, &local_error))
+            {
+              g_dbus_method_invocation_take_error (invocation,
+                                                   g_steal_pointer (&local_error));
+              return;
+            }
+
+          g_variant_lookup (query_parameters, "max-text-length", "u",
+                            &entry.max_text_length);
+        }
+
+      if (version2 &&
+          g_variant_lookup (query_parameters, "cursor", "&s", &cursor_token))
+        {
+          entry.group_index = state->groups->len;
+
+          group = g_new0 (MetadataQueryGroup, 1);
+          group->state = state;
+          group->offset = entry.offset;
+          group->end = saturating_add (entry.offset, entry.limit);
+          group->cursor = lookup_or_create_cursor (self,
+                                                   query,
+                                                   cursor_token,
+                                                   &group->cursor_token,
+                                                   &local_error);
+          g_ptr_array_add (state->groups, group);
+
+          if (group->cursor == NULL)
+            {
+              g_dbus_method_invocation_take_error (invocation,
+                                                   g_steal_pointer (&local_error));
+              return;
+            }
+
+          g_array_append_val (state->entries, entry);
+          continue;
+        }
+
+      group_key = query_group_key_from_parameters (query_parameters);
+      end = saturating_add (entry.offset, entry.limit);
+
+      /* Merging windows far apart would load every model in between */
+      key_group_indices = g_hash_table_lookup (group_indices, group_key);
+      for (guint j = 0; key_group_indices != NULL && j < key_group_indices->len; ++j)
+        {
+          MetadataQueryGroup *candidate = g_ptr_array_index (state->groups,
+                                                             g_array_index (key_group_indices, guint, j));
+
+          if (entry.offset <= candidate->end && candidate->offset <= end)
+            {
+              entry.group_index = g_array_index (key_group_indices, guint, j);
+              group = candidate;
+              break;
+            }
+        }
+
+      if (group != NULL)
+        {
+          group->offset = MIN (group->offset, entry.offset);
+          group->end = MAX (group->end, end);
+        }
+      else
+        {
+          entry.group_index = state->groups->len;
+
+          group = g_new0 (MetadataQueryGroup, 1);
+          group->state = state;
+          group->query = g_steal_pointer (&query);
+          group->offset = entry.offset;
+          group->end = end;
+
+          g_ptr_array_add (state->groups, group);
+
+          if (key_group_indices == NULL)
+            {
+              key_group_indices = g_array_new (FALSE, FALSE, sizeof (guint));
+              g_hash_table_insert (group_indices,
+                                   g_steal_pointer (&group_key),
+                                   key_group_indices);
+            }
+          g_array_append_val (key_group_indices, entry.group_index);
+        }
+
+      g_array_append_val (state->entries, entry);
+    }
+
+  /* Nothing to run, but still reply with the shards */
+  if (state->groups->len == 0)
+    {
+      complete_metadata_query (g_steal_pointer (&state));
+      return;
     }
 
   /* Hold the application so that it doesn't go away whilst we're handling
    * the query */
   g_application_hold (g_application_get_default ());
 
-  dm_engine_query (engine,
-                   query,
-                   NULL,
-                   on_received_query_results,
-                   metadata_query_state_new (self, invocation));
+  /* From here on, the state is owned by the pending engine queries and
+   * freed when the last one comes back */
+  state->n_pending = state->groups->len;
+
+  for (guint i = 0; i < state->groups->len; ++i)
+    {
+      MetadataQueryGroup *group = g_ptr_array_index (state->groups, i);
+      g_autoptr(DmQuery) group_query = NULL;
+
+      if (group->cursor != NULL)
+        {
+          fetch_cursor_page (group);
+          continue;
+        }
+
+      group_query = dm_query_new_from_object (group->query,
+                                              "offset", group->offset,
+                                              "limit", group->end - group->offset,
+                                              NULL);
+      dm_engine_query (engine,
+                       group_query,
+                       NULL,
+                       on_received_query_results,
+                       group);
+    }
+
+  g_steal_pointer (&state);
+}
+
+static gboolean
+handle_query (EksContentMetadata    *skeleton,
+              GDBusMethodInvocation *invocation,
+              GVariant              *queries,
+              gpointer               user_data)
+{
+  EksMetadataProvider *self = user_data;
+
+  run_query (self, invocation, queries, query_translation_infos (), FALSE, FALSE);
   return TRUE;
 }
 
 static gboolean
-handle_shards (EksContentMetadata    *skeleton,
+handle_query2 (EksContentMetadata2   *skeleton,
                GDBusMethodInvocation *invocation,
+               GVariant              *queries,
                gpointer               user_data)
 {
   EksMetadataProvider *self = user_data;
+
+  run_query (self, invocation, queries, query2_translation_infos (), TRUE, FALSE);
+  return TRUE;
+}
+
+static gboolean
+handle_query_fd (EksContentMetadata2   *skeleton,
+                 GDBusMethodInvocation *invocation,
+                 GUnixFDList           *fd_list,
+                 GVariant              *queries,
+                 gpointer               user_data)
+{
+  EksMetadataProvider *self = user_data;
+
+  run_query (self, invocation, queries, query2_translation_infos (), TRUE, TRUE);
+  return TRUE;
+}
+
+static GStrv
+shards_for_app (EksMetadataProvider  *self,
+                GError              **error)
+{
   DmEngine *engine = dm_engine_get_default ();
-  g_autoptr(GError) error = NULL;
+  g_autoptr(GError) local_error = NULL;
   DmDomain *domain = dm_engine_get_domain_for_app (engine,
                                                    self->application_id,
-                                                   &error);
-  g_auto(GStrv) shards_strv = NULL;
+                                                   &local_error);
 
   if (domain == NULL)
     {
-      g_dbus_method_invocation_take_error (invocation,
-                                           eks_map_error_to_eks_error (error));
+      g_propagate_error (error, eks_map_error_to_eks_error (local_error));
+      return NULL;
+    }
+
+  return strv_from_shard_list (dm_domain_get_shards (domain));
+}
+
+static gboolean
+handle_shards (EksContentMetadata    *skeleton,
+               GDBusMethodInvocation *invocation,
+               gpointer               user_data)
+{
+  EksMetadataProvider *self = user_data;
+  GError *error = NULL;
+  g_auto(GStrv) shards_strv = shards_for_app (self, &error);
+
+  if (shards_strv == NULL)
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
       return TRUE;
     }
 
-  shards_strv = strv_from_shard_list (dm_domain_get_shards (domain));
   eks_content_metadata_complete_shards (skeleton,
                                         invocation,
                                         (const char * const *) shards_strv);
@@ -800,14 +1997,62 @@ handle_shards (EksContentMetadata    *skeleton,
   return TRUE;
 }
 
+static gboolean
+handle_shards2 (EksContentMetadata2   *skeleton,
+                GDBusMethodInvocation *invocation,
+                gpointer               user_data)
+{
+  EksMetadataProvider *self = user_data;
+  GError *error = NULL;
+  g_auto(GStrv) shards_strv = shards_for_app (self, &error);
+
+  if (shards_strv == NULL)
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
+      return TRUE;
+    }
+
+  eks_content_metadata2_complete_shards (skeleton,
+                                         invocation,
+                                         (const char * const *) shards_strv);
+
+  return TRUE;
+}
+
 static GDBusInterfaceSkeleton *
 eks_metadata_provider_skeleton_for_interface (EksProvider *provider,
                                               const char  *interface)
 {
   EksMetadataProvider *self = EKS_METADATA_PROVIDER (provider);
 
+  /* Apps only use one of the interfaces, so each skeleton is created the
+   * first time its interface is called */
   if (g_strcmp0 (interface, "com.endlessm.ContentMetadata") == 0)
+    {
+      if (self->skeleton == NULL)
+        {
+          self->skeleton = eks_content_metadata_skeleton_new ();
+          g_signal_connect (self->skeleton, "handle-query",
+                            G_CALLBACK (handle_query), self);
+          g_signal_connect (self->skeleton, "handle-shards",
+                            G_CALLBACK (handle_shards), self);
+        }
       return G_DBUS_INTERFACE_SKELETON (self->skeleton);
+    }
+  if (g_strcmp0 (interface, "com.endlessm.ContentMetadata2") == 0)
+    {
+      if (self->skeleton2 == NULL)
+        {
+          self->skeleton2 = eks_content_metadata2_skeleton_new ();
+          g_signal_connect (self->skeleton2, "handle-query",
+                            G_CALLBACK (handle_query2), self);
+          g_signal_connect (self->skeleton2, "handle-query-fd",
+                            G_CALLBACK (handle_query_fd), self);
+          g_signal_connect (self->skeleton2, "handle-shards",
+                            G_CALLBACK (handle_shards2), self);
+        }
+      return G_DBUS_INTERFACE_SKELETON (self->skeleton2);
+    }
 
   g_assert_not_reached ();
   return NULL;
@@ -822,11 +2067,10 @@ eks_metadata_provider_interface_init (EksProviderInterface *iface)
 static void
 eks_metadata_provider_init (EksMetadataProvider *self)
 {
-  self->skeleton = eks_content_metadata_skeleton_new ();
-  self->translation_infos = article_metadata_query_construction_props_translation_table ();
-
-  g_signal_connect (self->skeleton, "handle-query",
-                    G_CALLBACK (handle_query), self);
-  g_signal_connect (self->skeleton, "handle-shards",
-                    G_CALLBACK (handle_shards), self);
+  self->cursors = eks_lru_cache_new (CURSOR_CACHE_MAX_ENTRIES,
+                                     CURSOR_CACHE_MAX_BYTES,
+                                     (GDestroyNotify) metadata_cursor_unref);
+  eks_metrics_add_cache (eks_metrics_get_default (),
+                         "metadata-cursors",
+                         self->cursors);
 }
@@ -0,0 +1,100 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#include "eks-metrics-provider.h"
+
+#include "eks-metrics.h"
+#include "eks-metrics-dbus.h"
+#include "eks-provider-iface.h"
+
+/**
+ * EksMetricsProvider:
+ *
+ * A provider exporting the metrics of the whole service on the root of the
+ * subtree.
+ */
+struct _EksMetricsProvider
+{
+  GObject parent_instance;
+
+  EksEknServicesMetrics *skeleton;
+};
+
+static void eks_metrics_provider_interface_init (EksProviderInterface *);
+
+G_DEFINE_TYPE_WITH_CODE (EksMetricsProvider,
+                         eks_metrics_provider,
+                         G_TYPE_OBJECT,
+                         G_IMPLEMENT_INTERFACE (EKS_TYPE_PROVIDER,
+                                                eks_metrics_provider_interface_init));
+
+static void
+eks_metrics_provider_finalize (GObject *object)
+{
+  EksMetricsProvider *self = EKS_METRICS_PROVIDER (object);
+
+  g_clear_object (&self->skeleton);
+
+  G_OBJECT_CLASS (eks_metrics_provider_parent_class)->finalize (object);
+}
+
+static void
+eks_metrics_provider_class_init (EksMetricsProviderClass *klass)
+{
+  GObjectClass *object_class = G_OBJECT_CLASS (klass);
+
+  object_class->finalize = eks_metrics_provider_finalize;
+}
+
+static gboolean
+handle_get_metrics (EksEknServicesMetrics *skeleton,
+                    GDBusMethodInvocation *invocation,
+                    gpointer               user_data)
+{
+  eks_ekn_services_metrics_complete_get_metrics (skeleton,
+                                                 invocation,
+                                                 eks_metrics_to_variant (eks_metrics_get_default ()));
+  return TRUE;
+}
+
+static gboolean
+handle_get_report (EksEknServicesMetrics *skeleton,
+                   GDBusMethodInvocation *invocation,
+                   gpointer               user_data)
+{
+  g_autofree gchar *report = eks_metrics_to_text (eks_metrics_get_default ());
+
+  eks_ekn_services_metrics_complete_get_report (skeleton, invocation, report);
+  return TRUE;
+}
+
+static GDBusInterfaceSkeleton *
+eks_metrics_provider_skeleton_for_interface (EksProvider *provider,
+                                             const gchar *interface)
+{
+  EksMetricsProvider *self = EKS_METRICS_PROVIDER (provider);
+  return G_DBUS_INTERFACE_SKELETON (self->skeleton);
+}
+
+/* Always kept, since it isn't specific to an app */
+static gboolean
+eks_metrics_provider_can_evict (EksProvider *provider)
+{
+  return FALSE;
+}
+
+static void
+eks_metrics_provider_interface_init (EksProviderInterface *iface)
+{
+  iface->skeleton_for_interface = eks_metrics_provider_skeleton_for_interface;
+  iface->can_evict = eks_metrics_provider_can_evict;
+}
+
+static void
+eks_metrics_provider_init (EksMetricsProvider *self)
+{
+  self->skeleton = eks_ekn_services_metrics_skeleton_new ();
+  g_signal_connect (self->skeleton, "handle-get-metrics",
+                    G_CALLBACK (handle_get_metrics), self);
+  g_signal_connect (self->skeleton, "handle-get-report",
+                    G_CALLBACK (handle_get_report), self);
+}
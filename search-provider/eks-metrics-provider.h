@@ -0,0 +1,12 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <glib-object.h>
+
+G_BEGIN_DECLS
+
+#define EKS_TYPE_METRICS_PROVIDER eks_metrics_provider_get_type ()
+G_DECLARE_FINAL_TYPE (EksMetricsProvider, eks_metrics_provider, EKS, METRICS_PROVIDER, GObject)
+
+G_END_DECLS
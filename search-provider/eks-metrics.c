@@ -0,0 +1,640 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#include "eks-metrics.h"
+
+/* Upper bounds of the latency histogram buckets, past the last of which
+ * there is one more bucket for everything slower */
+static const gint64 histogram_bounds_usec[] = {
+  1000,
+  2000,
+  5000,
+  10000,
+  20000,
+  50000,
+  100000,
+  200000,
+  500000,
+  1000000,
+  2000000,
+  5000000,
+};
+
+#define N_BUCKETS (G_N_ELEMENTS (histogram_bounds_usec) + 1)
+
+static const gchar *phase_names[EKS_METRICS_N_PHASES] = {
+  "total",
+  "dispatch",
+  "engine",
+  "serialization",
+};
+
+typedef struct
+{
+  guint64 count;
+  guint64 sum_usec;
+  guint64 buckets[N_BUCKETS];
+} Histogram;
+
+typedef struct
+{
+  guint64 calls;
+  guint64 errors;
+  Histogram phases[EKS_METRICS_N_PHASES];
+} CallStats;
+
+typedef struct
+{
+  gchar *interface_name;
+  gchar *app_id;
+  gint64 start_time;
+} InFlightCall;
+
+typedef struct
+{
+  gchar *name;
+  EksLruCache *cache;
+} NamedCache;
+
+/**
+ * EksMetrics:
+ *
+ * Counters and latency histograms for the method calls handled by the
+ * service, along with sizes reported by the rest of the service, such as
+ * the number of providers and the caches they hold. Calls are recorded as
+ * their messages go through the connection, which happens on GDBus's own
+ * thread, and phases can be recorded from worker threads, so everything is
+ * guarded by a lock.
+ */
+struct _EksMetrics
+{
+  GMutex lock;
+
+  // Hash table with interface name string keys, CallStats values
+  GHashTable *interfaces;
+  // Hash table with app id string keys, CallStats values
+  GHashTable *apps;
+  // Hash table with D-Bus error name string keys, guint64 counter values
+  GHashTable *errors;
+  // Hash table with "sender/serial" string keys, InFlightCall values
+  GHashTable *in_flight;
+  // Hash table with gauge name string keys, guint64 values
+  GHashTable *gauges;
+  // Array of NamedCache, registered on the main thread
+  GArray *caches;
+};
+
+static void
+in_flight_call_free (InFlightCall *call)
+{
+  g_free (call->interface_name);
+  g_free (call->app_id);
+
+  g_slice_free (InFlightCall, call);
+}
+
+static void
+named_cache_clear (NamedCache *named_cache)
+{
+  g_free (named_cache->name);
+}
+
+static gchar *
+call_key (const gchar *sender,
+          guint32      serial)
+{
+  return g_strdup_printf ("%s/%" G_GUINT32_FORMAT, sender, serial);
+}
+
+static void
+histogram_add (Histogram *histogram,
+               gint64     duration_usec)
+{
+  gsize bucket = 0;
+
+  duration_usec = MAX (duration_usec, 0);
+  while (bucket < G_N_ELEMENTS (histogram_bounds_usec) &&
+         duration_usec > histogram_bounds_usec[bucket])
+    ++bucket;
+
+  histogram->count++;
+  histogram->sum_usec += duration_usec;
+  histogram->buckets[bucket]++;
+}
+
+static CallStats *
+lookup_or_create_stats (GHashTable  *table,
+                        const gchar *key)
+{
+  CallStats *stats = g_hash_table_lookup (table, key);
+
+  if (stats == NULL)
+    {
+      stats = g_new0 (CallStats, 1);
+      g_hash_table_insert (table, g_strdup (key), stats);
+    }
+
+  return stats;
+}
+
+static guint64 *
+lookup_or_create_counter (GHashTable  *table,
+                          const gchar *key)
+{
+  guint64 *counter = g_hash_table_lookup (table, key);
+
+  if (counter == NULL)
+    {
+      counter = g_new0 (guint64, 1);
+      g_hash_table_insert (table, g_strdup (key), counter);
+    }
+
+  return counter;
+}
+
+static EksMetrics *
+eks_metrics_new (void)
+{
+  EksMetrics *metrics = g_slice_new0 (EksMetrics);
+
+  g_mutex_init (&metrics->lock);
+  metrics->interfaces = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  metrics->apps = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  metrics->errors = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  metrics->in_flight = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                              (GDestroyNotify) in_flight_call_free);
+  metrics->gauges = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  metrics->caches = g_array_new (FALSE, TRUE, sizeof (NamedCache));
+  g_array_set_clear_func (metrics->caches, (GDestroyNotify) named_cache_clear);
+
+  return metrics;
+}
+
+/**
+ * eks_metrics_get_default:
+ *
+ * Returns: (transfer none): the metrics of the whole process
+ */
+EksMetrics *
+eks_metrics_get_default (void)
+{
+  static EksMetrics *default_metrics = NULL;
+
+  if (g_once_init_enter (&default_metrics))
+    g_once_init_leave (&default_metrics, eks_metrics_new ());
+
+  return default_metrics;
+}
+
+/**
+ * eks_metrics_call_started:
+ * @metrics: the metrics
+ * @sender: the unique name of the caller
+ * @serial: the serial of the method call message
+ * @interface_name: the interface of the method
+ * @app_id: (nullable): the app the call is for, or %NULL for calls on the
+ *   root object
+ *
+ * Starts tracking a method call until eks_metrics_call_finished() is called
+ * for its reply.
+ */
+void
+eks_metrics_call_started (EksMetrics  *metrics,
+                          const gchar *sender,
+                          guint32      serial,
+                          const gchar *interface_name,
+                          const gchar *app_id)
+{
+  InFlightCall *call = g_slice_new0 (InFlightCall);
+
+  call->interface_name = g_strdup (interface_name);
+  call->app_id = g_strdup (app_id);
+  call->start_time = g_get_monotonic_time ();
+
+  g_mutex_lock (&metrics->lock);
+  g_hash_table_insert (metrics->in_flight, call_key (sender, serial), call);
+  g_mutex_unlock (&metrics->lock);
+}
+
+/**
+ * eks_metrics_call_finished:
+ * @metrics: the metrics
+ * @destination: the unique name the reply is sent to
+ * @reply_serial: the serial of the method call being replied to
+ * @error_name: (nullable): the D-Bus name of the error replied with, or
+ *   %NULL if the call succeeded
+ *
+ * Records the outcome of a call passed to eks_metrics_call_started(). Replies
+ * to calls which weren't started are ignored.
+ */
+void
+eks_metrics_call_finished (EksMetrics  *metrics,
+                           const gchar *destination,
+                           guint32      reply_serial,
+                           const gchar *error_name)
+{
+  g_autofree gchar *key = call_key (destination, reply_serial);
+  gint64 now = g_get_monotonic_time ();
+  InFlightCall *call;
+
+  g_mutex_lock (&metrics->lock);
+
+  call = g_hash_table_lookup (metrics->in_flight, key);
+  if (call != NULL)
+    {
+      CallStats *stats[2] = { NULL, NULL };
+
+      stats[0] = lookup_or_create_stats (metrics->interfaces, call->interface_name);
+      if (call->app_id != NULL)
+        stats[1] = lookup_or_create_stats (metrics->apps, call->app_id);
+
+      for (gsize i = 0; i < G_N_ELEMENTS (stats) && stats[i] != NULL; ++i)
+        {
+          stats[i]->calls++;
+          if (error_name != NULL)
+            stats[i]->errors++;
+          histogram_add (&stats[i]->phases[EKS_METRICS_PHASE_TOTAL],
+                         now - call->start_time);
+        }
+
+      if (error_name != NULL)
+        (*lookup_or_create_counter (metrics->errors, error_name))++;
+
+      g_hash_table_remove (metrics->in_flight, key);
+    }
+
+  g_mutex_unlock (&metrics->lock);
+}
+
+/**
+ * eks_metrics_record_phase:
+ * @metrics: the metrics
+ * @interface_name: the interface of the method the phase was part of
+ * @phase: the phase
+ * @duration_usec: how long the phase took, in microseconds
+ *
+ * Records how long one phase of handling a call took. This can be called
+ * from any thread.
+ */
+void
+eks_metrics_record_phase (EksMetrics      *metrics,
+                          const gchar     *interface_name,
+                          EksMetricsPhase  phase,
+                          gint64           duration_usec)
+{
+  g_return_if_fail (phase < EKS_METRICS_N_PHASES);
+
+  g_mutex_lock (&metrics->lock);
+  histogram_add (&lookup_or_create_stats (metrics->interfaces, interface_name)->phases[phase],
+                 duration_usec);
+  g_mutex_unlock (&metrics->lock);
+}
+
+/**
+ * eks_metrics_set_gauge:
+ * @metrics: the metrics
+ * @name: the name of the gauge
+ * @value: the current value
+ *
+ * Sets a value which is reported as is, such as the number of providers.
+ */
+void
+eks_metrics_set_gauge (EksMetrics  *metrics,
+                       const gchar *name,
+                       guint64      value)
+{
+  g_mutex_lock (&metrics->lock);
+  *lookup_or_create_counter (metrics->gauges, name) = value;
+  g_mutex_unlock (&metrics->lock);
+}
+
+/**
+ * eks_metrics_add_cache:
+ * @metrics: the metrics
+ * @name: the name to report the cache under
+ * @cache: the cache, which must be removed with eks_metrics_remove_cache()
+ *   before it is freed
+ *
+ * Reports the size and hit rate of @cache. The numbers of all the caches
+ * with the same name, such as the same cache of every app, are added up.
+ * Caches must only be added and removed on the main thread.
+ */
+void
+eks_metrics_add_cache (EksMetrics  *metrics,
+                       const gchar *name,
+                       EksLruCache *cache)
+{
+  NamedCache named_cache = { g_strdup (name), cache };
+
+  g_mutex_lock (&metrics->lock);
+  g_array_append_val (metrics->caches, named_cache);
+  g_mutex_unlock (&metrics->lock);
+}
+
+void
+eks_metrics_remove_cache (EksMetrics  *metrics,
+                          EksLruCache *cache)
+{
+  g_mutex_lock (&metrics->lock);
+
+  for (guint i = 0; i < metrics->caches->len; ++i)
+    {
+      if (g_array_index (metrics->caches, NamedCache, i).cache == cache)
+        {
+          g_array_remove_index_fast (metrics->caches, i);
+          break;
+        }
+    }
+
+  g_mutex_unlock (&metrics->lock);
+}
+
+static GVariant *
+histogram_to_variant (const Histogram *histogram)
+{
+  return g_variant_new ("(tt@at)",
+                        histogram->count,
+                        histogram->sum_usec,
+                        g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64,
+                                                   histogram->buckets,
+                                                   N_BUCKETS,
+                                                   sizeof (guint64)));
+}
+
+static GVariant *
+call_stats_to_variant (const CallStats *stats)
+{
+  g_auto(GVariantDict) dict;
+
+  g_variant_dict_init (&dict, NULL);
+  g_variant_dict_insert (&dict, "calls", "t", stats->calls);
+  g_variant_dict_insert (&dict, "errors", "t", stats->errors);
+
+  for (guint i = 0; i < EKS_METRICS_N_PHASES; ++i)
+    {
+      if (stats->phases[i].count > 0)
+        g_variant_dict_insert_value (&dict,
+                                     phase_names[i],
+                                     histogram_to_variant (&stats->phases[i]));
+    }
+
+  return g_variant_dict_end (&dict);
+}
+
+static GVariant *
+stats_table_to_variant (GHashTable *table)
+{
+  g_auto(GVariantBuilder) builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&builder, "{s@a{sv}}", key, call_stats_to_variant (value));
+
+  return g_variant_builder_end (&builder);
+}
+
+static GVariant *
+counter_table_to_variant (GHashTable *table)
+{
+  g_auto(GVariantBuilder) builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{st}"));
+
+  g_hash_table_iter_init (&iter, table);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_builder_add (&builder, "{st}", key, *(guint64 *) value);
+
+  return g_variant_builder_end (&builder);
+}
+
+typedef struct
+{
+  guint64 instances;
+  guint64 entries;
+  guint64 bytes;
+  guint64 hits;
+  guint64 misses;
+} CacheTotals;
+
+/* Returns a hash table with cache name keys and CacheTotals values */
+static GHashTable *
+total_caches_by_name (EksMetrics *metrics)
+{
+  GHashTable *totals = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+
+  for (guint i = 0; i < metrics->caches->len; ++i)
+    {
+      NamedCache *named_cache = &g_array_index (metrics->caches, NamedCache, i);
+      CacheTotals *cache_totals = g_hash_table_lookup (totals, named_cache->name);
+
+      if (cache_totals == NULL)
+        {
+          cache_totals = g_new0 (CacheTotals, 1);
+          g_hash_table_insert (totals, named_cache->name, cache_totals);
+        }
+
+      cache_totals->instances++;
+      cache_totals->entries += eks_lru_cache_get_n_entries (named_cache->cache);
+      cache_totals->bytes += eks_lru_cache_get_n_bytes (named_cache->cache);
+      cache_totals->hits += eks_lru_cache_get_hits (named_cache->cache);
+      cache_totals->misses += eks_lru_cache_get_misses (named_cache->cache);
+    }
+
+  return totals;
+}
+
+static GVariant *
+caches_to_variant (EksMetrics *metrics)
+{
+  g_autoptr(GHashTable) totals = total_caches_by_name (metrics);
+  g_auto(GVariantBuilder) builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{st}}"));
+
+  g_hash_table_iter_init (&iter, totals);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      CacheTotals *cache_totals = value;
+
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("{sa{st}}"));
+      g_variant_builder_add (&builder, "s", key);
+      g_variant_builder_open (&builder, G_VARIANT_TYPE ("a{st}"));
+      g_variant_builder_add (&builder, "{st}", "instances", cache_totals->instances);
+      g_variant_builder_add (&builder, "{st}", "entries", cache_totals->entries);
+      g_variant_builder_add (&builder, "{st}", "bytes", cache_totals->bytes);
+      g_variant_builder_add (&builder, "{st}", "hits", cache_totals->hits);
+      g_variant_builder_add (&builder, "{st}", "misses", cache_totals->misses);
+      g_variant_builder_close (&builder);
+      g_variant_builder_close (&builder);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+/**
+ * eks_metrics_to_variant:
+ * @metrics: the metrics
+ *
+ * Takes a snapshot of @metrics, in the format returned by
+ * com.endlessm.EknServices.Metrics.GetMetrics. This must be called on the
+ * main thread.
+ *
+ * Returns: (transfer floating): an a{sv} variant
+ */
+GVariant *
+eks_metrics_to_variant (EksMetrics *metrics)
+{
+  g_auto(GVariantDict) dict;
+  g_autoptr(GVariant) bounds = NULL;
+
+  bounds = g_variant_ref_sink (g_variant_new_fixed_array (G_VARIANT_TYPE_INT64,
+                                                          histogram_bounds_usec,
+                                                          G_N_ELEMENTS (histogram_bounds_usec),
+                                                          sizeof (gint64)));
+
+  g_variant_dict_init (&dict, NULL);
+
+  g_mutex_lock (&metrics->lock);
+
+  g_variant_dict_insert_value (&dict, "histogram-bounds", bounds);
+  g_variant_dict_insert_value (&dict, "interfaces", stats_table_to_variant (metrics->interfaces));
+  g_variant_dict_insert_value (&dict, "apps", stats_table_to_variant (metrics->apps));
+  g_variant_dict_insert_value (&dict, "errors", counter_table_to_variant (metrics->errors));
+  g_variant_dict_insert (&dict, "in-flight", "u", g_hash_table_size (metrics->in_flight));
+  g_variant_dict_insert_value (&dict, "gauges", counter_table_to_variant (metrics->gauges));
+  g_variant_dict_insert_value (&dict, "caches", caches_to_variant (metrics));
+
+  g_mutex_unlock (&metrics->lock);
+
+  return g_variant_dict_end (&dict);
+}
+
+static void
+append_histogram_text (GString         *text,
+                       const gchar     *name,
+                       const Histogram *histogram)
+{
+  g_string_append_printf (text, "    %s: count=%" G_GUINT64_FORMAT " mean=%.1fms",
+                          name,
+                          histogram->count,
+                          histogram->sum_usec / 1000.0 / histogram->count);
+
+  for (gsize i = 0; i < N_BUCKETS; ++i)
+    {
+      if (histogram->buckets[i] == 0)
+        continue;
+
+      if (i < G_N_ELEMENTS (histogram_bounds_usec))
+        g_string_append_printf (text, " <=%" G_GINT64_FORMAT "ms:%" G_GUINT64_FORMAT,
+                                histogram_bounds_usec[i] / 1000,
+                                histogram->buckets[i]);
+      else
+        g_string_append_printf (text, " >%" G_GINT64_FORMAT "ms:%" G_GUINT64_FORMAT,
+                                histogram_bounds_usec[i - 1] / 1000,
+                                histogram->buckets[i]);
+    }
+
+  g_string_append_c (text, '\n');
+}
+
+static gint
+compare_string_ptrs (gconstpointer a,
+                     gconstpointer b,
+                     gpointer      user_data)
+{
+  return g_strcmp0 (*(const gchar * const *) a, *(const gchar * const *) b);
+}
+
+static void
+append_stats_table_text (GString     *text,
+                         const gchar *title,
+                         GHashTable  *table)
+{
+  g_autofree gpointer *keys = (gpointer *) g_hash_table_get_keys_as_array (table, NULL);
+  guint n_keys = g_hash_table_size (table);
+
+  g_qsort_with_data (keys, n_keys, sizeof (gpointer),
+                     compare_string_ptrs, NULL);
+
+  for (guint i = 0; i < n_keys; ++i)
+    {
+      const CallStats *stats = g_hash_table_lookup (table, keys[i]);
+
+      g_string_append_printf (text, "%s %s: calls=%" G_GUINT64_FORMAT " errors=%" G_GUINT64_FORMAT "\n",
+                              title,
+                              (const gchar *) keys[i],
+                              stats->calls,
+                              stats->errors);
+
+      for (guint phase = 0; phase < EKS_METRICS_N_PHASES; ++phase)
+        {
+          if (stats->phases[phase].count > 0)
+            append_histogram_text (text, phase_names[phase], &stats->phases[phase]);
+        }
+    }
+}
+
+/**
+ * eks_metrics_to_text:
+ * @metrics: the metrics
+ *
+ * Like eks_metrics_to_variant(), but as a human-readable report.
+ *
+ * Returns: (transfer full): the report
+ */
+gchar *
+eks_metrics_to_text (EksMetrics *metrics)
+{
+  GString *text = g_string_new (NULL);
+  g_autoptr(GHashTable) cache_totals = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_mutex_lock (&metrics->lock);
+
+  g_string_append_printf (text, "in-flight: %u\n", g_hash_table_size (metrics->in_flight));
+
+  g_hash_table_iter_init (&iter, metrics->gauges);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_string_append_printf (text, "gauge %s: %" G_GUINT64_FORMAT "\n",
+                            (const gchar *) key, *(guint64 *) value);
+
+  g_hash_table_iter_init (&iter, metrics->errors);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_string_append_printf (text, "error %s: %" G_GUINT64_FORMAT "\n",
+                            (const gchar *) key, *(guint64 *) value);
+
+  cache_totals = total_caches_by_name (metrics);
+  g_hash_table_iter_init (&iter, cache_totals);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    {
+      CacheTotals *totals = value;
+
+      g_string_append_printf (text,
+                              "cache %s: instances=%" G_GUINT64_FORMAT
+                              " entries=%" G_GUINT64_FORMAT
+                              " bytes=%" G_GUINT64_FORMAT
+                              " hits=%" G_GUINT64_FORMAT
+                              " misses=%" G_GUINT64_FORMAT "\n",
+                              (const gchar *) key,
+                              totals->instances,
+                              totals->entries,
+                              totals->bytes,
+                              totals->hits,
+                              totals->misses);
+    }
+
+  append_stats_table_text (text, "interface", metrics->interfaces);
+  append_stats_table_text (text, "app", metrics->apps);
+
+  g_mutex_unlock (&metrics->lock);
+
+  return g_string_free (text, FALSE);
+}
@@ -0,0 +1,63 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <glib.h>
+
+#include "eks-lru-cache.h"
+
+G_BEGIN_DECLS
+
+/**
+ * EksMetricsPhase:
+ * @EKS_METRICS_PHASE_TOTAL: From receiving a method call to sending its reply
+ * @EKS_METRICS_PHASE_DISPATCH: Finding or creating the provider for a call
+ * @EKS_METRICS_PHASE_ENGINE: Waiting for the engine to run a query
+ * @EKS_METRICS_PHASE_SERIALIZATION: Turning models into the reply
+ *
+ * The phases which latencies are measured for.
+ */
+typedef enum {
+  EKS_METRICS_PHASE_TOTAL,
+  EKS_METRICS_PHASE_DISPATCH,
+  EKS_METRICS_PHASE_ENGINE,
+  EKS_METRICS_PHASE_SERIALIZATION,
+  EKS_METRICS_N_PHASES
+} EksMetricsPhase;
+
+typedef struct _EksMetrics EksMetrics;
+
+EksMetrics * eks_metrics_get_default (void);
+
+void eks_metrics_call_started (EksMetrics  *metrics,
+                               const gchar *sender,
+                               guint32      serial,
+                               const gchar *interface_name,
+                               const gchar *app_id);
+
+void eks_metrics_call_finished (EksMetrics  *metrics,
+                                const gchar *destination,
+                                guint32      reply_serial,
+                                const gchar *error_name);
+
+void eks_metrics_record_phase (EksMetrics      *metrics,
+                               const gchar     *interface_name,
+                               EksMetricsPhase  phase,
+                               gint64           duration_usec);
+
+void eks_metrics_set_gauge (EksMetrics  *metrics,
+                            const gchar *name,
+                            guint64      value);
+
+void eks_metrics_add_cache (EksMetrics  *metrics,
+                            const gchar *name,
+                            EksLruCache *cache);
+
+void eks_metrics_remove_cache (EksMetrics  *metrics,
+                               EksLruCache *cache);
+
+GVariant * eks_metrics_to_variant (EksMetrics *metrics);
+
+gchar * eks_metrics_to_text (EksMetrics *metrics);
+
+G_END_DECLS
@@ -20,3 +20,69 @@ eks_provider_skeleton_for_interface (EksProvider *self,
   return (*iface->skeleton_for_interface) (self, interface);
 }
 
+/**
+ * eks_provider_can_evict:
+ * @self: the provider
+ *
+ * Whether the provider can be dropped while idle without losing any work
+ * that would not be redone on the next request. Providers which do not
+ * implement this can always be evicted.
+ *
+ * Returns: %TRUE if the provider can be evicted
+ */
+gboolean
+eks_provider_can_evict (EksProvider *self)
+{
+  g_return_val_if_fail (EKS_IS_PROVIDER (self), TRUE);
+
+  EksProviderInterface *iface = EKS_PROVIDER_GET_IFACE (self);
+  if (iface->can_evict == NULL)
+    return TRUE;
+
+  return (*iface->can_evict) (self);
+}
+
+/**
+ * eks_provider_save_state:
+ * @self: the provider
+ *
+ * Saves what the provider computed from the content of its app, so that a
+ * later instance of the service can pick up from there with
+ * eks_provider_restore_state(). Providers which do not implement this have
+ * nothing worth saving.
+ *
+ * Returns: (transfer full) (nullable): an a{sv} with the state, or %NULL
+ */
+GVariant *
+eks_provider_save_state (EksProvider *self)
+{
+  g_return_val_if_fail (EKS_IS_PROVIDER (self), NULL);
+
+  EksProviderInterface *iface = EKS_PROVIDER_GET_IFACE (self);
+  if (iface->save_state == NULL)
+    return NULL;
+
+  GVariant *state = (*iface->save_state) (self);
+  return state != NULL ? g_variant_ref_sink (state) : NULL;
+}
+
+/**
+ * eks_provider_restore_state:
+ * @self: the provider
+ * @state: an a{sv} returned by eks_provider_save_state() for the same app
+ *
+ * Restores a saved state into a newly created provider. The caller has
+ * checked that the app's shards are the same as when @state was saved, but
+ * @state comes from a file, so its entries must still be type checked.
+ */
+void
+eks_provider_restore_state (EksProvider *self,
+                            GVariant    *state)
+{
+  g_return_if_fail (EKS_IS_PROVIDER (self));
+  g_return_if_fail (g_variant_is_of_type (state, G_VARIANT_TYPE_VARDICT));
+
+  EksProviderInterface *iface = EKS_PROVIDER_GET_IFACE (self);
+  if (iface->restore_state != NULL)
+    (*iface->restore_state) (self, state);
+}
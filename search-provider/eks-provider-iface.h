@@ -16,9 +16,20 @@ struct _EksProviderInterface
 
   GDBusInterfaceSkeleton * (*skeleton_for_interface) (EksProvider *self,
                                                       const gchar *interface);
+  gboolean (*can_evict) (EksProvider *self);
+  GVariant * (*save_state) (EksProvider *self);
+  void (*restore_state) (EksProvider *self,
+                         GVariant    *state);
 };
 
 GDBusInterfaceSkeleton * eks_provider_skeleton_for_interface (EksProvider *self,
                                                               const gchar *interface);
 
+gboolean eks_provider_can_evict (EksProvider *self);
+
+GVariant * eks_provider_save_state (EksProvider *self);
+
+void eks_provider_restore_state (EksProvider *self,
+                                 GVariant    *state);
+
 G_END_DECLS
@@ -5,6 +5,9 @@
 #include <dmodel.h>
 
 #include <gio/gio.h>
+#include <glib/gstdio.h>
+
+#include <string.h>
 
 gboolean
 models_for_result (DmEngine      *engine,
@@ -79,3 +82,66 @@ strv_from_shard_list (GSList *string_list)
 
   return strv;
 }
+
+/* Returns a string which changes whenever the set of shards backing an
+ * app changes. Shard paths include the deployment they belong to, so an
+ * app update always results in a different fingerprint. */
+gchar *
+shards_fingerprint_for_shard_list (GSList *shards)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA1);
+
+  for (GSList *l = shards; l; l = l->next)
+    {
+      const gchar *path = dm_shard_get_path (l->data);
+      g_checksum_update (checksum, (const guchar *) path, strlen (path) + 1);
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+gchar *
+shards_fingerprint_for_app (DmEngine     *engine,
+                            const gchar  *application_id,
+                            GError      **error)
+{
+  DmDomain *domain = dm_engine_get_domain_for_app (engine, application_id,
+                                                   error);
+  if (domain == NULL)
+    return NULL;
+
+  return shards_fingerprint_for_shard_list (dm_domain_get_shards (domain));
+}
+
+/* Unlike the fingerprint, which only tells which shards the app uses, the
+ * generation also changes when a shard is updated in place, so that state
+ * computed from the shards can be kept across restarts of the service */
+gchar *
+shards_generation_for_app (DmEngine     *engine,
+                           const gchar  *application_id,
+                           GError      **error)
+{
+  g_autoptr(GChecksum) checksum = g_checksum_new (G_CHECKSUM_SHA1);
+  DmDomain *domain = dm_engine_get_domain_for_app (engine, application_id,
+                                                   error);
+  if (domain == NULL)
+    return NULL;
+
+  for (GSList *l = dm_domain_get_shards (domain); l; l = l->next)
+    {
+      const gchar *path = dm_shard_get_path (l->data);
+      GStatBuf buf;
+      gint64 stat_data[2] = { 0, 0 };
+
+      if (g_stat (path, &buf) == 0)
+        {
+          stat_data[0] = buf.st_size;
+          stat_data[1] = buf.st_mtime;
+        }
+
+      g_checksum_update (checksum, (const guchar *) path, strlen (path) + 1);
+      g_checksum_update (checksum, (const guchar *) stat_data, sizeof (stat_data));
+    }
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
@@ -23,3 +23,13 @@ gboolean models_and_shards_for_result (DmEngine      *engine,
 
 GStrv strv_from_shard_list (GSList *string_list);
 
+gchar * shards_fingerprint_for_shard_list (GSList *shards);
+
+gchar * shards_fingerprint_for_app (DmEngine     *engine,
+                                    const gchar  *application_id,
+                                    GError      **error);
+
+gchar * shards_generation_for_app (DmEngine     *engine,
+                                   const gchar  *application_id,
+                                   GError      **error);
+
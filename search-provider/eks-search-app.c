@@ -2,17 +2,43 @@
 
 #include "eks-search-app.h"
 
+#include "eks-bus-label.h"
+#include "eks-discovery-feed-batch-provider.h"
 #include "eks-discovery-feed-provider-dbus.h"
 #include "eks-discovery-feed-provider.h"
+#include "eks-federated-search-dbus.h"
+#include "eks-federated-search-provider.h"
 #include "eks-metadata-provider.h"
 #include "eks-metadata-provider-dbus.h"
+#include "eks-metrics.h"
+#include "eks-metrics-dbus.h"
+#include "eks-metrics-provider.h"
 #include "eks-provider-iface.h"
 #include "eks-search-provider.h"
 #include "eks-search-provider-dbus.h"
+#include "eks-snapshot.h"
 #include "eks-subtree-dispatcher.h"
+#include "eks-trace.h"
 
+#include <errno.h>
 #include <string.h>
 
+#ifdef HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
+
+/* Discovery Feed cards for the next day are computed this long before
+ * midnight, spread over that same amount of time */
+#define PRECOMPUTE_LEAD_SECONDS (10 * 60)
+#define PRECOMPUTE_MIN_INTERVAL_MS 250
+#define PRECOMPUTE_MAX_INTERVAL_MS (10 * 1000)
+
+/* How often idle providers are looked for */
+#define PROVIDER_SWEEP_INTERVAL_SECONDS 10
+
+/* How often the metrics are written out, if a file is set for them */
+#define METRICS_DUMP_INTERVAL_SECONDS 60
+
 /**
  * EksSearchApp:
  *
@@ -24,124 +50,262 @@ struct _EksSearchApp
   GApplication parent_instance;
 
   EksSubtreeDispatcher *dispatcher;
-  // Hash table with app id string keys, EksSearchProvider values
+  // Providers for the root object, which aren't specific to an app, created
+  // on the first call to each of them
+  EksProvider *federated_search_provider;
+  EksProvider *discovery_feed_batch_provider;
+  EksProvider *metrics_provider;
+  // Hash table with app id string keys, ProviderEntry values of EksSearchProvider
   GHashTable *app_search_providers;
-  // Hash table with app id string keys, EksDiscoveryFeedProvider values
+  // Hash table with app id string keys, ProviderEntry values of EksDiscoveryFeedProvider
   GHashTable *discovery_feed_content_providers;
-  // Hash table with app id string keys, EksMetadataProvider values
+  // Hash table with app id string keys, ProviderEntry values of EksMetadataProvider
   GHashTable *metadata_providers;
+
+  // Eviction of providers which haven't been used for a while
+  guint provider_idle_timeout;
+  guint max_providers;
+  guint provider_sweep_id;
+
+  // Precomputation of the next day's Discovery Feed cards
+  GDateTime *precompute_next_day;
+  GDateTime *precompute_run_day;
+  guint precompute_timeout_id;
+  guint precompute_step_id;
+  guint precompute_interval_ms;
+  guint precompute_next_index;
+  // Array of DiscoveryFeedApp for the run in progress
+  GPtrArray *precompute_apps;
+  GCancellable *precompute_cancellable;
+
+  // Metrics of the calls made on the subtree
+  GDBusConnection *metrics_connection;
+  gchar *metrics_object_path;
+  guint metrics_filter_id;
+  gchar *metrics_dump_file;
+  guint metrics_dump_id;
+
+  // State of the providers carried over from the previous instance of the
+  // service, and saved for the next one, created with the first provider
+  gchar *snapshot_file;
+  EksSnapshot *snapshot;
+
+  // Resident mode, where the service stays around and trims its memory
+  // once idle instead of exiting
+  gboolean resident;
+  gint64 last_activity;
+  guint idle_trim_id;
 };
 
 G_DEFINE_TYPE (EksSearchApp,
                eks_search_app,
                G_TYPE_APPLICATION)
 
+enum {
+  PROP_0,
+  PROP_PROVIDER_IDLE_TIMEOUT,
+  PROP_MAX_PROVIDERS,
+  PROP_METRICS_DUMP_FILE,
+  PROP_SNAPSHOT_FILE,
+  PROP_RESIDENT,
+  NPROPS
+};
+
+static GParamSpec *eks_search_app_props [NPROPS] = { NULL, };
+
 static void
-eks_search_app_finalize (GObject *object)
+eks_search_app_get_property (GObject    *object,
+                             guint       prop_id,
+                             GValue     *value,
+                             GParamSpec *pspec)
 {
   EksSearchApp *self = EKS_SEARCH_APP (object);
 
-  g_clear_object (&self->dispatcher);
-  g_clear_pointer (&self->app_search_providers, g_hash_table_unref);
-  g_clear_pointer (&self->discovery_feed_content_providers, g_hash_table_unref);
-  g_clear_pointer (&self->metadata_providers, g_hash_table_unref);
+  switch (prop_id)
+    {
+    case PROP_PROVIDER_IDLE_TIMEOUT:
+      g_value_set_uint (value, self->provider_idle_timeout);
+      break;
 
-  G_OBJECT_CLASS (eks_search_app_parent_class)->finalize (object);
+    case PROP_MAX_PROVIDERS:
+      g_value_set_uint (value, self->max_providers);
+      break;
+
+    case PROP_METRICS_DUMP_FILE:
+      g_value_set_string (value, self->metrics_dump_file);
+      break;
+
+    case PROP_SNAPSHOT_FILE:
+      g_value_set_string (value, self->snapshot_file);
+      break;
+
+    case PROP_RESIDENT:
+      g_value_set_boolean (value, self->resident);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
 }
 
-static gboolean
-eks_search_app_register (GApplication    *application,
-                         GDBusConnection *connection,
-                         const gchar     *object_path,
-                         GError          **error)
+static void
+eks_search_app_set_property (GObject      *object,
+                             guint         prop_id,
+                             const GValue *value,
+                             GParamSpec   *pspec)
 {
-  EksSearchApp *self = EKS_SEARCH_APP (application);
+  EksSearchApp *self = EKS_SEARCH_APP (object);
 
-  eks_subtree_dispatcher_register (self->dispatcher, connection, object_path, error);
-  return TRUE;
+  switch (prop_id)
+    {
+    case PROP_PROVIDER_IDLE_TIMEOUT:
+      self->provider_idle_timeout = g_value_get_uint (value);
+      break;
+
+    case PROP_MAX_PROVIDERS:
+      self->max_providers = g_value_get_uint (value);
+      break;
+
+    case PROP_METRICS_DUMP_FILE:
+      g_free (self->metrics_dump_file);
+      self->metrics_dump_file = g_value_dup_string (value);
+      break;
+
+    case PROP_SNAPSHOT_FILE:
+      g_free (self->snapshot_file);
+      self->snapshot_file = g_value_dup_string (value);
+      break;
+
+    case PROP_RESIDENT:
+      self->resident = g_value_get_boolean (value);
+      break;
+
+    default:
+      G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
+    }
 }
 
 static void
-eks_search_app_unregister (GApplication    *application,
-                           GDBusConnection *connection,
-                           const gchar     *object_path)
+eks_search_app_finalize (GObject *object)
 {
-  EksSearchApp *self = EKS_SEARCH_APP (application);
+  EksSearchApp *self = EKS_SEARCH_APP (object);
 
-  eks_subtree_dispatcher_unregister (self->dispatcher);
+  if (self->provider_sweep_id != 0)
+    g_source_remove (self->provider_sweep_id);
+  if (self->metrics_dump_id != 0)
+    g_source_remove (self->metrics_dump_id);
+  if (self->idle_trim_id != 0)
+    g_source_remove (self->idle_trim_id);
+
+  g_clear_object (&self->dispatcher);
+  g_clear_object (&self->federated_search_provider);
+  g_clear_object (&self->discovery_feed_batch_provider);
+  g_clear_object (&self->metrics_provider);
+  g_clear_pointer (&self->app_search_providers, g_hash_table_unref);
+  g_clear_pointer (&self->discovery_feed_content_providers, g_hash_table_unref);
+  g_clear_pointer (&self->metadata_providers, g_hash_table_unref);
+  g_clear_pointer (&self->precompute_next_day, g_date_time_unref);
+  g_clear_pointer (&self->precompute_run_day, g_date_time_unref);
+  g_clear_pointer (&self->precompute_apps, g_ptr_array_unref);
+  g_clear_object (&self->precompute_cancellable);
+  g_clear_object (&self->metrics_connection);
+  g_clear_pointer (&self->metrics_object_path, g_free);
+  g_clear_pointer (&self->metrics_dump_file, g_free);
+  g_clear_pointer (&self->snapshot_file, g_free);
+  g_clear_pointer (&self->snapshot, eks_snapshot_free);
+
+  G_OBJECT_CLASS (eks_search_app_parent_class)->finalize (object);
 }
 
+static gboolean eks_search_app_register (GApplication     *application,
+                                         GDBusConnection  *connection,
+                                         const gchar      *object_path,
+                                         GError          **error);
+static void eks_search_app_unregister (GApplication    *application,
+                                       GDBusConnection *connection,
+                                       const gchar     *object_path);
+static void eks_search_app_shutdown (GApplication *application);
+
 static void
 eks_search_app_class_init (EksSearchAppClass *klass)
 {
   GObjectClass *object_class = G_OBJECT_CLASS (klass);
   GApplicationClass *application_class = G_APPLICATION_CLASS (klass);
 
+  object_class->get_property = eks_search_app_get_property;
+  object_class->set_property = eks_search_app_set_property;
   object_class->finalize = eks_search_app_finalize;
 
   application_class->dbus_register = eks_search_app_register;
   application_class->dbus_unregister = eks_search_app_unregister;
-}
-
-// The following code is adapted from
-// https://github.com/systemd/systemd/blob/master/src/basic/bus-label.c
-static gint
-unhexchar (gchar c)
-{
-  if (c >= '0' && c <= '9')
-    return c - '0';
-
-  if (c >= 'a' && c <= 'f')
-    return c - 'a' + 10;
-
-  if (c >= 'A' && c <= 'F')
-    return c - 'A' + 10;
+  application_class->shutdown = eks_search_app_shutdown;
 
-  return -1;
-}
-
-static gchar *
-bus_label_unescape (const gchar *f) {
-  gchar *r, *t;
-  gsize i;
-  gsize l = f ? strlen (f) : 0;
+  /**
+   * EksSearchApp:provider-idle-timeout:
+   *
+   * Number of seconds after which a provider that received no requests is
+   * dropped, or 0 to keep idle providers around.
+   */
+  eks_search_app_props[PROP_PROVIDER_IDLE_TIMEOUT] =
+    g_param_spec_uint ("provider-idle-timeout", "Provider Idle Timeout",
+      "Seconds after which an unused provider is dropped",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
-  /* Special case for the empty string */
-  if (l == 1 && *f == '_')
-    return g_strdup ("");
+  /**
+   * EksSearchApp:max-providers:
+   *
+   * Number of providers of all kinds to keep, dropping the least recently
+   * used ones first, or 0 for no limit.
+   */
+  eks_search_app_props[PROP_MAX_PROVIDERS] =
+    g_param_spec_uint ("max-providers", "Max Providers",
+      "Maximum number of providers to keep",
+      0, G_MAXUINT, 0,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
-  r = g_new (gchar, l + 1);
-  if (!r)
-    return NULL;
+  /**
+   * EksSearchApp:metrics-dump-file:
+   *
+   * Path of a file to periodically write a report of the metrics to, or
+   * %NULL to not write one.
+   */
+  eks_search_app_props[PROP_METRICS_DUMP_FILE] =
+    g_param_spec_string ("metrics-dump-file", "Metrics Dump File",
+      "File to periodically write the metrics to",
+      NULL,
+      G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS);
 
-  for (i = 0, t = r; i < l; ++i)
-    {
-      if (f[i] == '_')
-        {
-          int a, b;
-
-          if (l - i < 3 ||
-              (a = unhexchar (f[i + 1])) < 0 ||
-              (b = unhexchar (f[i + 2])) < 0)
-            {
-              /* Invalid escape code, let's take it literal then */
-              *(t++) = '_';
-            }
-          else
-            {
-              *(t++) = (gchar) ((a << 4) | b);
-              i += 2;
-            }
-        }
-      else
-        {
-          *(t++) = f[i];
-        }
-    }
+  /**
+   * EksSearchApp:snapshot-file:
+   *
+   * Path of a file to save the state of the providers to when the service
+   * exits, and to restore it from into the providers of the next instance,
+   * or %NULL to always start from scratch.
+   */
+  eks_search_app_props[PROP_SNAPSHOT_FILE] =
+    g_param_spec_string ("snapshot-file", "Snapshot File",
+      "File to carry the state of the providers over to the next instance in",
+      NULL,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
-  *t = 0;
+  /**
+   * EksSearchApp:resident:
+   *
+   * Whether to stay running when idle instead of exiting after the
+   * #GApplication:inactivity-timeout. Once no call came in for that long,
+   * the providers are dropped and their memory handed back to the system
+   * instead, so that the next call doesn't wait for the service to start.
+   */
+  eks_search_app_props[PROP_RESIDENT] =
+    g_param_spec_boolean ("resident", "Resident",
+      "Whether to trim memory when idle instead of exiting",
+      FALSE,
+      G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
 
-  return r;
+  g_object_class_install_properties (object_class,
+                                     NPROPS,
+                                     eks_search_app_props);
 }
 
 typedef struct {
@@ -165,12 +329,14 @@ subtree_object_info_for_interface (EksSearchApp      *self,
            g_strcmp0 (interface, "com.endlessm.DiscoveryFeedWord") == 0 ||
            g_strcmp0 (interface, "com.endlessm.DiscoveryFeedNews") == 0 ||
            g_strcmp0 (interface, "com.endlessm.DiscoveryFeedVideo") == 0 ||
-           g_strcmp0 (interface, "com.endlessm.DiscoveryFeedArtwork") == 0)
+           g_strcmp0 (interface, "com.endlessm.DiscoveryFeedArtwork") == 0 ||
+           g_strcmp0 (interface, "com.endlessm.DiscoveryFeedCards") == 0)
     {
       info->create_type = EKS_TYPE_DISCOVERY_FEED_PROVIDER;
       info->cache = self->discovery_feed_content_providers;
     }
-  else if (g_strcmp0 (interface, "com.endlessm.ContentMetadata") == 0)
+  else if (g_strcmp0 (interface, "com.endlessm.ContentMetadata") == 0 ||
+           g_strcmp0 (interface, "com.endlessm.ContentMetadata2") == 0)
     {
       info->create_type = EKS_TYPE_METADATA_PROVIDER;
       info->cache = self->metadata_providers;
@@ -179,6 +345,362 @@ subtree_object_info_for_interface (EksSearchApp      *self,
     g_assert_not_reached();
 }
 
+typedef struct {
+  EksProvider *provider;
+  gint64 last_used;
+} ProviderEntry;
+
+static void
+provider_entry_free (ProviderEntry *entry)
+{
+  g_object_unref (entry->provider);
+
+  g_free (entry);
+}
+
+static guint
+count_providers (EksSearchApp *self)
+{
+  return g_hash_table_size (self->app_search_providers) +
+         g_hash_table_size (self->discovery_feed_content_providers) +
+         g_hash_table_size (self->metadata_providers);
+}
+
+static void
+update_provider_gauges (EksSearchApp *self)
+{
+  EksMetrics *metrics = eks_metrics_get_default ();
+
+  eks_metrics_set_gauge (metrics, "search-providers",
+                         g_hash_table_size (self->app_search_providers));
+  eks_metrics_set_gauge (metrics, "discovery-feed-providers",
+                         g_hash_table_size (self->discovery_feed_content_providers));
+  eks_metrics_set_gauge (metrics, "metadata-providers",
+                         g_hash_table_size (self->metadata_providers));
+}
+
+/* The snapshot is dropped along with the providers when trimming memory,
+ * and created again when it is next needed */
+static void
+ensure_snapshot (EksSearchApp *self)
+{
+  if (self->snapshot == NULL)
+    self->snapshot = eks_snapshot_new (self->snapshot_file);
+}
+
+/* Keeps the state of a provider which is about to be dropped, either when
+ * it is evicted or when the service exits, for the next instance */
+static void
+snapshot_provider_state (EksSearchApp *self,
+                         const gchar  *subnode,
+                         EksProvider  *provider)
+{
+  g_autofree gchar *app_id = NULL;
+  g_autoptr(GVariant) state = NULL;
+
+  if (self->snapshot_file == NULL)
+    return;
+
+  state = eks_provider_save_state (provider);
+  if (state == NULL)
+    return;
+
+  app_id = bus_label_unescape (subnode);
+  ensure_snapshot (self);
+  eks_snapshot_add_state (self->snapshot, app_id, G_OBJECT_TYPE_NAME (provider), state);
+}
+
+static void
+restore_provider_state (EksSearchApp *self,
+                        const gchar  *app_id,
+                        EksProvider  *provider,
+                        guint         trace_id)
+{
+  g_autoptr(GVariant) state = NULL;
+  gint64 restore_begin = eks_trace_begin (trace_id);
+
+  ensure_snapshot (self);
+  state = eks_snapshot_lookup_state (self->snapshot, app_id, G_OBJECT_TYPE_NAME (provider));
+  if (state != NULL)
+    eks_provider_restore_state (provider, state);
+
+  eks_trace_span (trace_id, "snapshot-restore", restore_begin);
+}
+
+typedef struct {
+  EksSearchApp *self;
+  gint64 now;
+  gint64 max_idle;
+} IdleEvictionData;
+
+static gboolean
+provider_entry_is_idle (gpointer key,
+                        gpointer value,
+                        gpointer user_data)
+{
+  ProviderEntry *entry = value;
+  IdleEvictionData *data = user_data;
+
+  if (data->now - entry->last_used < data->max_idle ||
+      !eks_provider_can_evict (entry->provider))
+    return FALSE;
+
+  snapshot_provider_state (data->self, key, entry->provider);
+  return TRUE;
+}
+
+/* Drops the least recently used provider of all kinds which can be
+ * dropped. Returns whether one was dropped. */
+static gboolean
+evict_least_recently_used_provider (EksSearchApp *self,
+                                    gint64        now)
+{
+  GHashTable *caches[] = {
+    self->app_search_providers,
+    self->discovery_feed_content_providers,
+    self->metadata_providers,
+  };
+  GHashTable *oldest_cache = NULL;
+  const gchar *oldest_subnode = NULL;
+  ProviderEntry *oldest_entry = NULL;
+  gint64 oldest_last_used = G_MAXINT64;
+
+  for (gsize i = 0; i < G_N_ELEMENTS (caches); ++i)
+    {
+      GHashTableIter iter;
+      gpointer key, value;
+
+      g_hash_table_iter_init (&iter, caches[i]);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        {
+          ProviderEntry *entry = value;
+
+          if (entry->last_used >= oldest_last_used ||
+              !eks_provider_can_evict (entry->provider))
+            continue;
+
+          oldest_cache = caches[i];
+          oldest_subnode = key;
+          oldest_entry = entry;
+          oldest_last_used = entry->last_used;
+        }
+    }
+
+  if (oldest_cache == NULL)
+    return FALSE;
+
+  snapshot_provider_state (self, oldest_subnode, oldest_entry->provider);
+  g_hash_table_remove (oldest_cache, oldest_subnode);
+  return TRUE;
+}
+
+/* Requests which are still being handled by a dropped provider hold a
+ * reference on it until they are answered. The next request for the same
+ * app creates a new provider. */
+static gboolean
+sweep_providers (gpointer user_data)
+{
+  EksSearchApp *self = user_data;
+  gint64 now = g_get_monotonic_time ();
+  GHashTable *caches[] = {
+    self->app_search_providers,
+    self->discovery_feed_content_providers,
+    self->metadata_providers,
+  };
+
+  if (self->provider_idle_timeout > 0)
+    {
+      IdleEvictionData data = {
+        .self = self,
+        .now = now,
+        .max_idle = (gint64) self->provider_idle_timeout * G_USEC_PER_SEC,
+      };
+
+      for (gsize i = 0; i < G_N_ELEMENTS (caches); ++i)
+        g_hash_table_foreach_remove (caches[i], provider_entry_is_idle, &data);
+    }
+
+  if (self->max_providers > 0)
+    {
+      while (count_providers (self) > self->max_providers &&
+             evict_least_recently_used_provider (self, now))
+        ;
+    }
+
+  update_provider_gauges (self);
+
+  if (count_providers (self) == 0)
+    {
+      self->provider_sweep_id = 0;
+      return G_SOURCE_REMOVE;
+    }
+
+  return G_SOURCE_CONTINUE;
+}
+
+static EksProvider *
+lookup_or_create_provider (EksSearchApp            *self,
+                           const SubtreeObjectInfo *info,
+                           const gchar             *subnode,
+                           guint                    trace_id)
+{
+  ProviderEntry *entry = g_hash_table_lookup (info->cache, subnode);
+  if (entry == NULL)
+    {
+      g_autofree gchar *app_id = bus_label_unescape (subnode);
+      gint64 creation_begin = eks_trace_begin (trace_id);
+      entry = g_new0 (ProviderEntry, 1);
+      entry->provider = g_object_new (info->create_type,
+                                      "application-id", app_id,
+                                      NULL);
+      g_hash_table_insert (info->cache, g_strdup (subnode), entry);
+      update_provider_gauges (self);
+      eks_trace_span (trace_id, "provider-creation", creation_begin);
+
+      if (self->snapshot_file != NULL)
+        restore_provider_state (self, app_id, entry->provider, trace_id);
+    }
+
+  entry->last_used = g_get_monotonic_time ();
+
+  if (self->provider_sweep_id == 0 &&
+      (self->provider_idle_timeout > 0 || self->max_providers > 0))
+    self->provider_sweep_id = g_timeout_add_seconds (PROVIDER_SWEEP_INTERVAL_SECONDS,
+                                                     sweep_providers,
+                                                     self);
+
+  return entry->provider;
+}
+
+/* Drops everything which is rebuilt on demand, keeping the state of the
+ * providers in the snapshot if there is one. The engine keeps the domains
+ * it opened, since it can't be asked to close them. */
+static void
+trim_idle_memory (EksSearchApp *self)
+{
+  g_autoptr(GError) error = NULL;
+  GHashTable *caches[] = {
+    self->app_search_providers,
+    self->discovery_feed_content_providers,
+    self->metadata_providers,
+  };
+  IdleEvictionData data = {
+    .self = self,
+    .now = g_get_monotonic_time (),
+    .max_idle = 0,
+  };
+
+  for (gsize i = 0; i < G_N_ELEMENTS (caches); ++i)
+    g_hash_table_foreach_remove (caches[i], provider_entry_is_idle, &data);
+  update_provider_gauges (self);
+
+  /* Providers created from now on read the snapshot just written, which
+   * the next one maps again */
+  if (self->snapshot != NULL)
+    {
+      if (!eks_snapshot_write (self->snapshot, &error))
+        g_warning ("Could not write snapshot to %s: %s",
+                   self->snapshot_file, error->message);
+      g_clear_pointer (&self->snapshot, eks_snapshot_free);
+    }
+
+  g_thread_pool_stop_unused_threads ();
+
+#ifdef HAVE_MALLOC_TRIM
+  malloc_trim (0);
+#endif
+}
+
+static gboolean
+on_idle_trim_timeout (gpointer user_data)
+{
+  EksSearchApp *self = user_data;
+  gint64 idle_usec = (gint64) g_application_get_inactivity_timeout (G_APPLICATION (self)) * 1000;
+  gint64 idle_for = g_get_monotonic_time () - self->last_activity;
+
+  /* Calls since the timeout was added only moved the deadline */
+  if (idle_for < idle_usec)
+    {
+      self->idle_trim_id = g_timeout_add ((idle_usec - idle_for) / 1000 + 1,
+                                          on_idle_trim_timeout,
+                                          self);
+      return G_SOURCE_REMOVE;
+    }
+
+  self->idle_trim_id = 0;
+  trim_idle_memory (self);
+  return G_SOURCE_REMOVE;
+}
+
+/* Called for every call, so it only adds a timeout when there is none */
+static void
+note_activity (EksSearchApp *self)
+{
+  if (!self->resident)
+    return;
+
+  self->last_activity = g_get_monotonic_time ();
+  if (self->idle_trim_id == 0)
+    self->idle_trim_id = g_timeout_add (g_application_get_inactivity_timeout (G_APPLICATION (self)),
+                                        on_idle_trim_timeout,
+                                        self);
+}
+
+static EksProvider *lookup_discovery_feed_provider (EksDiscoveryFeedBatchProvider *batch_provider,
+                                                   const gchar                   *app_id,
+                                                   EksSearchApp                  *self);
+
+/* The service is activated for, and usually exits after, a handful of
+ * calls, so the root providers are only created once they are called */
+static EksProvider *
+root_provider_for_interface (EksSearchApp *self,
+                             const gchar  *interface)
+{
+  if (g_strcmp0 (interface, "com.endlessm.DiscoveryFeedBatch") == 0)
+    {
+      if (self->discovery_feed_batch_provider == NULL)
+        {
+          self->discovery_feed_batch_provider = g_object_new (EKS_TYPE_DISCOVERY_FEED_BATCH_PROVIDER, NULL);
+          g_signal_connect (self->discovery_feed_batch_provider, "lookup-provider",
+                            G_CALLBACK (lookup_discovery_feed_provider), self);
+        }
+      return self->discovery_feed_batch_provider;
+    }
+
+  if (g_strcmp0 (interface, "com.endlessm.EknServices.Metrics") == 0)
+    {
+      if (self->metrics_provider == NULL)
+        self->metrics_provider = g_object_new (EKS_TYPE_METRICS_PROVIDER, NULL);
+      return self->metrics_provider;
+    }
+
+  if (self->federated_search_provider == NULL)
+    self->federated_search_provider = g_object_new (EKS_TYPE_FEDERATED_SEARCH_PROVIDER, NULL);
+  return self->federated_search_provider;
+}
+
+static gboolean
+release_dispatched_provider (gpointer user_data)
+{
+  return G_SOURCE_REMOVE;
+}
+
+/* GDBus doesn't take a reference on the skeleton returned from dispatching,
+ * and only delivers the method call to it from an idle source added right
+ * after, at the default priority. A reference on the provider is held until
+ * a source of lower priority runs, which can only happen once that call has
+ * been delivered, so that evicting the provider in between can't free the
+ * skeleton from under it. Once delivered, the handlers of the providers hold
+ * references of their own for as long as they need them. */
+static void
+hold_provider_until_delivered (EksProvider *provider)
+{
+  g_idle_add_full (G_PRIORITY_LOW,
+                   release_dispatched_provider,
+                   g_object_ref (provider),
+                   g_object_unref);
+}
+
 static GDBusInterfaceSkeleton *
 dispatch_subtree (EksSubtreeDispatcher *dispatcher,
                   const gchar *subnode,
@@ -186,19 +708,534 @@ dispatch_subtree (EksSubtreeDispatcher *dispatcher,
                   EksSearchApp *self)
 {
   SubtreeObjectInfo info;
+  gint64 start_time = g_get_monotonic_time ();
+
+  note_activity (self);
+
+  if (subnode == NULL)
+    return eks_provider_skeleton_for_interface (root_provider_for_interface (self, interface),
+                                                interface);
+
   subtree_object_info_for_interface (self, interface, &info);
 
-  EksProvider *provider = EKS_PROVIDER (g_hash_table_lookup (info.cache, subnode));
-  if (provider == NULL)
+  /* Dispatching is traced as a request of its own, since the provider
+   * only sees the method call later on */
+  guint trace_id = 0;
+  if (eks_trace_is_enabled ())
     {
       g_autofree gchar *app_id = bus_label_unescape (subnode);
-      provider = g_object_new (info.create_type,
-                               "application-id", app_id,
-                               NULL);
-      g_hash_table_insert (info.cache, g_strdup (subnode), provider);
+      trace_id = eks_trace_request_begin (app_id, interface);
     }
 
-  return eks_provider_skeleton_for_interface (provider, interface);
+  EksProvider *provider = lookup_or_create_provider (self, &info, subnode, trace_id);
+  GDBusInterfaceSkeleton *skeleton = eks_provider_skeleton_for_interface (provider, interface);
+  hold_provider_until_delivered (provider);
+
+  eks_metrics_record_phase (eks_metrics_get_default (),
+                            interface,
+                            EKS_METRICS_PHASE_DISPATCH,
+                            g_get_monotonic_time () - start_time);
+  eks_trace_span (trace_id, "dispatch", start_time);
+  eks_trace_request_end (trace_id);
+  return skeleton;
+}
+
+static EksProvider *
+lookup_discovery_feed_provider (EksDiscoveryFeedBatchProvider *batch_provider,
+                                const gchar                   *app_id,
+                                EksSearchApp                  *self)
+{
+  SubtreeObjectInfo info;
+  g_autofree gchar *subnode = bus_label_escape (app_id);
+
+  subtree_object_info_for_interface (self, "com.endlessm.DiscoveryFeedContent", &info);
+  return lookup_or_create_provider (self, &info, subnode, 0);
+}
+
+typedef struct {
+  gchar *app_id;
+  GStrv interfaces;
+} DiscoveryFeedApp;
+
+static void
+discovery_feed_app_free (DiscoveryFeedApp *app)
+{
+  g_free (app->app_id);
+  g_strfreev (app->interfaces);
+
+  g_free (app);
+}
+
+static void
+add_discovery_feed_apps_from_directory (const gchar *data_dir,
+                                        const gchar *bus_name,
+                                        GPtrArray   *apps,
+                                        GHashTable  *seen_app_ids)
+{
+  g_autofree gchar *path = g_build_filename (data_dir,
+                                             "eos-discovery-feed",
+                                             "content-providers",
+                                             NULL);
+  g_autoptr(GDir) dir = g_dir_open (path, 0, NULL);
+  const gchar *name;
+
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      const gchar *group = "Discovery Feed Content Provider";
+      g_autofree gchar *file_path = NULL;
+      g_autofree gchar *file_bus_name = NULL;
+      g_autoptr(GKeyFile) key_file = NULL;
+      DiscoveryFeedApp *app = NULL;
+
+      if (!g_str_has_suffix (name, ".ini"))
+        continue;
+
+      file_path = g_build_filename (path, name, NULL);
+      key_file = g_key_file_new ();
+      if (!g_key_file_load_from_file (key_file, file_path, G_KEY_FILE_NONE, NULL))
+        continue;
+
+      /* Only apps whose content is served by this version of EknServices */
+      file_bus_name = g_key_file_get_string (key_file, group, "BusName", NULL);
+      if (g_strcmp0 (file_bus_name, bus_name) != 0)
+        continue;
+
+      app = g_new0 (DiscoveryFeedApp, 1);
+      app->app_id = g_key_file_get_string (key_file, group, "AppID", NULL);
+      app->interfaces = g_key_file_get_string_list (key_file, group,
+                                                    "SupportedInterfaces",
+                                                    NULL, NULL);
+
+      /* Files in earlier data directories take precedence */
+      if (app->app_id == NULL || app->interfaces == NULL ||
+          g_hash_table_contains (seen_app_ids, app->app_id))
+        {
+          discovery_feed_app_free (app);
+          continue;
+        }
+
+      g_hash_table_add (seen_app_ids, app->app_id);
+      g_ptr_array_add (apps, app);
+    }
+}
+
+/* Returns an array of DiscoveryFeedApp for each app which installed a
+ * Discovery Feed content provider file pointing to bus_name */
+static GPtrArray *
+discovery_feed_apps_for_bus_name (const gchar *bus_name)
+{
+  GPtrArray *apps = g_ptr_array_new_with_free_func ((GDestroyNotify) discovery_feed_app_free);
+  g_autoptr(GHashTable) seen_app_ids = g_hash_table_new (g_str_hash, g_str_equal);
+  g_autofree gchar *user_flatpak_dir = g_build_filename (g_get_home_dir (),
+                                                         ".local/share/flatpak/exports/share",
+                                                         NULL);
+  const gchar * const *system_dirs = g_get_system_data_dirs ();
+  /* When running inside flatpak, the exported files of the host's
+   * installations are not part of the data directories */
+  const gchar * const flatpak_dirs[] = {
+    user_flatpak_dir,
+    "/var/lib/flatpak/exports/share",
+    "/var/endless-extra/flatpak/exports/share",
+    NULL
+  };
+
+  add_discovery_feed_apps_from_directory (g_get_user_data_dir (), bus_name,
+                                          apps, seen_app_ids);
+  for (const gchar * const *iter = system_dirs; *iter != NULL; ++iter)
+    add_discovery_feed_apps_from_directory (*iter, bus_name, apps, seen_app_ids);
+  for (const gchar * const *iter = flatpak_dirs; *iter != NULL; ++iter)
+    add_discovery_feed_apps_from_directory (*iter, bus_name, apps, seen_app_ids);
+
+  return apps;
+}
+
+static gboolean precompute_next_app (gpointer user_data);
+
+static gchar *
+precompute_day_key (GDateTime *day)
+{
+  return g_date_time_format (day, "%Y-%m-%d");
+}
+
+/* The day whose cards were last computed for every app is kept next to the
+ * snapshot, which is where those cards end up, so that the service doesn't
+ * compute them again each time it is activated */
+static gchar *
+precompute_stamp_path (EksSearchApp *self)
+{
+  g_autofree gchar *dir = NULL;
+
+  if (self->snapshot_file == NULL)
+    return NULL;
+
+  dir = g_path_get_dirname (self->snapshot_file);
+  return g_build_filename (dir, "precomputed-day", NULL);
+}
+
+static gboolean
+day_was_precomputed (EksSearchApp *self,
+                     GDateTime    *day)
+{
+  g_autofree gchar *path = precompute_stamp_path (self);
+  g_autofree gchar *contents = NULL;
+  g_autofree gchar *day_key = precompute_day_key (day);
+
+  if (path == NULL || !g_file_get_contents (path, &contents, NULL, NULL))
+    return FALSE;
+
+  return g_strcmp0 (g_strstrip (contents), day_key) == 0;
+}
+
+static void
+mark_day_precomputed (EksSearchApp *self,
+                      GDateTime    *day)
+{
+  g_autofree gchar *path = precompute_stamp_path (self);
+  g_autofree gchar *dir = NULL;
+  g_autofree gchar *day_key = precompute_day_key (day);
+  g_autoptr(GError) error = NULL;
+
+  if (path == NULL)
+    return;
+
+  dir = g_path_get_dirname (path);
+  if (g_mkdir_with_parents (dir, 0700) < 0 ||
+      !g_file_set_contents (path, day_key, -1, &error))
+    g_warning ("Could not record the precomputed day in %s: %s",
+               path, error != NULL ? error->message : g_strerror (errno));
+}
+
+static void
+on_app_precomputed (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  g_autoptr(EksSearchApp) self = user_data;
+  g_autoptr(GError) error = NULL;
+
+  if (!eks_discovery_feed_provider_precompute_finish (EKS_DISCOVERY_FEED_PROVIDER (source),
+                                                      result,
+                                                      &error))
+    {
+      if (g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+        return;
+
+      g_warning ("Error precomputing Discovery Feed cards: %s", error->message);
+    }
+
+  /* Spread the work over the whole window instead of starting
+   * the queries for all the apps at once */
+  self->precompute_step_id = g_timeout_add_full (G_PRIORITY_LOW,
+                                                 self->precompute_interval_ms,
+                                                 precompute_next_app,
+                                                 self,
+                                                 NULL);
+}
+
+static gboolean
+precompute_next_app (gpointer user_data)
+{
+  EksSearchApp *self = user_data;
+  SubtreeObjectInfo info;
+  DiscoveryFeedApp *app = NULL;
+  g_autofree gchar *subnode = NULL;
+  g_autoptr(GDateTime) date = NULL;
+  EksProvider *provider = NULL;
+
+  self->precompute_step_id = 0;
+
+  if (self->precompute_apps == NULL)
+    return G_SOURCE_REMOVE;
+
+  if (self->precompute_next_index >= self->precompute_apps->len)
+    {
+      mark_day_precomputed (self, self->precompute_run_day);
+      g_clear_pointer (&self->precompute_apps, g_ptr_array_unref);
+      g_clear_pointer (&self->precompute_run_day, g_date_time_unref);
+      return G_SOURCE_REMOVE;
+    }
+
+  app = g_ptr_array_index (self->precompute_apps, self->precompute_next_index++);
+  subnode = bus_label_escape (app->app_id);
+  subtree_object_info_for_interface (self, "com.endlessm.DiscoveryFeedContent", &info);
+  provider = lookup_or_create_provider (self, &info, subnode, 0);
+
+  eks_discovery_feed_provider_precompute (EKS_DISCOVERY_FEED_PROVIDER (provider),
+                                          (const gchar * const *) app->interfaces,
+                                          self->precompute_run_day,
+                                          self->precompute_cancellable,
+                                          on_app_precomputed,
+                                          g_object_ref (self));
+  return G_SOURCE_REMOVE;
+}
+
+static void
+cancel_discovery_feed_precompute (EksSearchApp *self)
+{
+  if (self->precompute_cancellable != NULL)
+    g_cancellable_cancel (self->precompute_cancellable);
+
+  g_clear_object (&self->precompute_cancellable);
+  g_clear_pointer (&self->precompute_apps, g_ptr_array_unref);
+  g_clear_pointer (&self->precompute_run_day, g_date_time_unref);
+
+  if (self->precompute_step_id != 0)
+    {
+      g_source_remove (self->precompute_step_id);
+      self->precompute_step_id = 0;
+    }
+}
+
+/* Computes the Discovery Feed cards of every app served by this service
+ * as they should be shown on day, spreading the apps over the time before
+ * midnight if spread is set, or one after the other at idle priority */
+static void
+start_discovery_feed_precompute (EksSearchApp *self,
+                                 GDateTime    *day,
+                                 gboolean      spread)
+{
+  const gchar *bus_name = g_application_get_application_id (G_APPLICATION (self));
+
+  cancel_discovery_feed_precompute (self);
+
+  self->precompute_run_day = g_date_time_ref (day);
+  self->precompute_apps = discovery_feed_apps_for_bus_name (bus_name);
+  self->precompute_next_index = 0;
+  self->precompute_cancellable = g_cancellable_new ();
+
+  if (self->precompute_apps->len == 0)
+    {
+      g_clear_pointer (&self->precompute_apps, g_ptr_array_unref);
+      g_clear_pointer (&self->precompute_run_day, g_date_time_unref);
+      return;
+    }
+
+  if (spread)
+    self->precompute_interval_ms = CLAMP (PRECOMPUTE_LEAD_SECONDS * 1000 / self->precompute_apps->len,
+                                          PRECOMPUTE_MIN_INTERVAL_MS,
+                                          PRECOMPUTE_MAX_INTERVAL_MS);
+  else
+    self->precompute_interval_ms = PRECOMPUTE_MIN_INTERVAL_MS;
+  self->precompute_step_id = g_idle_add_full (G_PRIORITY_LOW,
+                                              precompute_next_app,
+                                              self,
+                                              NULL);
+}
+
+static void schedule_discovery_feed_precompute (EksSearchApp *self,
+                                                GDateTime    *day);
+
+static gboolean
+on_precompute_timeout (gpointer user_data)
+{
+  EksSearchApp *self = user_data;
+  g_autoptr(GDateTime) day = g_steal_pointer (&self->precompute_next_day);
+  g_autoptr(GDateTime) next_day = g_date_time_add_days (day, 1);
+
+  self->precompute_timeout_id = 0;
+
+  /* If we woke up late, after midnight, this still computes the cards for
+   * the right day, they just won't be ready before the first request */
+  start_discovery_feed_precompute (self, day, TRUE);
+  schedule_discovery_feed_precompute (self, next_day);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Schedules computing the Discovery Feed cards for day, which is the local
+ * midnight at the start of that day, shortly before it starts */
+static void
+schedule_discovery_feed_precompute (EksSearchApp *self,
+                                    GDateTime    *day)
+{
+  g_autoptr(GDateTime) now = g_date_time_new_now_local ();
+  g_autoptr(GDateTime) start = g_date_time_add_seconds (day, -PRECOMPUTE_LEAD_SECONDS);
+  GTimeSpan delay = g_date_time_difference (start, now);
+
+  if (self->precompute_timeout_id != 0)
+    g_source_remove (self->precompute_timeout_id);
+
+  g_clear_pointer (&self->precompute_next_day, g_date_time_unref);
+  self->precompute_next_day = g_date_time_ref (day);
+
+  self->precompute_timeout_id = g_timeout_add_seconds (MAX (delay, 0) / G_TIME_SPAN_SECOND,
+                                                       on_precompute_timeout,
+                                                       self);
+}
+
+/* Runs on the GDBus worker thread for every message going through the
+ * connection, so it only looks at the messages and leaves them alone */
+static GDBusMessage *
+filter_metrics_messages (GDBusConnection *connection,
+                         GDBusMessage    *message,
+                         gboolean         incoming,
+                         gpointer         user_data)
+{
+  EksSearchApp *self = user_data;
+  EksMetrics *metrics = eks_metrics_get_default ();
+  GDBusMessageType type = g_dbus_message_get_message_type (message);
+
+  if (incoming && type == G_DBUS_MESSAGE_TYPE_METHOD_CALL)
+    {
+      const gchar *path = g_dbus_message_get_path (message);
+      gsize prefix_len = strlen (self->metrics_object_path);
+      g_autofree gchar *app_id = NULL;
+
+      if ((g_dbus_message_get_flags (message) & G_DBUS_MESSAGE_FLAGS_NO_REPLY_EXPECTED) ||
+          path == NULL ||
+          !g_str_has_prefix (path, self->metrics_object_path))
+        return message;
+
+      if (path[prefix_len] == '/')
+        app_id = bus_label_unescape (path + prefix_len + 1);
+      else if (path[prefix_len] != '\0')
+        return message;
+
+      eks_metrics_call_started (metrics,
+                                g_dbus_message_get_sender (message),
+                                g_dbus_message_get_serial (message),
+                                g_dbus_message_get_interface (message),
+                                app_id);
+    }
+  else if (!incoming && (type == G_DBUS_MESSAGE_TYPE_METHOD_RETURN ||
+                         type == G_DBUS_MESSAGE_TYPE_ERROR))
+    {
+      eks_metrics_call_finished (metrics,
+                                 g_dbus_message_get_destination (message),
+                                 g_dbus_message_get_reply_serial (message),
+                                 type == G_DBUS_MESSAGE_TYPE_ERROR ?
+                                 g_dbus_message_get_error_name (message) :
+                                 NULL);
+    }
+
+  return message;
+}
+
+static gboolean
+dump_metrics (gpointer user_data)
+{
+  EksSearchApp *self = user_data;
+  g_autoptr(GError) error = NULL;
+  g_autofree gchar *report = eks_metrics_to_text (eks_metrics_get_default ());
+
+  if (!g_file_set_contents (self->metrics_dump_file, report, -1, &error))
+    g_warning ("Could not write metrics to %s: %s",
+               self->metrics_dump_file, error->message);
+
+  return G_SOURCE_CONTINUE;
+}
+
+static gboolean
+eks_search_app_register (GApplication    *application,
+                         GDBusConnection *connection,
+                         const gchar     *object_path,
+                         GError          **error)
+{
+  EksSearchApp *self = EKS_SEARCH_APP (application);
+  g_autoptr(GDateTime) now = g_date_time_new_now_local ();
+  g_autoptr(GDateTime) today = g_date_time_new_local (g_date_time_get_year (now),
+                                                      g_date_time_get_month (now),
+                                                      g_date_time_get_day_of_month (now),
+                                                      0, 0, 0);
+  g_autoptr(GDateTime) tomorrow = g_date_time_add_days (today, 1);
+
+  eks_subtree_dispatcher_register (self->dispatcher, connection, object_path, error);
+  schedule_discovery_feed_precompute (self, tomorrow);
+
+  /* The service is rarely running before midnight, so it works towards
+   * tomorrow's cards whenever it is activated, at idle priority and without
+   * staying around any longer for it; they are kept until tomorrow in the
+   * snapshot, which also records the day once every app is done. Today's
+   * cards are cached as each app asks for them. */
+  if ((self->snapshot_file != NULL || self->resident) &&
+      !day_was_precomputed (self, tomorrow))
+    start_discovery_feed_precompute (self, tomorrow, FALSE);
+
+  g_set_object (&self->metrics_connection, connection);
+  g_free (self->metrics_object_path);
+  self->metrics_object_path = g_strdup (object_path);
+  self->metrics_filter_id = g_dbus_connection_add_filter (connection,
+                                                          filter_metrics_messages,
+                                                          self,
+                                                          NULL);
+
+  if (self->metrics_dump_file != NULL && self->metrics_dump_id == 0)
+    self->metrics_dump_id = g_timeout_add_seconds (METRICS_DUMP_INTERVAL_SECONDS,
+                                                   dump_metrics,
+                                                   self);
+
+  /* The inactivity timeout then only decides when to trim */
+  if (self->resident)
+    g_application_hold (application);
+
+  return TRUE;
+}
+
+static void
+eks_search_app_unregister (GApplication    *application,
+                           GDBusConnection *connection,
+                           const gchar     *object_path)
+{
+  EksSearchApp *self = EKS_SEARCH_APP (application);
+
+  cancel_discovery_feed_precompute (self);
+  if (self->precompute_timeout_id != 0)
+    {
+      g_source_remove (self->precompute_timeout_id);
+      self->precompute_timeout_id = 0;
+    }
+
+  eks_subtree_dispatcher_unregister (self->dispatcher);
+
+  if (self->metrics_filter_id != 0)
+    {
+      g_dbus_connection_remove_filter (self->metrics_connection,
+                                       self->metrics_filter_id);
+      self->metrics_filter_id = 0;
+    }
+  g_clear_object (&self->metrics_connection);
+
+  if (self->metrics_dump_id != 0)
+    {
+      g_source_remove (self->metrics_dump_id);
+      self->metrics_dump_id = 0;
+    }
+}
+
+/* Only providers still around when the service exits normally, or dropped
+ * before that, make it into the snapshot */
+static void
+eks_search_app_shutdown (GApplication *application)
+{
+  EksSearchApp *self = EKS_SEARCH_APP (application);
+  g_autoptr(GError) error = NULL;
+  GHashTable *caches[] = {
+    self->app_search_providers,
+    self->discovery_feed_content_providers,
+    self->metadata_providers,
+  };
+
+  for (gsize i = 0; i < G_N_ELEMENTS (caches); ++i)
+    {
+      GHashTableIter iter;
+      gpointer key, value;
+
+      g_hash_table_iter_init (&iter, caches[i]);
+      while (g_hash_table_iter_next (&iter, &key, &value))
+        snapshot_provider_state (self, key, ((ProviderEntry *) value)->provider);
+    }
+
+  if (self->snapshot != NULL)
+    {
+      if (!eks_snapshot_write (self->snapshot, &error))
+        g_warning ("Could not write snapshot to %s: %s",
+                   self->snapshot_file, error->message);
+    }
+
+  G_APPLICATION_CLASS (eks_search_app_parent_class)->shutdown (application);
 }
 
 static GPtrArray *
@@ -212,7 +1249,19 @@ eks_search_app_node_interface_infos ()
   g_ptr_array_add (ptr_array, eks_discovery_feed_news_interface_info ());
   g_ptr_array_add (ptr_array, eks_discovery_feed_video_interface_info ());
   g_ptr_array_add (ptr_array, eks_discovery_feed_artwork_interface_info ());
+  g_ptr_array_add (ptr_array, eks_discovery_feed_cards_interface_info ());
   g_ptr_array_add (ptr_array, eks_content_metadata_interface_info ());
+  g_ptr_array_add (ptr_array, eks_content_metadata2_interface_info ());
+  return ptr_array;
+}
+
+static GPtrArray *
+eks_search_app_root_interface_infos ()
+{
+  GPtrArray *ptr_array = g_ptr_array_new_with_free_func ((GDestroyNotify) g_dbus_interface_info_unref);
+  g_ptr_array_add (ptr_array, eks_federated_search_interface_info ());
+  g_ptr_array_add (ptr_array, eks_discovery_feed_batch_interface_info ());
+  g_ptr_array_add (ptr_array, eks_ekn_services_metrics_interface_info ());
   return ptr_array;
 }
 
@@ -220,13 +1269,18 @@ static void
 eks_search_app_init (EksSearchApp *self)
 {
   g_autoptr(GPtrArray) interface_infos = eks_search_app_node_interface_infos ();
+  g_autoptr(GPtrArray) root_interface_infos = eks_search_app_root_interface_infos ();
 
   self->dispatcher = g_object_new (EKS_TYPE_SUBTREE_DISPATCHER,
                                    "interface-infos", interface_infos,
+                                   "root-interface-infos", root_interface_infos,
                                    NULL);
-  self->app_search_providers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
-  self->discovery_feed_content_providers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
-  self->metadata_providers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+  self->app_search_providers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                      (GDestroyNotify) provider_entry_free);
+  self->discovery_feed_content_providers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                                  (GDestroyNotify) provider_entry_free);
+  self->metadata_providers = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                                    (GDestroyNotify) provider_entry_free);
   g_signal_connect (self->dispatcher, "dispatch-subtree",
                     G_CALLBACK (dispatch_subtree), self);
 }
@@ -1,15 +1,28 @@
 #include <gio/gio.h>
 
 #include "eks-search-app.h"
+#include "eks-trace.h"
 
 gint
 main (gint   argc,
       gchar *argv[])
 {
+    eks_trace_init ();
+
+    g_autofree gchar *snapshot_file = g_build_filename (g_get_user_cache_dir (),
+                                                        "com.endlessm.EknServices4.SearchProviderV4",
+                                                        "snapshot.gvariant",
+                                                        NULL);
+
     g_autoptr(GApplication) app = g_object_new (EKS_TYPE_SEARCH_APP,
                                                 "application-id", "com.endlessm.EknServices4.SearchProviderV4",
                                                 "flags", G_APPLICATION_IS_SERVICE,
                                                 "inactivity-timeout", 12000,
+                                                "provider-idle-timeout", 300,
+                                                "max-providers", 30,
+                                                "metrics-dump-file", g_getenv ("EKS_METRICS_DUMP_FILE"),
+                                                "snapshot-file", snapshot_file,
+                                                "resident", g_getenv ("EKS_RESIDENT") != NULL,
                                                 NULL);
     return g_application_run (app, argc, argv);
 }
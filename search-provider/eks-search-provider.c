@@ -3,15 +3,36 @@
 #include "eks-search-provider.h"
 
 #include "eks-knowledge-app-dbus.h"
+#include "eks-lru-cache.h"
+#include "eks-metrics.h"
 #include "eks-provider-iface.h"
+#include "eks-query-util.h"
 #include "eks-search-provider-dbus.h"
+#include "eks-trace.h"
 
 #include <string.h>
 
 #include <dmodel.h>
 
 #define RESULTS_LIMIT 5
+/* How many results to keep from a full search, so that the shell's following
+ * subsearches can be answered by narrowing them down. Every one of them is
+ * loaded as a model, so this stays a small multiple of what is shown. */
+#define CANDIDATES_LIMIT 15
+/* Bounds for the time during which searches are merged into one */
+#define MIN_COALESCING_WINDOW_USEC (2 * G_TIME_SPAN_MILLISECOND)
+#define MAX_COALESCING_WINDOW_USEC (50 * G_TIME_SPAN_MILLISECOND)
 #define MAX_DESCRIPTION_LENGTH 200
+/* Enough for the results of many searches in a row; each entry is at most a
+ * few hundred bytes */
+#define RESULT_META_CACHE_MAX_ENTRIES 500
+#define RESULT_META_CACHE_MAX_BYTES (256 * 1024)
+/* People tend to search for the same few things again and again */
+#define SEARCH_CACHE_MAX_ENTRIES 100
+#define SEARCH_CACHE_MAX_BYTES (256 * 1024)
+#define SEARCH_CACHE_TTL (5 * G_TIME_SPAN_MINUTE)
+
+typedef struct _SearchState SearchState;
 
 /**
  * EksSearchProvider:
@@ -30,9 +51,27 @@ struct _EksSearchProvider
   gchar *application_id;
   EksSearchProvider2 *skeleton;
   EksKnowledgeSearch *app_proxy;
+  // Array of PendingActivation while app_proxy is being created
+  GPtrArray *pending_activations;
   GCancellable *cancellable;
-  // Hash table with ID string keys, DmContent values
-  GHashTable *object_cache;
+  // LRU cache with ID string keys, ResultMeta values
+  EksLruCache *result_meta_cache;
+  // Array of ID strings matching candidate_terms, best first
+  GPtrArray *candidates;
+  // Case-folded terms that candidates were found for
+  GStrv candidate_terms;
+  // Whether candidates holds every match for candidate_terms
+  gboolean candidates_complete;
+  // LRU cache with normalized terms keys, CachedSearch values
+  EksLruCache *search_cache;
+  // SearchState waiting for the coalescing window to end, or NULL
+  SearchState *pending_search;
+  guint pending_search_id;
+  // SearchState running in the engine, or NULL
+  SearchState *running_search;
+  gint64 last_search_start_time;
+  // Moving average of the time searches take, in microseconds
+  gint64 search_latency;
 };
 
 static void eks_search_provider_interface_init (EksProviderInterface *);
@@ -98,8 +137,14 @@ eks_search_provider_finalize (GObject *object)
   g_clear_pointer (&self->application_id, g_free);
   g_clear_object (&self->skeleton);
   g_clear_object (&self->app_proxy);
+  g_clear_pointer (&self->pending_activations, g_ptr_array_unref);
   g_clear_object (&self->cancellable);
-  g_clear_pointer (&self->object_cache, g_hash_table_unref);
+  eks_metrics_remove_cache (eks_metrics_get_default (), self->result_meta_cache);
+  g_clear_pointer (&self->result_meta_cache, eks_lru_cache_free);
+  g_clear_pointer (&self->candidates, g_ptr_array_unref);
+  g_clear_pointer (&self->candidate_terms, g_strfreev);
+  eks_metrics_remove_cache (eks_metrics_get_default (), self->search_cache);
+  g_clear_pointer (&self->search_cache, eks_lru_cache_free);
 
   G_OBJECT_CLASS (eks_search_provider_parent_class)->finalize (object);
 }
@@ -130,43 +175,486 @@ object_path_from_app_id (const gchar *application_id)
   return g_strconcat ("/", replaced, NULL);
 }
 
-static gboolean
-ensure_app_proxy (EksSearchProvider *self)
+/* A call to the knowledge app which is waiting for its proxy */
+typedef struct
+{
+  gchar *id;  // NULL for LoadQuery
+  gchar *query;
+  guint32 timestamp;
+} PendingActivation;
+
+static void
+pending_activation_free (PendingActivation *activation)
+{
+  g_free (activation->id);
+  g_free (activation->query);
+
+  g_free (activation);
+}
+
+static void
+on_load_item_finished (GObject      *source,
+                       GAsyncResult *result,
+                       gpointer      user_data)
+{
+  g_autoptr(EksSearchProvider) self = user_data;
+  g_autoptr(GError) error = NULL;
+
+  g_application_release (g_application_get_default ());
+
+  if (!eks_knowledge_search_call_load_item_finish (EKS_KNOWLEDGE_SEARCH (source),
+                                                   result, &error))
+    g_warning ("Error activating result in %s: %s",
+               self->application_id, error->message);
+}
+
+static void
+on_load_query_finished (GObject      *source,
+                        GAsyncResult *result,
+                        gpointer      user_data)
+{
+  g_autoptr(EksSearchProvider) self = user_data;
+  g_autoptr(GError) error = NULL;
+
+  g_application_release (g_application_get_default ());
+
+  if (!eks_knowledge_search_call_load_query_finish (EKS_KNOWLEDGE_SEARCH (source),
+                                                    result, &error))
+    g_warning ("Error launching search in %s: %s",
+               self->application_id, error->message);
+}
+
+/* Activating an app can take a while if it has to be started, so none of
+ * this blocks the main loop; errors are only logged since the shell has
+ * already been replied to */
+static void
+send_activation (EksSearchProvider *self,
+                 PendingActivation *activation)
+{
+  /* Keep the service around until the app has received the call */
+  g_application_hold (g_application_get_default ());
+
+  if (activation->id != NULL)
+    eks_knowledge_search_call_load_item (self->app_proxy,
+                                         activation->id,
+                                         activation->query,
+                                         activation->timestamp,
+                                         NULL,
+                                         on_load_item_finished,
+                                         g_object_ref (self));
+  else
+    eks_knowledge_search_call_load_query (self->app_proxy,
+                                          activation->query,
+                                          activation->timestamp,
+                                          NULL,
+                                          on_load_query_finished,
+                                          g_object_ref (self));
+}
+
+static void
+on_app_proxy_ready (GObject      *source,
+                    GAsyncResult *result,
+                    gpointer      user_data)
+{
+  g_autoptr(EksSearchProvider) self = user_data;
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GPtrArray) pending = g_steal_pointer (&self->pending_activations);
+
+  g_application_release (g_application_get_default ());
+
+  self->app_proxy = eks_knowledge_search_proxy_new_for_bus_finish (result, &error);
+  if (self->app_proxy == NULL)
+    {
+      g_warning ("Error initializing dbus proxy for %s: %s",
+                 self->application_id, error->message);
+      return;
+    }
+
+  for (guint i = 0; i < pending->len; ++i)
+    send_activation (self, g_ptr_array_index (pending, i));
+}
+
+/* Takes ownership of activation */
+static void
+activate_app (EksSearchProvider *self,
+              PendingActivation *activation)
 {
   if (self->app_proxy != NULL)
-    return TRUE;
+    {
+      send_activation (self, activation);
+      pending_activation_free (activation);
+      return;
+    }
+
+  /* The proxy is being created already, the call will be sent along with
+   * the others once it's ready */
+  if (self->pending_activations != NULL)
+    {
+      g_ptr_array_add (self->pending_activations, activation);
+      return;
+    }
+
+  self->pending_activations =
+    g_ptr_array_new_with_free_func ((GDestroyNotify) pending_activation_free);
+  g_ptr_array_add (self->pending_activations, activation);
 
   g_autofree gchar *object_path = object_path_from_app_id (self->application_id);
-  GError *error = NULL;
-  self->app_proxy = eks_knowledge_search_proxy_new_for_bus_sync (G_BUS_TYPE_SESSION,
-                                                                 G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START_AT_CONSTRUCTION |
-                                                                   G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
-                                                                 self->application_id,
-                                                                 object_path,
-                                                                 NULL,
-                                                                 &error);
-  if (error != NULL)
+
+  g_application_hold (g_application_get_default ());
+  eks_knowledge_search_proxy_new_for_bus (G_BUS_TYPE_SESSION,
+                                          G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START_AT_CONSTRUCTION |
+                                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                                          self->application_id,
+                                          object_path,
+                                          NULL,
+                                          on_app_proxy_ready,
+                                          g_object_ref (self));
+}
+
+/* What GetResultMetas needs to know about a search result, kept in a single
+ * allocation. The ID is not stored, it is the key of the cache entry. */
+typedef struct
+{
+  const gchar *name;
+  const gchar *description;  // NULL if the result has no synopsis
+  gchar data[];
+} ResultMeta;
+
+static ResultMeta *
+result_meta_new (const gchar *visible_title,
+                 const gchar *synopsis,
+                 gsize       *size)
+{
+  gsize name_length = strlen (visible_title);
+  gsize description_length = 0;
+  if (synopsis)
     {
-      g_warning ("Error initializing dbus proxy: %s", error->message);
-      g_clear_error (&error);
-      return FALSE;
+      /* The limit is in characters, not bytes */
+      if (g_utf8_strlen (synopsis, -1) > MAX_DESCRIPTION_LENGTH)
+        description_length = g_utf8_offset_to_pointer (synopsis, MAX_DESCRIPTION_LENGTH) - synopsis;
+      else
+        description_length = strlen (synopsis);
     }
-  return TRUE;
+
+  *size = sizeof (ResultMeta) + name_length + 1 + (synopsis ? description_length + 1 : 0);
+  ResultMeta *meta = g_malloc (*size);
+  gchar *name = meta->data;
+  memcpy (name, visible_title, name_length);
+  name[name_length] = '\0';
+  meta->name = name;
+  meta->description = NULL;
+  if (synopsis)
+    {
+      gchar *description = name + name_length + 1;
+      memcpy (description, synopsis, description_length);
+      description[description_length] = '\0';
+      meta->description = description;
+    }
+
+  return meta;
+}
+
+static ResultMeta *
+result_meta_new_for_model (DmContent *model,
+                           gsize     *size)
+{
+  g_autofree gchar *original_title = NULL;
+  g_autofree gchar *title = NULL;
+  g_autofree gchar *synopsis = NULL;
+  g_object_get (model,
+                "original-title", &original_title,
+                "title", &title,
+                "synopsis", &synopsis,
+                NULL);
+
+  const gchar *visible_title = (original_title && *original_title) ? original_title : title;
+  if (visible_title == NULL)
+    visible_title = "";
+
+  return result_meta_new (visible_title, synopsis, size);
+}
+
+static gsize
+result_meta_get_size (ResultMeta *meta)
+{
+  return sizeof (ResultMeta) + strlen (meta->name) + 1 +
+    (meta->description ? strlen (meta->description) + 1 : 0);
+}
+
+static ResultMeta *
+result_meta_copy (ResultMeta *meta)
+{
+  gsize size = result_meta_get_size (meta);
+  ResultMeta *copy = g_malloc (size);
+  memcpy (copy, meta, size);
+
+  copy->name = copy->data + (meta->name - meta->data);
+  if (meta->description)
+    copy->description = copy->data + (meta->description - meta->data);
+
+  return copy;
 }
 
+/* The results of a search, kept for answering it again later */
 typedef struct
+{
+  // Array of ID strings, shared with the candidates of the provider
+  GPtrArray *ids;
+  GStrv folded_terms;
+  gboolean complete;
+  // Array of ResultMeta for the ids that are returned to the shell
+  GPtrArray *metas;
+  gchar *shards_fingerprint;
+  gint64 expiry_time;
+} CachedSearch;
+
+static void
+cached_search_free (CachedSearch *cached)
+{
+  g_ptr_array_unref (cached->ids);
+  g_strfreev (cached->folded_terms);
+  g_ptr_array_unref (cached->metas);
+  g_free (cached->shards_fingerprint);
+
+  g_slice_free (CachedSearch, cached);
+}
+
+static gsize
+cached_search_get_size (CachedSearch *cached)
+{
+  gsize size = sizeof (CachedSearch) + strlen (cached->shards_fingerprint) + 1;
+
+  for (guint i = 0; i < cached->ids->len; i++)
+    size += sizeof (gpointer) + strlen (g_ptr_array_index (cached->ids, i)) + 1;
+  for (guint i = 0; cached->folded_terms[i] != NULL; i++)
+    size += sizeof (gpointer) + strlen (cached->folded_terms[i]) + 1;
+  for (guint i = 0; i < cached->metas->len; i++)
+    size += sizeof (gpointer) + result_meta_get_size (g_ptr_array_index (cached->metas, i));
+
+  return size;
+}
+
+static GStrv
+fold_terms (gchar **terms)
+{
+  guint n_terms = g_strv_length (terms);
+  GStrv folded = g_new0 (gchar *, n_terms + 1);
+
+  for (guint i = 0; i < n_terms; i++)
+    folded[i] = g_utf8_casefold (terms[i], -1);
+
+  return folded;
+}
+
+/* Terms that only differ in case or spacing are the same search */
+static gchar *
+search_cache_key_for_terms (GStrv folded_terms)
+{
+  GString *key = g_string_new (NULL);
+
+  for (guint i = 0; folded_terms[i] != NULL; i++)
+    {
+      g_auto(GStrv) words = g_strsplit_set (folded_terms[i], " \t\n\r", -1);
+      for (guint j = 0; words[j] != NULL; j++)
+        {
+          if (*words[j] == '\0')
+            continue;
+          if (key->len > 0)
+            g_string_append_c (key, ' ');
+          g_string_append (key, words[j]);
+        }
+    }
+
+  return g_string_free (key, FALSE);
+}
+
+/* Whether new_terms can only match a subset of what old_terms matched; that
+ * is, the user kept typing. The engine requires every term to match and
+ * treats the last one as a prefix, so extending any term or adding more terms
+ * narrows the results down. */
+static gboolean
+terms_refine (GStrv old_terms,
+              GStrv new_terms)
+{
+  guint n_old_terms = g_strv_length (old_terms);
+
+  if (n_old_terms == 0 || g_strv_length (new_terms) < n_old_terms)
+    return FALSE;
+
+  for (guint i = 0; i < n_old_terms; i++)
+    {
+      if (!g_str_has_prefix (new_terms[i], old_terms[i]))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Splits case-folded text into its words, which are the runs of letters and
+ * digits in it */
+static GStrv
+split_folded_words (const gchar *folded_text)
+{
+  GPtrArray *words = g_ptr_array_new ();
+  const gchar *word_start = NULL;
+
+  for (const gchar *p = folded_text; ; p = g_utf8_next_char (p))
+    {
+      gboolean in_word = *p != '\0' && g_unichar_isalnum (g_utf8_get_char (p));
+
+      if (in_word && word_start == NULL)
+        word_start = p;
+      else if (!in_word && word_start != NULL)
+        {
+          g_ptr_array_add (words, g_strndup (word_start, p - word_start));
+          word_start = NULL;
+        }
+
+      if (*p == '\0')
+        break;
+    }
+
+  g_ptr_array_add (words, NULL);
+  return (GStrv) g_ptr_array_free (words, FALSE);
+}
+
+/* Matches the way the engine does: every term must be a word of the text,
+ * except for the last one, which the user may still be typing and only has
+ * to start a word */
+static gboolean
+text_matches_terms (const gchar *text,
+                    GStrv        term_words)
+{
+  if (text == NULL)
+    return FALSE;
+
+  g_autofree gchar *folded_text = g_utf8_casefold (text, -1);
+  g_auto(GStrv) words = split_folded_words (folded_text);
+  guint n_terms = g_strv_length (term_words);
+
+  for (guint i = 0; i < n_terms; i++)
+    {
+      gboolean is_last = i == n_terms - 1;
+      gboolean found = FALSE;
+
+      for (guint j = 0; words[j] != NULL && !found; j++)
+        found = is_last ? g_str_has_prefix (words[j], term_words[i]) :
+                          strcmp (words[j], term_words[i]) == 0;
+
+      if (!found)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/* Tries to answer a subsearch from the titles and synopses of the previous
+ * candidates alone, ranking title matches first. The candidates must hold
+ * every match of the previous search, or better matches for the new terms
+ * could be missing from them. This only succeeds when it finds enough
+ * matches to fill the results, since candidates that match in their body
+ * text can't be told apart from ones that don't match at all.
+ *
+ * Returns: (nullable): a floating "(as)" with the results, or %NULL */
+static GVariant *
+refine_candidates_locally (EksSearchProvider *self,
+                           GStrv              folded_terms)
+{
+  g_autoptr(GPtrArray) title_matches = g_ptr_array_new ();
+  g_autoptr(GPtrArray) description_matches = g_ptr_array_new ();
+  g_autofree gchar *joined_terms = NULL;
+  g_auto(GStrv) term_words = NULL;
+
+  if (!self->candidates_complete)
+    return NULL;
+
+  joined_terms = g_strjoinv (" ", folded_terms);
+  term_words = split_folded_words (joined_terms);
+  if (term_words[0] == NULL)
+    return NULL;
+
+  for (guint i = 0; i < self->candidates->len; i++)
+    {
+      const gchar *id = g_ptr_array_index (self->candidates, i);
+      ResultMeta *meta = eks_lru_cache_lookup (self->result_meta_cache, id);
+      if (meta == NULL)
+        continue;
+
+      if (text_matches_terms (meta->name, term_words))
+        g_ptr_array_add (title_matches, (gpointer) id);
+      else if (text_matches_terms (meta->description, term_words))
+        g_ptr_array_add (description_matches, (gpointer) id);
+
+      if (title_matches->len >= RESULTS_LIMIT)
+        break;
+    }
+
+  if (title_matches->len + description_matches->len < RESULTS_LIMIT)
+    return NULL;
+
+  GVariantBuilder builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+  for (guint i = 0; i < title_matches->len; i++)
+    g_variant_builder_add (&builder, "s", g_ptr_array_index (title_matches, i));
+  for (guint i = 0; i < description_matches->len && i + title_matches->len < RESULTS_LIMIT; i++)
+    g_variant_builder_add (&builder, "s", g_ptr_array_index (description_matches, i));
+  return g_variant_new ("(as)", &builder);
+}
+
+/* One search in the engine, on behalf of all the calls from the shell that
+ * were merged into it */
+struct _SearchState
 {
   EksSearchProvider *self;
-  GDBusMethodInvocation *invocation;
-} SearchState;
+  // Array of GDBusMethodInvocation to answer with the results
+  GPtrArray *invocations;
+  gchar *search_terms;
+  GStrv folded_terms;
+  gchar *cache_key;
+  gboolean subsearch;
+  // Whether the search was restricted to the previous candidates
+  gboolean refining;
+  gint64 start_time;
+  guint trace_id;
+};
+
+static SearchState *
+search_state_new (EksSearchProvider *self)
+{
+  SearchState *state = g_slice_new0 (SearchState);
+  state->self = g_object_ref (self);
+  state->invocations = g_ptr_array_new_with_free_func (g_object_unref);
+  state->trace_id = eks_trace_request_begin (self->application_id,
+                                             "org.gnome.Shell.SearchProvider2");
+  return state;
+}
 
 static void
 search_state_free (SearchState *state)
 {
-  g_object_unref (state->invocation);
+  g_object_unref (state->self);
+  g_ptr_array_unref (state->invocations);
+  g_free (state->search_terms);
+  g_strfreev (state->folded_terms);
+  g_free (state->cache_key);
+  eks_trace_request_end (state->trace_id);
   g_slice_free (SearchState, state);
 }
 
+/* Answers every invocation in the array and empties it; consumes results if
+ * it is floating */
+static void
+return_search_results (GPtrArray *invocations,
+                       GVariant  *results)
+{
+  g_autoptr(GVariant) owned_results = g_variant_ref_sink (results);
+
+  for (guint i = 0; i < invocations->len; i++)
+    g_dbus_method_invocation_return_value (g_ptr_array_index (invocations, i),
+                                           owned_results);
+  g_ptr_array_set_size (invocations, 0);
+}
+
 static void
 search_finished (GObject *source,
                  GAsyncResult *result,
@@ -174,19 +662,40 @@ search_finished (GObject *source,
 {
   DmEngine *engine = DM_ENGINE (source);
   SearchState *state = user_data;
+  EksSearchProvider *self = state->self;
 
   g_application_release (g_application_get_default ());
 
-  GError *error = NULL;
+  if (self->running_search == state)
+    self->running_search = NULL;
+
+  g_autoptr(GError) error = NULL;
   g_autoptr(DmQueryResults) results = NULL;
   if (!(results = dm_engine_query_finish (engine, result, &error)))
     {
-      g_dbus_method_invocation_return_gerror (state->invocation, error);
+      /* A cancelled search has handed its invocations over to the search
+       * that replaced it, so this only reaches the shell for real errors */
+      for (guint i = 0; i < state->invocations->len; i++)
+        g_dbus_method_invocation_return_gerror (g_ptr_array_index (state->invocations, i),
+                                                error);
       search_state_free (state);
       return;
     }
 
+  gint64 latency = g_get_monotonic_time () - state->start_time;
+  eks_trace_span (state->trace_id, "engine-query", state->start_time);
+  eks_metrics_record_phase (eks_metrics_get_default (),
+                            "org.gnome.Shell.SearchProvider2",
+                            EKS_METRICS_PHASE_ENGINE,
+                            latency);
+  if (self->search_latency == 0)
+    self->search_latency = latency;
+  else
+    self->search_latency = (3 * self->search_latency + latency) / 4;
+
   GSList *models = dm_query_results_get_models (results);
+  g_autoptr(GPtrArray) candidates = g_ptr_array_new_with_free_func (g_free);
+  g_autoptr(GPtrArray) metas = g_ptr_array_new_with_free_func (g_free);
 
   GVariantBuilder builder;
   g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
@@ -195,29 +704,79 @@ search_finished (GObject *source,
       DmContent *model = l->data;
       g_autofree char *id = NULL;
       g_object_get (model, "id", &id, NULL);
-      g_hash_table_insert (state->self->object_cache, g_strdup (id),
-                           g_object_ref (model));
-      g_variant_builder_add (&builder, "s", id);
+      gsize size;
+      ResultMeta *meta = result_meta_new_for_model (model, &size);
+      if (candidates->len < RESULTS_LIMIT)
+        {
+          g_variant_builder_add (&builder, "s", id);
+          g_ptr_array_add (metas, result_meta_copy (meta));
+        }
+      eks_lru_cache_insert (self->result_meta_cache, id, meta, size);
+      g_ptr_array_add (candidates, g_steal_pointer (&id));
+    }
+
+  /* A search restricted to a complete set of candidates finds every match */
+  self->candidates_complete = state->refining || candidates->len < CANDIDATES_LIMIT;
+  g_clear_pointer (&self->candidates, g_ptr_array_unref);
+  self->candidates = g_steal_pointer (&candidates);
+  g_clear_pointer (&self->candidate_terms, g_strfreev);
+  self->candidate_terms = g_steal_pointer (&state->folded_terms);
+
+  g_autoptr(GError) fingerprint_error = NULL;
+  g_autofree gchar *fingerprint = shards_fingerprint_for_app (engine, self->application_id,
+                                                              &fingerprint_error);
+  if (fingerprint != NULL)
+    {
+      CachedSearch *cached = g_slice_new0 (CachedSearch);
+      cached->ids = g_ptr_array_ref (self->candidates);
+      cached->folded_terms = g_strdupv (self->candidate_terms);
+      cached->complete = self->candidates_complete;
+      cached->metas = g_steal_pointer (&metas);
+      cached->shards_fingerprint = g_steal_pointer (&fingerprint);
+      cached->expiry_time = g_get_monotonic_time () + SEARCH_CACHE_TTL;
+      eks_lru_cache_insert (self->search_cache, state->cache_key, cached,
+                            cached_search_get_size (cached));
     }
-  g_dbus_method_invocation_return_value (state->invocation, g_variant_new ("(as)", &builder));
+  else
+    {
+      g_warning ("Not caching search for %s: %s", self->application_id,
+                 fingerprint_error->message);
+    }
+
+  return_search_results (state->invocations, g_variant_new ("(as)", &builder));
   search_state_free (state);
 }
 
 static void
-do_search (EksSearchProvider *self,
-           GDBusMethodInvocation *invocation,
-           gchar **terms)
+start_search (EksSearchProvider *self,
+              SearchState       *state)
 {
-  if (self->cancellable != NULL)
+  /* The shell has moved on from the search that is still running, so its
+   * calls get the newer results instead */
+  if (self->running_search != NULL)
     {
+      GPtrArray *superseded = self->running_search->invocations;
+      for (guint i = 0; i < superseded->len; i++)
+        g_ptr_array_add (state->invocations, g_object_ref (g_ptr_array_index (superseded, i)));
+      g_ptr_array_set_size (superseded, 0);
+
       g_cancellable_cancel (self->cancellable);
       g_clear_object (&self->cancellable);
+      self->running_search = NULL;
     }
 
-  g_autofree char *search_terms = g_strjoinv (" ", terms);
-  if (*search_terms == '\0')
+  state->refining = state->subsearch && self->candidates != NULL &&
+                    terms_refine (self->candidate_terms, state->folded_terms);
+
+  /* If the previous search found all of its matches, only those need to be
+   * checked against the new terms */
+  if (state->refining && !self->candidates_complete)
+    state->refining = FALSE;
+
+  if (state->refining && self->candidates->len == 0)
     {
-      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(as)", NULL));
+      return_search_results (state->invocations, g_variant_new ("(as)", NULL));
+      search_state_free (state);
       return;
     }
 
@@ -226,26 +785,203 @@ do_search (EksSearchProvider *self,
   const char *tags_match_any[] = { "EknArticleObject", NULL };
 
   self->cancellable = g_cancellable_new ();
-  g_autoptr(DmQuery) query_obj = g_object_new (DM_TYPE_QUERY,
-                                               "search-terms", search_terms,
-                                               "limit", RESULTS_LIMIT,
-                                               "app-id", self->application_id,
-                                               "tags-match-any", tags_match_any,
-                                               NULL);
-  SearchState *state = g_slice_new0 (SearchState);
-  state->self = self;
-  state->invocation = g_object_ref (invocation);
+  g_autoptr(DmQuery) query_obj = NULL;
+  if (state->refining)
+    {
+      g_autoptr(GPtrArray) ids = g_ptr_array_sized_new (self->candidates->len + 1);
+      for (guint i = 0; i < self->candidates->len; i++)
+        g_ptr_array_add (ids, g_ptr_array_index (self->candidates, i));
+      g_ptr_array_add (ids, NULL);
+
+      query_obj = g_object_new (DM_TYPE_QUERY,
+                                "search-terms", state->search_terms,
+                                "limit", self->candidates->len,
+                                "app-id", self->application_id,
+                                "ids", (const char * const *) ids->pdata,
+                                NULL);
+    }
+  else
+    {
+      query_obj = g_object_new (DM_TYPE_QUERY,
+                                "search-terms", state->search_terms,
+                                "limit", CANDIDATES_LIMIT,
+                                "app-id", self->application_id,
+                                "tags-match-any", tags_match_any,
+                                NULL);
+    }
+
+  state->start_time = g_get_monotonic_time ();
+  self->last_search_start_time = state->start_time;
+  self->running_search = state;
   dm_engine_query (dm_engine_get_default (), query_obj, self->cancellable,
                    search_finished, state);
 }
 
+static gboolean
+on_pending_search_timeout (gpointer user_data)
+{
+  EksSearchProvider *self = user_data;
+  SearchState *state = g_steal_pointer (&self->pending_search);
+
+  self->pending_search_id = 0;
+  start_search (self, state);
+  g_application_release (g_application_get_default ());
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Looks up a previous search for the same terms, and makes its results the
+ * candidates for the following subsearches. Results from before the app's
+ * content was updated are dropped.
+ *
+ * Returns: (nullable): a floating "(as)" with the results, or %NULL */
+static GVariant *
+lookup_cached_search (EksSearchProvider *self,
+                      const gchar       *cache_key)
+{
+  CachedSearch *cached = eks_lru_cache_lookup (self->search_cache, cache_key);
+  if (cached == NULL)
+    return NULL;
+
+  g_autofree gchar *fingerprint = shards_fingerprint_for_app (dm_engine_get_default (),
+                                                              self->application_id,
+                                                              NULL);
+  if (g_get_monotonic_time () > cached->expiry_time ||
+      g_strcmp0 (fingerprint, cached->shards_fingerprint) != 0)
+    {
+      eks_lru_cache_remove (self->search_cache, cache_key);
+      return NULL;
+    }
+
+  g_clear_pointer (&self->candidates, g_ptr_array_unref);
+  self->candidates = g_ptr_array_ref (cached->ids);
+  g_clear_pointer (&self->candidate_terms, g_strfreev);
+  self->candidate_terms = g_strdupv (cached->folded_terms);
+  self->candidates_complete = cached->complete;
+
+  /* GetResultMetas will be asked for these next */
+  GVariantBuilder builder;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("as"));
+  for (guint i = 0; i < cached->metas->len; i++)
+    {
+      const gchar *id = g_ptr_array_index (cached->ids, i);
+      ResultMeta *meta = g_ptr_array_index (cached->metas, i);
+      eks_lru_cache_insert (self->result_meta_cache, id, result_meta_copy (meta),
+                            result_meta_get_size (meta));
+      g_variant_builder_add (&builder, "s", id);
+    }
+  return g_variant_new ("(as)", &builder);
+}
+
+/* Searches starting closer together than this are merged into one. Waiting
+ * for a fraction of the time a search takes is cheaper than starting one
+ * that the next keystroke will cancel, so the window follows the measured
+ * latency; searches that are fast anyway are never delayed. */
+static gint64
+get_coalescing_window (EksSearchProvider *self)
+{
+  gint64 window = self->search_latency / 2;
+
+  if (window < MIN_COALESCING_WINDOW_USEC)
+    return 0;
+  return MIN (window, MAX_COALESCING_WINDOW_USEC);
+}
+
+static void
+do_search (EksSearchProvider *self,
+           GDBusMethodInvocation *invocation,
+           gchar **terms,
+           gboolean subsearch)
+{
+  g_autofree char *search_terms = g_strjoinv (" ", terms);
+  if (*search_terms == '\0')
+    {
+      g_dbus_method_invocation_return_value (invocation, g_variant_new ("(as)", NULL));
+      return;
+    }
+
+  g_auto(GStrv) folded_terms = fold_terms (terms);
+  g_autofree gchar *cache_key = search_cache_key_for_terms (folded_terms);
+
+  GVariant *results = lookup_cached_search (self, cache_key);
+
+  /* Typing one more letter usually leaves enough of the previous results to
+   * answer without going to the database at all */
+  if (results == NULL && subsearch && self->candidates != NULL &&
+      terms_refine (self->candidate_terms, folded_terms))
+    results = refine_candidates_locally (self, folded_terms);
+
+  /* Calls still waiting for a search get the same answer */
+  if (results != NULL)
+    {
+      g_autoptr(GPtrArray) invocations = g_ptr_array_new_with_free_func (g_object_unref);
+      g_ptr_array_add (invocations, g_object_ref (invocation));
+      /* Nobody is left waiting for the running search, so it is cancelled
+       * rather than left to finish for nothing */
+      if (self->running_search != NULL)
+        {
+          return_search_results (self->running_search->invocations, g_variant_ref (results));
+          g_cancellable_cancel (self->cancellable);
+          g_clear_object (&self->cancellable);
+          self->running_search = NULL;
+        }
+      if (self->pending_search != NULL)
+        {
+          g_source_remove (self->pending_search_id);
+          self->pending_search_id = 0;
+          return_search_results (self->pending_search->invocations, g_variant_ref (results));
+          g_clear_pointer (&self->pending_search, search_state_free);
+          g_application_release (g_application_get_default ());
+        }
+      return_search_results (invocations, results);
+      return;
+    }
+
+  /* A search is already waiting for the window to end; it will now run for
+   * the latest terms and answer this call too */
+  SearchState *state = self->pending_search;
+  if (state != NULL)
+    {
+      g_ptr_array_add (state->invocations, g_object_ref (invocation));
+      g_free (state->search_terms);
+      state->search_terms = g_steal_pointer (&search_terms);
+      g_strfreev (state->folded_terms);
+      state->folded_terms = g_steal_pointer (&folded_terms);
+      g_free (state->cache_key);
+      state->cache_key = g_steal_pointer (&cache_key);
+      state->subsearch = subsearch;
+      return;
+    }
+
+  state = search_state_new (self);
+  g_ptr_array_add (state->invocations, g_object_ref (invocation));
+  state->search_terms = g_steal_pointer (&search_terms);
+  state->folded_terms = g_steal_pointer (&folded_terms);
+  state->cache_key = g_steal_pointer (&cache_key);
+  state->subsearch = subsearch;
+
+  gint64 elapsed = g_get_monotonic_time () - self->last_search_start_time;
+  gint64 window = get_coalescing_window (self);
+  if (elapsed >= window)
+    {
+      start_search (self, state);
+      return;
+    }
+
+  g_application_hold (g_application_get_default ());
+  self->pending_search = state;
+  self->pending_search_id = g_timeout_add ((window - elapsed + 999) / 1000,
+                                           on_pending_search_timeout,
+                                           self);
+}
+
 static gboolean
 handle_get_initial_result_set (EksSearchProvider2 *skeleton,
                                GDBusMethodInvocation *invocation,
                                gchar **terms,
                                EksSearchProvider *self)
 {
-  do_search (self, invocation, terms);
+  do_search (self, invocation, terms, FALSE);
   return TRUE;
 }
 
@@ -256,7 +992,9 @@ handle_get_subsearch_result_set (EksSearchProvider2 *skeleton,
                                  gchar **terms,
                                  EksSearchProvider *self)
 {
-  do_search (self, invocation, terms);
+  /* previous_results are only the few results the shell displayed; the
+   * wider set of candidates kept from the previous search is used instead */
+  do_search (self, invocation, terms, TRUE);
   return TRUE;
 }
 
@@ -272,35 +1010,27 @@ handle_get_result_metas (EksSearchProvider2 *skeleton,
   guint length = g_strv_length (results);
   for (guint i = 0; i < length; i++)
     {
-      DmContent *model = g_hash_table_lookup (self->object_cache, results[i]);
-      if (model == NULL)
+      ResultMeta *meta = eks_lru_cache_lookup (self->result_meta_cache, results[i]);
+      if (meta == NULL)
         continue;
 
       GVariantBuilder meta_builder;
       g_variant_builder_init (&meta_builder, G_VARIANT_TYPE ("a{sv}"));
-      g_autofree gchar *original_title = NULL;
-      g_autofree gchar *title = NULL;
-      g_autofree gchar *synopsis = NULL;
-      g_object_get (model,
-                    "original-title", &original_title,
-                    "title", &title,
-                    "synopsis", &synopsis,
-                    NULL);
-      gchar *visible_title = (original_title && *original_title) ? original_title : title;
       g_variant_builder_add (&meta_builder, "{sv}", "id", g_variant_new_string (results[i]));
-      g_variant_builder_add (&meta_builder, "{sv}", "name", g_variant_new_string (visible_title));
-      if (synopsis)
-        {
-          if (strlen (synopsis) > MAX_DESCRIPTION_LENGTH)
-            {
-              gchar *end = g_utf8_prev_char (synopsis + MAX_DESCRIPTION_LENGTH + 1);
-              *end = '\0';
-            }
-          g_variant_builder_add (&meta_builder, "{sv}", "description", g_variant_new_string (synopsis));
-        }
+      g_variant_builder_add (&meta_builder, "{sv}", "name", g_variant_new_string (meta->name));
+      if (meta->description)
+        g_variant_builder_add (&meta_builder, "{sv}", "description", g_variant_new_string (meta->description));
       g_variant_builder_add_value (&builder, g_variant_builder_end (&meta_builder));
     }
 
+  g_debug ("Result meta cache for %s: %u entries, %" G_GSIZE_FORMAT " bytes, "
+           "%" G_GUINT64_FORMAT " hits, %" G_GUINT64_FORMAT " misses",
+           self->application_id,
+           eks_lru_cache_get_n_entries (self->result_meta_cache),
+           eks_lru_cache_get_n_bytes (self->result_meta_cache),
+           eks_lru_cache_get_hits (self->result_meta_cache),
+           eks_lru_cache_get_misses (self->result_meta_cache));
+
   g_dbus_method_invocation_return_value (invocation, g_variant_new ("(aa{sv})", &builder));
   return TRUE;
 }
@@ -313,22 +1043,14 @@ handle_activate_result (EksSearchProvider2 *skeleton,
                         guint32 timestamp,
                         EksSearchProvider *self)
 {
-  if (!ensure_app_proxy (self))
-    return TRUE;
-
-  g_autofree gchar *query = g_strjoinv (" ", terms);
-  GError *error = NULL;
-  eks_knowledge_search_call_load_item_sync (self->app_proxy,
-                                            id,
-                                            query,
-                                            timestamp,
-                                            NULL,
-                                            &error);
-  if (error != NULL)
-    {
-      g_warning ("Error activating result: %s", error->message);
-      g_clear_error (&error);
-    }
+  PendingActivation *activation = g_new0 (PendingActivation, 1);
+  activation->id = g_strdup (id);
+  activation->query = g_strjoinv (" ", terms);
+  activation->timestamp = timestamp;
+
+  /* Don't make the shell wait for the app to start */
+  eks_search_provider2_complete_activate_result (skeleton, invocation);
+  activate_app (self, activation);
   return TRUE;
 }
 
@@ -339,21 +1061,12 @@ handle_launch_search (EksSearchProvider2 *skeleton,
                       guint32 timestamp,
                       EksSearchProvider *self)
 {
-  if (!ensure_app_proxy (self))
-    return TRUE;
-
-  g_autofree gchar *query = g_strjoinv (" ", terms);
-  GError *error = NULL;
-  eks_knowledge_search_call_load_query_sync (self->app_proxy,
-                                             query,
-                                             timestamp,
-                                             NULL,
-                                             &error);
-  if (error != NULL)
-    {
-      g_warning ("Error launching search: %s", error->message);
-      g_clear_error (&error);
-    }
+  PendingActivation *activation = g_new0 (PendingActivation, 1);
+  activation->query = g_strjoinv (" ", terms);
+  activation->timestamp = timestamp;
+
+  eks_search_provider2_complete_launch_search (skeleton, invocation);
+  activate_app (self, activation);
   return TRUE;
 }
 
@@ -365,10 +1078,144 @@ eks_search_provider_skeleton_for_interface (EksProvider *provider,
   return G_DBUS_INTERFACE_SKELETON (self->skeleton);
 }
 
+typedef struct {
+  GVariantBuilder *builder;
+  const gchar *shards_fingerprint;
+  gint64 now;
+  gint64 real_now;
+} SaveSearchesData;
+
+static void
+add_cached_search_to_builder (gpointer key,
+                              gpointer value,
+                              gpointer user_data)
+{
+  CachedSearch *cached = value;
+  SaveSearchesData *data = user_data;
+  GVariantBuilder metas;
+
+  if (data->now > cached->expiry_time ||
+      g_strcmp0 (cached->shards_fingerprint, data->shards_fingerprint) != 0)
+    return;
+
+  g_variant_builder_init (&metas, G_VARIANT_TYPE ("a(sms)"));
+  for (guint i = 0; i < cached->metas->len; i++)
+    {
+      ResultMeta *meta = g_ptr_array_index (cached->metas, i);
+      g_variant_builder_add (&metas, "(sms)", meta->name, meta->description);
+    }
+
+  /* The expiry time is saved as wall clock time, since the monotonic clock
+   * of the next process may not count from the same point */
+  g_variant_builder_add (data->builder, "(s@as@asba(sms)x)",
+                         key,
+                         g_variant_new_strv ((const gchar * const *) cached->ids->pdata,
+                                             cached->ids->len),
+                         g_variant_new_strv ((const gchar * const *) cached->folded_terms, -1),
+                         cached->complete,
+                         &metas,
+                         data->real_now + (cached->expiry_time - data->now));
+}
+
+static GVariant *
+eks_search_provider_save_state (EksProvider *provider)
+{
+  EksSearchProvider *self = EKS_SEARCH_PROVIDER (provider);
+  g_autofree gchar *fingerprint = shards_fingerprint_for_app (dm_engine_get_default (),
+                                                              self->application_id,
+                                                              NULL);
+  GVariantBuilder searches;
+  GVariantDict state;
+
+  if (fingerprint == NULL)
+    return NULL;
+
+  SaveSearchesData data = {
+    .builder = &searches,
+    .shards_fingerprint = fingerprint,
+    .now = g_get_monotonic_time (),
+    .real_now = g_get_real_time (),
+  };
+
+  g_variant_builder_init (&searches, G_VARIANT_TYPE ("a(sasasba(sms)x)"));
+  eks_lru_cache_foreach (self->search_cache, add_cached_search_to_builder, &data);
+
+  g_variant_dict_init (&state, NULL);
+  g_variant_dict_insert_value (&state, "searches", g_variant_builder_end (&searches));
+  g_variant_dict_insert (&state, "search-latency", "x", self->search_latency);
+  return g_variant_dict_end (&state);
+}
+
+static void
+eks_search_provider_restore_state (EksProvider *provider,
+                                   GVariant    *state)
+{
+  EksSearchProvider *self = EKS_SEARCH_PROVIDER (provider);
+  g_autofree gchar *fingerprint = shards_fingerprint_for_app (dm_engine_get_default (),
+                                                              self->application_id,
+                                                              NULL);
+  g_autoptr(GVariant) searches = g_variant_lookup_value (state, "searches",
+                                                         G_VARIANT_TYPE ("a(sasasba(sms)x)"));
+  gint64 now = g_get_monotonic_time ();
+  gint64 real_now = g_get_real_time ();
+  GVariantIter iter;
+  const gchar *key;
+  GVariant *ids, *folded_terms;
+  gboolean complete;
+  GVariantIter *metas;
+  gint64 expiry_time;
+
+  if (fingerprint == NULL)
+    return;
+
+  g_variant_lookup (state, "search-latency", "x", &self->search_latency);
+
+  if (searches == NULL)
+    return;
+
+  /* Saved from the least to the most recently used, which is the order to
+   * insert them in */
+  g_variant_iter_init (&iter, searches);
+  while (g_variant_iter_loop (&iter, "(&s@as@asba(sms)x)",
+                              &key, &ids, &folded_terms, &complete, &metas, &expiry_time))
+    {
+      CachedSearch *cached;
+      g_autofree gchar **id_strv = NULL;
+      gsize n_ids;
+      const gchar *name, *description;
+
+      if (expiry_time <= real_now ||
+          g_variant_iter_n_children (metas) > g_variant_n_children (ids))
+        continue;
+
+      cached = g_slice_new0 (CachedSearch);
+      /* The array takes over the strings */
+      id_strv = g_variant_dup_strv (ids, &n_ids);
+      cached->ids = g_ptr_array_new_with_free_func (g_free);
+      for (gsize i = 0; i < n_ids; i++)
+        g_ptr_array_add (cached->ids, id_strv[i]);
+      cached->folded_terms = g_variant_dup_strv (folded_terms, NULL);
+      cached->complete = complete;
+      cached->metas = g_ptr_array_new_with_free_func (g_free);
+      while (g_variant_iter_next (metas, "(&sm&s)", &name, &description))
+        {
+          gsize size;
+          g_ptr_array_add (cached->metas, result_meta_new (name, description, &size));
+        }
+      cached->shards_fingerprint = g_strdup (fingerprint);
+      cached->expiry_time = now + MIN (expiry_time - real_now, SEARCH_CACHE_TTL);
+
+      eks_lru_cache_insert (self->search_cache, key, cached,
+                            cached_search_get_size (cached));
+    }
+}
+
 static void
 eks_search_provider_interface_init (EksProviderInterface *iface)
 {
   iface->skeleton_for_interface = eks_search_provider_skeleton_for_interface;
+  iface->save_state = eks_search_provider_save_state;
+  iface->restore_state = eks_search_provider_restore_state;
 }
 
 static void
@@ -386,5 +1233,16 @@ eks_search_provider_init (EksSearchProvider *self)
   g_signal_connect (self->skeleton, "handle-launch-search",
                     G_CALLBACK (handle_launch_search), self);
 
-  self->object_cache = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_object_unref);
+  self->result_meta_cache = eks_lru_cache_new (RESULT_META_CACHE_MAX_ENTRIES,
+                                               RESULT_META_CACHE_MAX_BYTES,
+                                               g_free);
+  self->search_cache = eks_lru_cache_new (SEARCH_CACHE_MAX_ENTRIES,
+                                          SEARCH_CACHE_MAX_BYTES,
+                                          (GDestroyNotify) cached_search_free);
+  eks_metrics_add_cache (eks_metrics_get_default (),
+                         "search-result-metas",
+                         self->result_meta_cache);
+  eks_metrics_add_cache (eks_metrics_get_default (),
+                         "search-terms",
+                         self->search_cache);
 }
@@ -0,0 +1,320 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#include "eks-snapshot.h"
+
+#include "eks-query-util.h"
+
+#include <dmodel.h>
+
+#include <errno.h>
+#include <gio/gio.h>
+#include <glib/gstdio.h>
+
+/* Must change whenever the format of the file, or of the state saved by any
+ * provider, changes; files with another version are ignored */
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_TYPE "(ua{s(sxa{sv})})"
+/* Apps which haven't been used for this long are left out of the snapshot,
+ * and at most this many apps are kept in it */
+#define SNAPSHOT_MAX_AGE (7 * G_TIME_SPAN_DAY)
+#define SNAPSHOT_MAX_APPS 100
+
+/**
+ * EksSnapshot:
+ *
+ * The state of the providers, saved to a file when the service exits and
+ * restored into the providers created by the next instance. The file holds
+ * a GVariant of type (ua{s(sxa{sv})}): the version of the format, then for
+ * each app id, the generation of the app's shards when the state was saved,
+ * the wall clock time it was saved at, and the state of each kind of
+ * provider. A provider's state is only restored if the shards of its app
+ * are still of the same generation.
+ *
+ * The file is only mapped when the first provider is created, and states
+ * are read from the mapping as they are needed.
+ */
+struct _EksSnapshot
+{
+  gchar *path;
+  gboolean loaded;
+  // The apps of the file, of type a{s(sxa{sv})}, or NULL if there was none
+  GVariant *apps;
+  // Hash table with app id string keys, shards generation string values,
+  // which are empty if the app couldn't be loaded
+  GHashTable *generations;
+  // Hash table with app id string keys, values of hash tables with provider
+  // name string keys and GVariant state values, to be written out
+  GHashTable *states;
+};
+
+/**
+ * eks_snapshot_new:
+ * @path: the file the snapshot is read from and written to
+ *
+ * Returns: (transfer full): a new snapshot, which doesn't read @path until
+ *   a state is looked up
+ */
+EksSnapshot *
+eks_snapshot_new (const gchar *path)
+{
+  EksSnapshot *snapshot = g_slice_new0 (EksSnapshot);
+
+  snapshot->path = g_strdup (path);
+  snapshot->generations = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, g_free);
+  snapshot->states = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify) g_hash_table_unref);
+
+  return snapshot;
+}
+
+void
+eks_snapshot_free (EksSnapshot *snapshot)
+{
+  g_free (snapshot->path);
+  g_clear_pointer (&snapshot->apps, g_variant_unref);
+  g_hash_table_unref (snapshot->generations);
+  g_hash_table_unref (snapshot->states);
+
+  g_slice_free (EksSnapshot, snapshot);
+}
+
+static void
+ensure_loaded (EksSnapshot *snapshot)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(GMappedFile) mapped_file = NULL;
+  g_autoptr(GBytes) bytes = NULL;
+  g_autoptr(GVariant) contents = NULL;
+  guint32 version;
+
+  if (snapshot->loaded)
+    return;
+  snapshot->loaded = TRUE;
+
+  mapped_file = g_mapped_file_new (snapshot->path, FALSE, &error);
+  if (mapped_file == NULL)
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Could not read snapshot %s: %s", snapshot->path, error->message);
+      return;
+    }
+
+  /* The data is not trusted, so that a corrupt file reads as default
+   * values rather than crashing; the variants returned keep the file
+   * mapped for as long as they are around */
+  bytes = g_mapped_file_get_bytes (mapped_file);
+  contents = g_variant_ref_sink (g_variant_new_from_bytes (G_VARIANT_TYPE (SNAPSHOT_TYPE),
+                                                           bytes,
+                                                           FALSE));
+
+  g_variant_get (contents, "(u@a{s(sxa{sv})})", &version, &snapshot->apps);
+  if (version != SNAPSHOT_VERSION)
+    g_clear_pointer (&snapshot->apps, g_variant_unref);
+}
+
+static const gchar *
+current_generation (EksSnapshot *snapshot,
+                    const gchar *app_id)
+{
+  gchar *generation = g_hash_table_lookup (snapshot->generations, app_id);
+
+  if (generation == NULL)
+    {
+      generation = shards_generation_for_app (dm_engine_get_default (), app_id, NULL);
+      if (generation == NULL)
+        generation = g_strdup ("");
+      g_hash_table_insert (snapshot->generations, g_strdup (app_id), generation);
+    }
+
+  return generation;
+}
+
+/* Returns: (transfer full) (nullable): the saved providers of app_id, if
+ * its shards are still of the same generation */
+static GVariant *
+lookup_valid_providers (EksSnapshot *snapshot,
+                        const gchar *app_id)
+{
+  g_autoptr(GVariant) app = NULL;
+  const gchar *generation;
+  GVariant *providers;
+
+  if (snapshot->apps == NULL)
+    return NULL;
+
+  /* Check that there is something to restore before checking that it is
+   * still valid, which is the expensive part */
+  app = g_variant_lookup_value (snapshot->apps, app_id, G_VARIANT_TYPE ("(sxa{sv})"));
+  if (app == NULL)
+    return NULL;
+
+  g_variant_get (app, "(&sx@a{sv})", &generation, NULL, &providers);
+  if (g_strcmp0 (generation, current_generation (snapshot, app_id)) != 0)
+    {
+      g_variant_unref (providers);
+      return NULL;
+    }
+
+  return providers;
+}
+
+/**
+ * eks_snapshot_lookup_state:
+ * @snapshot: the snapshot
+ * @app_id: the app of the provider
+ * @provider_name: the kind of provider
+ *
+ * Looks up the state saved for a provider, reading the snapshot file the
+ * first time. Finding out whether the state is still valid loads the app's
+ * domain, which only happens if there is a state for it.
+ *
+ * Returns: (transfer full) (nullable): the a{sv} state to restore, or %NULL
+ */
+GVariant *
+eks_snapshot_lookup_state (EksSnapshot *snapshot,
+                           const gchar *app_id,
+                           const gchar *provider_name)
+{
+  g_autoptr(GVariant) providers = NULL;
+
+  ensure_loaded (snapshot);
+
+  providers = lookup_valid_providers (snapshot, app_id);
+  if (providers == NULL)
+    return NULL;
+
+  return g_variant_lookup_value (providers, provider_name, G_VARIANT_TYPE_VARDICT);
+}
+
+/**
+ * eks_snapshot_add_state:
+ * @snapshot: the snapshot
+ * @app_id: the app of the provider
+ * @provider_name: the kind of provider
+ * @state: the a{sv} state of the provider
+ *
+ * Adds the state of a provider to what eks_snapshot_write() writes out.
+ */
+void
+eks_snapshot_add_state (EksSnapshot *snapshot,
+                        const gchar *app_id,
+                        const gchar *provider_name,
+                        GVariant    *state)
+{
+  GHashTable *app_states = g_hash_table_lookup (snapshot->states, app_id);
+
+  if (app_states == NULL)
+    {
+      app_states = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
+                                          (GDestroyNotify) g_variant_unref);
+      g_hash_table_insert (snapshot->states, g_strdup (app_id), app_states);
+    }
+
+  g_hash_table_insert (app_states, g_strdup (provider_name), g_variant_ref_sink (state));
+}
+
+static GVariant *
+build_app_providers (EksSnapshot *snapshot,
+                     const gchar *app_id,
+                     GHashTable  *app_states)
+{
+  g_autoptr(GVariant) saved_providers = lookup_valid_providers (snapshot, app_id);
+  GVariantDict providers;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  /* Kinds of provider this instance didn't create for the app keep their
+   * saved state, if it is still valid */
+  g_variant_dict_init (&providers, saved_providers);
+
+  g_hash_table_iter_init (&iter, app_states);
+  while (g_hash_table_iter_next (&iter, &key, &value))
+    g_variant_dict_insert_value (&providers, key, value);
+
+  return g_variant_dict_end (&providers);
+}
+
+/**
+ * eks_snapshot_write:
+ * @snapshot: the snapshot
+ * @error: return location for a #GError
+ *
+ * Writes out the states added with eks_snapshot_add_state(), along with the
+ * ones of the apps they don't cover which were read from the file and are
+ * recent enough to keep.
+ *
+ * Returns: %TRUE if the snapshot was written
+ */
+gboolean
+eks_snapshot_write (EksSnapshot  *snapshot,
+                    GError      **error)
+{
+  g_autoptr(GVariant) contents = NULL;
+  g_autofree gchar *dir = g_path_get_dirname (snapshot->path);
+  gint64 now = g_get_real_time ();
+  GVariantBuilder apps;
+  GHashTableIter iter;
+  gpointer key, value;
+  guint n_apps = 0;
+
+  ensure_loaded (snapshot);
+
+  g_variant_builder_init (&apps, G_VARIANT_TYPE ("a{s(sxa{sv})}"));
+
+  g_hash_table_iter_init (&iter, snapshot->states);
+  while (g_hash_table_iter_next (&iter, &key, &value) && n_apps < SNAPSHOT_MAX_APPS)
+    {
+      const gchar *generation = current_generation (snapshot, key);
+
+      if (*generation == '\0')
+        continue;
+
+      g_variant_builder_add (&apps, "{s(sx@a{sv})}",
+                             key,
+                             generation,
+                             now,
+                             build_app_providers (snapshot, key, value));
+      n_apps++;
+    }
+
+  if (snapshot->apps != NULL)
+    {
+      GVariantIter apps_iter;
+      const gchar *app_id;
+      GVariant *app;
+
+      g_variant_iter_init (&apps_iter, snapshot->apps);
+      while (g_variant_iter_loop (&apps_iter, "{&s@(sxa{sv})}", &app_id, &app))
+        {
+          gint64 saved_time;
+
+          g_variant_get_child (app, 1, "x", &saved_time);
+          if (n_apps >= SNAPSHOT_MAX_APPS ||
+              g_hash_table_contains (snapshot->states, app_id) ||
+              now - saved_time > SNAPSHOT_MAX_AGE)
+            continue;
+
+          g_variant_builder_add (&apps, "{s@(sxa{sv})}", app_id, app);
+          n_apps++;
+        }
+    }
+
+  contents = g_variant_ref_sink (g_variant_new ("(u@a{s(sxa{sv})})",
+                                                SNAPSHOT_VERSION,
+                                                g_variant_builder_end (&apps)));
+
+  if (g_mkdir_with_parents (dir, 0700) < 0)
+    {
+      int errsv = errno;
+      g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                   "Could not create %s: %s", dir, g_strerror (errsv));
+      return FALSE;
+    }
+
+  /* The file is replaced rather than written in place, so a mapping of the
+   * old one is left alone */
+  return g_file_set_contents (snapshot->path,
+                              g_variant_get_data (contents),
+                              g_variant_get_size (contents),
+                              error);
+}
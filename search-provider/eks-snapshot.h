@@ -0,0 +1,29 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EksSnapshot EksSnapshot;
+
+EksSnapshot * eks_snapshot_new (const gchar *path);
+
+void eks_snapshot_free (EksSnapshot *snapshot);
+
+GVariant * eks_snapshot_lookup_state (EksSnapshot *snapshot,
+                                      const gchar *app_id,
+                                      const gchar *provider_name);
+
+void eks_snapshot_add_state (EksSnapshot *snapshot,
+                             const gchar *app_id,
+                             const gchar *provider_name,
+                             GVariant    *state);
+
+gboolean eks_snapshot_write (EksSnapshot  *snapshot,
+                             GError      **error);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (EksSnapshot, eks_snapshot_free)
+
+G_END_DECLS
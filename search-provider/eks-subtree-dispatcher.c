@@ -17,12 +17,14 @@ struct _EksSubtreeDispatcherPrivate
   guint registration_id;
 
   GPtrArray *interface_infos;
+  GPtrArray *root_interface_infos;
 };
 typedef struct _EksSubtreeDispatcherPrivate EksSubtreeDispatcherPrivate;
 
 enum {
   PROP_0,
   PROP_INTERFACE_INFOS,
+  PROP_ROOT_INTERFACE_INFOS,
   NUM_PROPS,
 };
 static GParamSpec *obj_props[NUM_PROPS];
@@ -51,6 +53,10 @@ eks_subtree_dispatcher_get_property (GObject    *object,
       g_value_set_boxed (value, priv->interface_infos);
       break;
 
+    case PROP_ROOT_INTERFACE_INFOS:
+      g_value_set_boxed (value, priv->root_interface_infos);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -71,6 +77,10 @@ eks_subtree_dispatcher_set_property (GObject      *object,
       priv->interface_infos = g_value_dup_boxed (value);
       break;
 
+    case PROP_ROOT_INTERFACE_INFOS:
+      priv->root_interface_infos = g_value_dup_boxed (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
     }
@@ -85,6 +95,7 @@ eks_subtree_dispatcher_dispose (GObject *object)
   G_OBJECT_CLASS (eks_subtree_dispatcher_parent_class)->dispose (object);
 
   g_clear_pointer (&priv->interface_infos, g_ptr_array_unref);
+  g_clear_pointer (&priv->root_interface_infos, g_ptr_array_unref);
 
   if (priv->registration_id > 0)
     {
@@ -113,6 +124,18 @@ eks_subtree_dispatcher_class_init (EksSubtreeDispatcherClass *klass)
                                                         "The interface infos of the children subobjects",
                                                         G_TYPE_PTR_ARRAY,
                                                         G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
+
+  /**
+   * EksSubtreeDispatcher:root-interface-infos:
+   *
+   * A #GPtrArray of #GDBusInterfaceInfo for the interfaces of the root
+   * object of this tree, which are dispatched with a %NULL subnode.
+   */
+  obj_props[PROP_ROOT_INTERFACE_INFOS] = g_param_spec_boxed ("root-interface-infos",
+                                                             "Root Interface Infos",
+                                                             "The interface infos of the root object",
+                                                             G_TYPE_PTR_ARRAY,
+                                                             G_PARAM_READWRITE | G_PARAM_CONSTRUCT_ONLY | G_PARAM_STATIC_STRINGS);
   g_object_class_install_properties (object_class, NUM_PROPS, obj_props);
 
   /**
@@ -160,16 +183,17 @@ subtree_introspect (GDBusConnection *connection,
   EksSubtreeDispatcher *self = EKS_SUBTREE_DISPATCHER (user_data);
   EksSubtreeDispatcherPrivate *priv = eks_subtree_dispatcher_get_instance_private (self);
 
-  /* Root has no interfaces. */
-  if (node == NULL)
+  GPtrArray *infos = node == NULL ? priv->root_interface_infos : priv->interface_infos;
+
+  if (infos == NULL || infos->len == 0)
     return NULL;
 
   GPtrArray *ptr_array = g_ptr_array_new ();
   size_t i = 0;
 
-  for (; i < priv->interface_infos->len; ++i) {
+  for (; i < infos->len; ++i) {
     g_ptr_array_add (ptr_array,
-                     g_dbus_interface_info_ref (g_ptr_array_index(priv->interface_infos,
+                     g_dbus_interface_info_ref (g_ptr_array_index(infos,
                                                                   i)));
   }
 
@@ -0,0 +1,269 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#include "eks-trace.h"
+
+#ifdef HAVE_SYSPROF
+#include <sysprof-capture.h>
+#endif
+
+/* Tracing follows requests from the moment they reach a provider to the
+ * moment they are answered, recording how long each step along the way
+ * took. Steps are recorded as spans against the id of their request.
+ *
+ * When the process runs under sysprof, every span is a mark in the capture.
+ * If EKS_SLOW_REQUEST_MS is set, the spans of each request are also kept
+ * until it ends, and requests taking longer than that many milliseconds are
+ * logged along with their spans. With neither, requests get the id 0 and
+ * every call returns straight away. */
+
+typedef struct
+{
+  const gchar *name;
+  gint64 begin_time;
+  gint64 duration;
+} TraceSpan;
+
+typedef struct
+{
+  gchar *app_id;
+  gchar *interface_name;
+  gint64 begin_time;
+  // Array of TraceSpan, in the order they ended
+  GArray *spans;
+} TraceRequest;
+
+static gboolean trace_enabled = FALSE;
+static gboolean trace_to_sysprof = FALSE;
+static gint64 slow_request_usec = 0;
+
+/* Requests are begun and spans recorded from both the main thread and the
+ * worker threads */
+G_LOCK_DEFINE_STATIC (trace_requests);
+static guint next_request_id = 1;
+// Hash table with request id keys, TraceRequest values
+static GHashTable *trace_requests = NULL;
+
+static void
+trace_request_free (TraceRequest *request)
+{
+  g_free (request->app_id);
+  g_free (request->interface_name);
+  g_array_unref (request->spans);
+
+  g_slice_free (TraceRequest, request);
+}
+
+/**
+ * eks_trace_init:
+ *
+ * Decides whether, and how, to trace requests, based on the environment.
+ * Must be called once at startup, before any request is traced.
+ */
+void
+eks_trace_init (void)
+{
+  const gchar *slow_request_ms = g_getenv ("EKS_SLOW_REQUEST_MS");
+
+#ifdef HAVE_SYSPROF
+  trace_to_sysprof = sysprof_collector_is_active ();
+#endif
+
+  if (slow_request_ms != NULL)
+    slow_request_usec = g_ascii_strtoll (slow_request_ms, NULL, 10) * 1000;
+
+  trace_enabled = trace_to_sysprof || slow_request_usec > 0;
+
+  if (trace_enabled)
+    trace_requests = g_hash_table_new_full (NULL, NULL, NULL,
+                                            (GDestroyNotify) trace_request_free);
+}
+
+gboolean
+eks_trace_is_enabled (void)
+{
+  return trace_enabled;
+}
+
+/**
+ * eks_trace_request_begin:
+ * @app_id: (nullable): the app the request is for
+ * @interface_name: the D-Bus interface the request came through
+ *
+ * Starts tracing a request, which must be ended with
+ * eks_trace_request_end() once it has been answered.
+ *
+ * Returns: the id of the request, or 0 if tracing is disabled
+ */
+guint
+eks_trace_request_begin (const gchar *app_id,
+                         const gchar *interface_name)
+{
+  TraceRequest *request;
+  guint request_id;
+
+  if (!trace_enabled)
+    return 0;
+
+  request = g_slice_new0 (TraceRequest);
+  request->app_id = g_strdup (app_id);
+  request->interface_name = g_strdup (interface_name);
+  request->begin_time = g_get_monotonic_time ();
+  request->spans = g_array_new (FALSE, FALSE, sizeof (TraceSpan));
+
+  G_LOCK (trace_requests);
+  request_id = next_request_id++;
+  /* Skip 0, which means no request, when the ids wrap around */
+  if (next_request_id == 0)
+    next_request_id = 1;
+  g_hash_table_insert (trace_requests, GUINT_TO_POINTER (request_id), request);
+  G_UNLOCK (trace_requests);
+
+  return request_id;
+}
+
+/**
+ * eks_trace_begin:
+ * @request_id: the id of the request the span is part of
+ *
+ * Returns: the begin time to pass to eks_trace_span(), or 0 if the request
+ *   isn't traced
+ */
+gint64
+eks_trace_begin (guint request_id)
+{
+  if (request_id == 0)
+    return 0;
+
+  return g_get_monotonic_time ();
+}
+
+#ifdef HAVE_SYSPROF
+static void
+mark_in_sysprof (guint               request_id,
+                 const TraceRequest *request,
+                 const gchar        *name,
+                 gint64              begin_time,
+                 gint64              duration)
+{
+  g_autofree gchar *message = g_strdup_printf ("request=%u app=%s interface=%s",
+                                               request_id,
+                                               request->app_id != NULL ? request->app_id : "",
+                                               request->interface_name);
+
+  /* Both clocks are CLOCK_MONOTONIC */
+  sysprof_collector_mark (begin_time * 1000,
+                          duration * 1000,
+                          "EknServices",
+                          name,
+                          message);
+}
+#endif
+
+/**
+ * eks_trace_span:
+ * @request_id: the id of the request the span is part of
+ * @name: the name of the span, which must be a static string
+ * @begin_time: the time returned by eks_trace_begin() when the span began
+ *
+ * Records a span of @request_id, ending now.
+ */
+void
+eks_trace_span (guint        request_id,
+                const gchar *name,
+                gint64       begin_time)
+{
+  TraceRequest *request;
+  TraceSpan span;
+
+  if (request_id == 0)
+    return;
+
+  span.name = name;
+  span.begin_time = begin_time;
+  span.duration = g_get_monotonic_time () - begin_time;
+
+  G_LOCK (trace_requests);
+
+  request = g_hash_table_lookup (trace_requests, GUINT_TO_POINTER (request_id));
+  if (request != NULL)
+    {
+#ifdef HAVE_SYSPROF
+      if (trace_to_sysprof)
+        mark_in_sysprof (request_id, request, span.name, span.begin_time, span.duration);
+#endif
+      if (slow_request_usec > 0)
+        g_array_append_val (request->spans, span);
+    }
+
+  G_UNLOCK (trace_requests);
+}
+
+static void
+log_slow_request (guint               request_id,
+                  const TraceRequest *request,
+                  gint64              duration)
+{
+  g_autoptr(GString) spans = g_string_new (NULL);
+
+  for (guint i = 0; i < request->spans->len; ++i)
+    {
+      const TraceSpan *span = &g_array_index (request->spans, TraceSpan, i);
+
+      g_string_append_printf (spans, "%s%s=%.1fms@%.1fms",
+                              i > 0 ? " " : "",
+                              span->name,
+                              span->duration / 1000.0,
+                              (span->begin_time - request->begin_time) / 1000.0);
+    }
+
+  g_log_structured ("EknServices", G_LOG_LEVEL_MESSAGE,
+                    "EKS_REQUEST_ID", "%u", request_id,
+                    "EKS_APP_ID", "%s", request->app_id != NULL ? request->app_id : "",
+                    "EKS_INTERFACE", "%s", request->interface_name,
+                    "EKS_DURATION_MS", "%.1f", duration / 1000.0,
+                    "EKS_SPANS", "%s", spans->str,
+                    "MESSAGE", "Slow request %u to %s for %s took %.1fms: %s",
+                    request_id,
+                    request->interface_name,
+                    request->app_id != NULL ? request->app_id : "the root object",
+                    duration / 1000.0,
+                    spans->str);
+}
+
+/**
+ * eks_trace_request_end:
+ * @request_id: the id of the request
+ *
+ * Stops tracing @request_id, marking it as a whole in sysprof or logging it
+ * if it was slow.
+ */
+void
+eks_trace_request_end (guint request_id)
+{
+  TraceRequest *request;
+  gint64 duration;
+
+  if (request_id == 0)
+    return;
+
+  G_LOCK (trace_requests);
+  request = g_hash_table_lookup (trace_requests, GUINT_TO_POINTER (request_id));
+  if (request != NULL)
+    g_hash_table_steal (trace_requests, GUINT_TO_POINTER (request_id));
+  G_UNLOCK (trace_requests);
+
+  if (request == NULL)
+    return;
+
+  duration = g_get_monotonic_time () - request->begin_time;
+
+#ifdef HAVE_SYSPROF
+  if (trace_to_sysprof)
+    mark_in_sysprof (request_id, request, "request", request->begin_time, duration);
+#endif
+
+  if (slow_request_usec > 0 && duration >= slow_request_usec)
+    log_slow_request (request_id, request, duration);
+
+  trace_request_free (request);
+}
@@ -0,0 +1,24 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+void eks_trace_init (void);
+
+gboolean eks_trace_is_enabled (void);
+
+guint eks_trace_request_begin (const gchar *app_id,
+                               const gchar *interface_name);
+
+void eks_trace_request_end (guint request_id);
+
+gint64 eks_trace_begin (guint request_id);
+
+void eks_trace_span (guint        request_id,
+                     const gchar *name,
+                     gint64       begin_time);
+
+G_END_DECLS
@@ -0,0 +1,171 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#include "eks-worker-pool.h"
+
+/**
+ * EksWorkerPool:
+ *
+ * A pool of threads to run the CPU-bound part of replies on, such as
+ * turning models into variants, so that a large reply for one client does
+ * not hold up the main loop for all the others.
+ *
+ * Each job has a key, usually the ID of the app it is for. At most one job
+ * per key is handed to the threads at any time, and the others wait in
+ * order behind it, so that a single app can't take over every thread and
+ * its jobs keep their order. The threads themselves take the next runnable
+ * job from a shared queue whenever they become idle, whichever key it has.
+ */
+struct _EksWorkerPool
+{
+  GThreadPool *threads;
+
+  GMutex lock;
+  // Hash table with key string keys, GQueue of WorkerJob values. A key is
+  // present for as long as one of its jobs is running or queued.
+  GHashTable *waiting_jobs;
+};
+
+typedef struct
+{
+  gchar *key;
+  GTask *task;
+  GTaskThreadFunc func;
+} WorkerJob;
+
+static void
+worker_job_free (WorkerJob *job)
+{
+  g_free (job->key);
+  g_object_unref (job->task);
+
+  g_slice_free (WorkerJob, job);
+}
+
+static void
+waiting_jobs_queue_free (GQueue *queue)
+{
+  g_queue_free_full (queue, (GDestroyNotify) worker_job_free);
+}
+
+static void
+push_job (EksWorkerPool *pool,
+          WorkerJob     *job)
+{
+  g_autoptr(GError) error = NULL;
+
+  /* This can only fail when creating a new thread fails, in which case the
+   * job stays queued until one of the existing threads is free */
+  if (!g_thread_pool_push (pool->threads, job, &error))
+    g_warning ("Could not start a worker thread: %s", error->message);
+}
+
+static void
+run_job (gpointer data,
+         gpointer user_data)
+{
+  WorkerJob *job = data;
+  EksWorkerPool *pool = user_data;
+  WorkerJob *next_job = NULL;
+
+  job->func (job->task,
+             g_task_get_source_object (job->task),
+             g_task_get_task_data (job->task),
+             g_task_get_cancellable (job->task));
+
+  g_mutex_lock (&pool->lock);
+
+  GQueue *queue = g_hash_table_lookup (pool->waiting_jobs, job->key);
+  next_job = g_queue_pop_head (queue);
+  if (next_job == NULL)
+    g_hash_table_remove (pool->waiting_jobs, job->key);
+
+  g_mutex_unlock (&pool->lock);
+
+  if (next_job != NULL)
+    push_job (pool, next_job);
+
+  worker_job_free (job);
+}
+
+static EksWorkerPool *
+eks_worker_pool_new (void)
+{
+  EksWorkerPool *pool = g_slice_new0 (EksWorkerPool);
+
+  g_mutex_init (&pool->lock);
+  pool->waiting_jobs = g_hash_table_new_full (g_str_hash,
+                                              g_str_equal,
+                                              g_free,
+                                              (GDestroyNotify) waiting_jobs_queue_free);
+
+  /* Jobs are CPU-bound, so there's no use in having more threads than
+   * processors */
+  pool->threads = g_thread_pool_new (run_job,
+                                     pool,
+                                     g_get_num_processors (),
+                                     FALSE,
+                                     NULL);
+
+  return pool;
+}
+
+/**
+ * eks_worker_pool_get_default:
+ *
+ * Returns: (transfer none): the pool shared by the whole process
+ */
+EksWorkerPool *
+eks_worker_pool_get_default (void)
+{
+  static EksWorkerPool *default_pool = NULL;
+
+  if (g_once_init_enter (&default_pool))
+    g_once_init_leave (&default_pool, eks_worker_pool_new ());
+
+  return default_pool;
+}
+
+/**
+ * eks_worker_pool_run:
+ * @pool: the pool
+ * @key: the key to serialize the job with, usually an app ID
+ * @task: the task to run
+ * @func: the function to run @task with
+ *
+ * Runs @func in one of the threads of @pool, once all the jobs previously
+ * given to @pool with the same @key have finished. Like
+ * g_task_run_in_thread(), @func is expected to return a result for @task,
+ * which is then passed to its callback on the main context it was created
+ * in.
+ */
+void
+eks_worker_pool_run (EksWorkerPool   *pool,
+                     const gchar     *key,
+                     GTask           *task,
+                     GTaskThreadFunc  func)
+{
+  WorkerJob *job = g_slice_new0 (WorkerJob);
+  gboolean runnable = FALSE;
+
+  job->key = g_strdup (key);
+  job->task = g_object_ref (task);
+  job->func = func;
+
+  g_mutex_lock (&pool->lock);
+
+  GQueue *queue = g_hash_table_lookup (pool->waiting_jobs, key);
+  if (queue == NULL)
+    {
+      g_hash_table_insert (pool->waiting_jobs, g_strdup (key), g_queue_new ());
+      runnable = TRUE;
+    }
+  else
+    {
+      g_queue_push_tail (queue, job);
+    }
+
+  g_mutex_unlock (&pool->lock);
+
+  if (runnable)
+    push_job (pool, job);
+}
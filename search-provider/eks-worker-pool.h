@@ -0,0 +1,18 @@
+/* Copyright 2018 Endless Mobile, Inc. */
+
+#pragma once
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _EksWorkerPool EksWorkerPool;
+
+EksWorkerPool * eks_worker_pool_get_default (void);
+
+void eks_worker_pool_run (EksWorkerPool   *pool,
+                          const gchar     *key,
+                          GTask           *task,
+                          GTaskThreadFunc  func);
+
+G_END_DECLS